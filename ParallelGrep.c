@@ -28,7 +28,7 @@
  *				INCLUDE 
  ****************************************************************************/
 
-#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE                     /* For memrchr(), madvise()         */
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -40,21 +40,48 @@
 #include <sys/stat.h>                   /* For stat()/lstat() structure     */
 #include <pthread.h>                    /* For pthread_ functions           */ 
 #include <string.h>                     /* For strstr()                     */
-#include <ftw.h>                        /* For ftw()/nftw()                 */
+#include <sys/mman.h>                   /* For mmap()/madvise()/munmap()    */
+#include <stdint.h>                     /* For intptr_t                     */
+#include <limits.h>                     /* For LONG_MAX                     */
+#include <stdatomic.h>                  /* For atomic_int                   */
+#include <sys/uio.h>                    /* For writev()                     */
+#include <errno.h>                      /* For errno                        */
+
+#include "literal-search.h"             /* For literal_search()             */
+#include "aho-corasick.h"               /* For aho_corasick_search()        */
+#include "work-stealing-pool.h"         /* For ws_pool_push()/ws_pool_pop() */
+#include "reorder-buffer.h"             /* For reorder_buffer_put()/take()  */
+#include "arena.h"                      /* For arena_append()               */
+#include "dir-walk.h"                   /* For dir_walk_next()              */
+#include "uring-reader.h"               /* For uring_reader_next()          */
+#include "gzip-reader.h"                /* For gzip_reader_next()           */
+#include "run-stats.h"                  /* For run_stats_span()             */
+#include "match-record.h"               /* For match_record_line()          */
+#include "splice-output.h"              /* For splice_output_write()        */
 
 #define KB             1024             /* 1K                               */
 #define MB             (1024*1024)      /* 1M                               */
-#define LINEBUF        (4*KB) 
-#define THREADSNUM     8 
+#define AUTOFACTOR     4                /* -j auto runs up to 4 threads per CPU */
 #define threshold      2 
-#define MAXFILES       4096 
+#define ORDERWINDOW    4096             /* files in flight ahead of the writer */
+#define QUEUECAPACITY  1024             /* files queued ahead of the work threads */
+#define CHUNKSIZE      (16*MB)          /* the size of a part of a big file found by -r */
+#define URINGMAXFILE   MB               /* bigger files are mapped instead of read with -u */
+#define SLICESIZE      MB               /* searched at once when the search may stop early */
+#define BATCHFILESIZE  (64*KB)          /* smaller files of the args are searched in batches */
+#define BATCHFILES     32               /* at most so many files in a batch */
+#define BATCHBYTES     MB               /* and at most so many bytes */
 
 
 /****************************************************************************
  *                            CONSTANTS                                     *
  ****************************************************************************/
-/* Save the PATTERN */
-const char *targetString_G   = NULL;    //^_^ pointing to the search pattern
+/* Save the PATTERNs from the arguments, -e and -f */
+const char **targetString_G  = NULL;    //^_^ pointing to the search patterns
+size_t      *targetLen_G     = NULL;    //^_^ length of each search pattern
+int          targetNum_G     = 0;       //^_^ number of the search patterns
+aho_corasick_t *targetAC_G   = NULL;    //^_^ searching all patterns at once if more than one
+int          targetEmpty_G   = 0;       //^_^ one of the patterns is empty, so every line matches
 
 /****************************************************************************
  *                           STATIC VARIABLES                               *
@@ -62,32 +89,102 @@ const char *targetString_G   = NULL;    //^_^ pointing to the search pattern
 static int grepDirRec         = 0;  //^_^ recursive flag
 static int useOption          = 0;  //^_^ using -r or not
 static int indexFile          = 0;  //^_^ the index of the args pointing to the file name
-static int finishedGrepSubDir = 0;  //^_^
+static int numFiles           = 0;  //^_^ the number of files and directories in the args
+static int threadsNum         = 0;  //^_^ number of work threads, -j or the number of CPUs
+static int adaptiveThreads    = 0;  //^_^ -j auto, the pool adjusts the active threads
+static int uringDepth         = 0;  //^_^ -u, files read at once by each thread with io_uring
+static int lineNumber         = 0;  //^_^ -n, print the line number of every matched line
+static int listFiles          = 0;  //^_^ -l, print only the names of the files which match
+static int countMatches       = 0;  //^_^ -c, print only the number of matched lines
+static long maxCount          = 0;  //^_^ -m, stop after so many matched lines, 0 for no limit
+static long printedCount      = 0;  //^_^ matched lines written out so far, only by one thread
+static atomic_int cancelled   = 0;  //^_^ -m is reached, the remaining tasks are skipped
+static int showStats          = 0;  //^_^ --stats, print the counters of every thread
+static const char *tracePath  = NULL;  //^_^ --trace, write the spans of every thread here
+static match_format_t offsetFormat = MATCH_TEXT;  //^_^ --offsets, records instead of the lines
+static long nextFileId        = 0;  //^_^ the id of the next file in the records of --offsets
+static long printedPath       = -1; //^_^ the last file whose path record is written out
+static int spliceOutput       = 0;  //^_^ stdout is a pipe, the lines of a big file go by vmsplice()
 
 /****************************************************************************
  *			     PTHREAD DECLARATION			                                      *
  ****************************************************************************/
-pthread_t workThread[THREADSNUM];
-pthread_t workThreadPool[THREADSNUM];
-static pthread_mutex_t  workThreadPoolMux               = PTHREAD_MUTEX_INITIALIZER;
-//static pthread_cond_t   workThreadPoolCond              = PTHREAD_COND_INITIALIZER; 
+pthread_t *workThread     = NULL;   // threadsNum threads for a big file
+pthread_t *workThreadPool = NULL;   // threadsNum, or more with -j auto, for -r
+int        poolThreadsNum = 0;
+pthread_t writerThread;
 
 /****************************************************************************
  *			     STRUCTURE DECLARATION			                                    *
  ****************************************************************************/
-struct task {
-    char *fname;
-    int   outputPath;
-    long  start;
-    long  end;
+struct fileOutput {
+    arena_t   **outputs;    // the output of every part of the file in order
+    int         num;        // the number of parts
+    atomic_int  left;       // the parts which are not finished
+    arena_t    *first;      // outputs points here if there is only one part
+    arena_t   **numbers;    // with -n and several parts, the numbers of every part
+    long       *lines;      // and the lines of every part, see renumber()
+    atomic_long matches;    // the matched lines of all parts, for -c and -l
+    atomic_int  found;      // a part has matched, the others stop with -l
+    char       *fname;      // the file name for -c, -l and --offsets, printed by the writer
+    long        id;         // the id of the file in the records of --offsets
+    struct fileOutput *next;  // the next file of a batch, written out right after
+};
+
+/* Where a part not at the beginning of the file left out the number of a
+ * matched line, its number is only known relative to the part. */
+struct lineMark {
+    size_t      offset;     // the place in the output to insert the number
+    long        line;       // the number of the line inside the part, from 1
 };
 
-struct tasklist {
-    struct task      task;
-    struct tasklist *next;
+struct task {
+    char       *fname;
+    const char *map;        // mapping of the whole file shared by all chunks, or NULL
+    long        size;       // the size of the mapping
+    int         outputPath;
+    long        start;      // first byte to search, see grepFile for lines across it
+    long        end;        // one past the last byte to search
+    long        seq;        // the order of the output among all files
+    arena_t    *output;     // the matched lines are collected here, not printed
+    arena_t    *numbers;    // with -n, the lineMarks of a part which doesn't 
+                            // begin the file, NULL to print the numbers at once
+    long        lines;      // the number of lines in the part, set by grepFile
+    long        lineBase;   // with -n, the lines before the searched buffer, see grepGzip
+    long        id;         // the id of the file in the records of --offsets
+    long        byteBase;   // with --offsets, the bytes before the searched buffer
+    int         ranges;     // save the ranges of the lines in map, see splice-output.c
+    long        matches;    // the number of matched lines, set by grepFile
+    atomic_int *found;      // set when a part of the file matches, or NULL
+    struct fileOutput *file;  // the outputs of all parts of the file for -r
+    int         part;       // the index of this part in file
+    int         fromRing;   // map is a buffer of the io_uring reader, not to munmap()
+    void       *dir;        // a directory to list instead of a file, see dir-walk.c
+    dir_walk_t **walk;      // the walk of dir, in dirWalks
+    struct task *next;      // the next small file of a batch, see grepBatch
+    int         batched;    // a file of a batch, searched whole and handed over with it
 };
 
-struct tasklist *plHead=NULL, *plTail=NULL;
+// Every work thread has its own deque of tasks and steals from the others
+// when its deque is empty, see work-stealing-pool.c.
+ws_pool_t *workPool = NULL;
+
+// The outputs of the tasks are put back into order here and written out 
+// by a single thread, see reorder-buffer.c.
+reorder_buffer_t *outputOrder = NULL;
+
+// Every thread takes its output buffers from its own pool, see arena.c.
+arena_pool_t **arenaPool_G = NULL;
+
+// The directories are listed by the work threads too, see dir-walk.c.
+// There is one walk for every directory in the args, NULL for the files.
+dir_walk_t **dirWalks = NULL;
+int          numWalks = 0;
+
+// The statistics of --stats and --trace, NULL without them, see run-stats.c.
+// The pool threads and the threads of a big file share the slots from 0,
+// then come the writer and the main thread.
+run_stats_t *runStats_G = NULL;
 
 /****************************************************************************
  *				GLOBAL FUNCTIONS			                                            *
@@ -103,148 +200,1250 @@ struct tasklist *plHead=NULL, *plTail=NULL;
 void
 help() 
 {
-    printf ("Usage : grep [option] PATTERN [FILE|DIRECTORY] \n");
+    printf ("Usage : grep [-rnlc] [-m NUM] [-j N|auto] [-u DEPTH] [--offsets binary|json] [--stats] [--trace FILE] [-e PATTERN]... [-f FILE] PATTERN [FILE|DIRECTORY]... \n");
+}
+
+
+/****************************************************************************
+ * function    : addPattern
+ * description : save one more PATTERN.
+ * argument(s) : pattern , the PATTERN, not copied
+ * return      : 
+ ****************************************************************************/
+static void
+addPattern(const char *pattern)
+{
+    targetString_G = realloc(targetString_G, (targetNum_G + 1) * sizeof(char *));
+    targetLen_G    = realloc(targetLen_G, (targetNum_G + 1) * sizeof(size_t));
+    if (targetString_G == NULL || targetLen_G == NULL) {
+        printf("Error: No enough memory for the patterns!\n");
+        exit (0);
+    }
+    targetString_G[targetNum_G] = pattern;
+    targetLen_G[targetNum_G]    = strlen(pattern);
+    if (targetLen_G[targetNum_G] == 0) {
+        targetEmpty_G = 1;
+    }
+    ++targetNum_G;
+}
+
+
+/****************************************************************************
+ * function    : readPatternFile
+ * description : save every line of the file as a PATTERN.
+ * argument(s) : fname , file name
+ * return      : 
+ ****************************************************************************/
+static void
+readPatternFile(const char *fname)
+{
+    FILE   *fp      = NULL;
+    char   *buf     = NULL;
+    size_t  bufSize = 0;
+    ssize_t ret     = 0;
+
+    if ((fp = fopen(fname, "r")) == NULL) {
+        printf("Error: Could not open the pattern file : %s\n", fname);
+        exit (0);
+    }
+    while ((ret = getline(&buf, &bufSize, fp)) != -1) {
+        if (ret > 0 && buf[ret - 1] == '\n') {
+            buf[ret - 1] = '\0';
+        }
+        addPattern(strdup(buf));
+    }
+    free(buf);
+    fclose(fp);
 }
 
 
 /****************************************************************************
  * function    : parseArg 
  * description : split the arguments from command line.
+ *               -r       , search the directories recursively
+ *               -n       , print the line numbers
+ *               -l       , print only the names of the files which match
+ *               -c       , print only the number of matched lines per file
+ *               -m NUM   , stop after NUM matched lines, in total with -r
+ *               -e PAT   , search PAT, could be used many times
+ *               -f FILE  , search every line in FILE 
+ *               -j N     , use N work threads instead of one per CPU
+ *               -j auto  , adjust the number of work threads to the load
+ *               -u DEPTH , with -r, every thread reads up to DEPTH files at
+ *                          once with io_uring if the kernel allows it
+ *               --offsets FORMAT , write binary or json records of the file,
+ *                          offset and length of the matched lines instead
+ *                          of the lines, see match-record.c
+ *               --stats  , print the work and the time of every thread
+ *               --trace FILE , write the spans of every thread into FILE
+ *               PATTERN is taken from the args only without -e and -f.
  * argument(s) : 
  * return      : 
  ****************************************************************************/
 void 
 parseArg(int num, char *string[])
 {
-    //TODO: Does not support the options such as -r, -i. Need to enhance.
-    if ( num < 3) {
+    int i          = 1;
+    int fromOption = 0;
+
+    //TODO: Does not support the options such as -i. Need to enhance.
+    while (i < num && string[i][0] == '-' && string[i][1] != '\0') {
+        if (!strcmp(string[i], "--")) {
+            ++i;
+            break;
+        }
+        if (!strcmp(string[i], "-r")) {
+            useOption      = 1;
+            grepDirRec     = 1;
+        } else if (!strcmp(string[i], "-n")) {
+            lineNumber     = 1;
+        } else if (!strcmp(string[i], "-l")) {
+            listFiles      = 1;
+        } else if (!strcmp(string[i], "-c")) {
+            countMatches   = 1;
+        } else if (!strcmp(string[i], "-m") && i + 1 < num) {
+            ++i;
+            if ((maxCount = atol(string[i])) <= 0) {
+                printf("Error: Incorrect number of matches : %s\n", string[i]);
+                help();
+                exit (0);
+            }
+        } else if (!strcmp(string[i], "-e") && i + 1 < num) {
+            addPattern(string[++i]);
+            fromOption     = 1;
+        } else if (!strcmp(string[i], "-f") && i + 1 < num) {
+            readPatternFile(string[++i]);
+            fromOption     = 1;
+        } else if (!strcmp(string[i], "-j") && i + 1 < num) {
+            ++i;
+            if (!strcmp(string[i], "auto")) {
+                adaptiveThreads = 1;
+            } else if ((threadsNum = atoi(string[i])) <= 0) {
+                printf("Error: Incorrect number of threads : %s\n", string[i]);
+                help();
+                exit (0);
+            }
+        } else if (!strcmp(string[i], "-u") && i + 1 < num) {
+            ++i;
+            if ((uringDepth = atoi(string[i])) <= 0) {
+                printf("Error: Incorrect depth : %s\n", string[i]);
+                help();
+                exit (0);
+            }
+        } else if (!strcmp(string[i], "--offsets") && i + 1 < num) {
+            ++i;
+            if (!match_format_parse(string[i], &offsetFormat)) {
+                printf("Error: Incorrect format of the records : %s\n", string[i]);
+                help();
+                exit (0);
+            }
+        } else if (!strcmp(string[i], "--stats")) {
+            showStats      = 1;
+        } else if (!strcmp(string[i], "--trace") && i + 1 < num) {
+            tracePath      = string[++i];
+        } else {
+            break;
+        }
+        ++i;
+    }
+
+    if (fromOption == 0 && i < num) {
+        addPattern(string[i++]);
+    }
+    if (i >= num || (fromOption == 0 && targetNum_G == 0)) {
         printf("Error: Incorrect arguments!\n");
         help();
         exit (0);
     }
+    // The search destinations are from here to the end.
+    indexFile = i;
+    numFiles  = num - i;
+
+    // No line is printed with -l or -c.
+    if (listFiles != 0 || countMatches != 0) {
+        lineNumber = 0;
+    }
+    // The records tell where the lines are, not their numbers.
+    if (offsetFormat != MATCH_TEXT && (lineNumber != 0 || listFiles != 0 || countMatches != 0)) {
+        printf("Error: --offsets can't be used with -n, -l or -c!\n");
+        help();
+        exit (0);
+    }
+
+    // One thread per CPU we may run on by default.
+    if (threadsNum == 0) {
+        threadsNum = ws_pool_num_cpus();
+    }
+    poolThreadsNum = adaptiveThreads ? AUTOFACTOR * threadsNum : threadsNum;
+
+    // All patterns are searched in one pass by a single automaton.
+    if (targetNum_G != 1) {
+        targetAC_G = aho_corasick_build(targetString_G, targetLen_G, targetNum_G);
+    }
+}
+
+
+/****************************************************************************
+ * function    : findPattern
+ * description : find the first PATTERN in the buffer.
+ * argument(s) : buf , the buffer, doesn't need to be NUL terminated
+ *               len , the length of the buffer
+ * return      : the beginning of the first PATTERN found, or NULL
+ ****************************************************************************/
+static const char *
+findPattern(const char *buf, size_t len)
+{
+    if (targetNum_G == 1) {
+        return literal_search(buf, len, targetString_G[0], targetLen_G[0]);
+    }
+    // An empty pattern matches every line, the automaton ignores it.
+    if (targetEmpty_G == 1) {
+        return buf;
+    }
+    return aho_corasick_search(targetAC_G, buf, len, NULL);
+}
+
+
+/****************************************************************************
+ * function    : formatNumber
+ * description : write the decimal digits of a line number and a ':'.
+ * argument(s) : dst , where to write, at least 22 bytes
+ *               num , the number
+ * return      : the number of bytes written
+ ****************************************************************************/
+static size_t
+formatNumber(char *dst, long num)
+{
+    char   digits[20];
+    size_t len = 0;
+    size_t i   = 0;
+
+    do {
+        digits[len++] = '0' + num % 10;
+        num /= 10;
+    } while (num > 0);
+    for (i = 0; i < len; i++) {
+        dst[i] = digits[len - 1 - i];
+    }
+    dst[len] = ':';
+    return len + 1;
+}
+
+
+/****************************************************************************
+ * function    : printLine
+ * description : save one matched line into the output of the task. The line
+ *               is not NUL terminated and doesn't include the '\n', which is
+ *               appended here. Nothing is printed until the output is
+ *               written out by writeOutput(), so no lock is needed.
+ *               With -n, a part which doesn't begin the file only marks
+ *               where the number goes, it is inserted by renumber().
+ *               With -l and -c the line is only counted, with --offsets
+ *               only its record is saved, and for vmsplice() only its range
+ *               in the mapping.
+ * argument(s) : file   , the task, with the file name, the output and the
+ *                        outputPath flag, 1 (print the path) or 0 (don't)
+ *               line   , the beginning of the line
+ *               len    , the length of the line without '\n'
+ *               num    , the number of the line inside the part, from 1,
+ *                        after the lineBase lines of the task
+ *               offset , the offset of the line in the searched buffer,
+ *                        after the byteBase bytes of the task
+ * return      : NULL
+ ****************************************************************************/
+static void
+printLine(struct task *file, const char *line, size_t len, long num, long offset)
+{
+    struct lineMark mark;
+
+    ++file->matches;
+    if (listFiles != 0 || countMatches != 0) {
+        if (file->found != NULL) {
+            atomic_store(file->found, 1);
+        }
+        return;
+    }
+    if (offsetFormat != MATCH_TEXT) {
+        match_record_line(file->output, offsetFormat, file->id, file->byteBase + offset, len);
+        return;
+    }
+    if (file->ranges != 0) {
+        splice_output_add(file->output, offset, len + 1);
+        return;
+    }
+    if (file->outputPath != 0) {
+        arena_append(file->output, file->fname, strlen(file->fname));
+        arena_append(file->output, ":", 1);
+    }
+    if (lineNumber != 0 && file->numbers != NULL) {
+        mark.offset = arena_len(file->output);
+        mark.line   = num;
+        arena_append(file->numbers, (const char *)&mark, sizeof(mark));
+    } else if (lineNumber != 0) {
+        arena_commit(file->output, formatNumber(arena_reserve(file->output, 22), file->lineBase + num));
+    }
+    arena_append(file->output, line, len);
+    arena_append(file->output, "\n", 1);
+}
+
+
+/****************************************************************************
+ * function    : writeOutput
+ * description : write out the outputs of several tasks to stdout with as
+ *               few system calls as possible, and give them back to their
+ *               pools. Only one thread writes at a time, so the outputs 
+ *               are never mixed.
+ * argument(s) : outputs , the outputs in order
+ *               num     , the number of outputs
+ * return      : NULL
+ ****************************************************************************/
+static void
+writeOutput(arena_t **outputs, int num)
+{
+    struct iovec iov[num];
+    int          first = 0;
+    int          i     = 0;
+    ssize_t      ret   = 0;
+    long         total = 0;
+    uint64_t     start = run_stats_now(runStats_G);
+
+    for (i = 0; i < num; i++) {
+        iov[i].iov_base = (void *)arena_data(outputs[i]);
+        iov[i].iov_len  = arena_len(outputs[i]);
+        total          += iov[i].iov_len;
+    }
+    if (total > 0) {
+        run_stats_output(runStats_G);
+    }
+    while (first < num) {
+        ret = writev(STDOUT_FILENO, iov + first, num - first);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        // Skip what has been written, writev() may stop in the middle.
+        while (first < num && (size_t)ret >= iov[first].iov_len) {
+            ret -= iov[first].iov_len;
+            ++first;
+        }
+        if (first < num) {
+            iov[first].iov_base = (char *)iov[first].iov_base + ret;
+            iov[first].iov_len -= ret;
+        }
+    }
+    for (i = 0; i < num; i++) {
+        arena_release(outputs[i]);
+    }
+    if (total > 0) {
+        run_stats_span(runStats_G, RUN_PRINT, start, total);
+    }
+}
+
+
+/****************************************************************************
+ * function    : writeRanges
+ * description : write out the matched lines of the parts of a big file by
+ *               their ranges in the mapping, like writeOutput(). The lines
+ *               go into the pipe with vmsplice() without being copied.
+ * argument(s) : outputs , the ranges of the parts in order
+ *               num     , the number of parts
+ *               map     , the mapping of the file, kept until the end
+ *               size    , the size of the mapping
+ * return      : NULL
+ ****************************************************************************/
+static void
+writeRanges(arena_t **outputs, int num, const char *map, long size)
+{
+    int          i     = 0;
+    long         total = 0;
+    ssize_t      ret   = 0;
+    uint64_t     start = run_stats_now(runStats_G);
+
+    for (i = 0; i < num; i++) {
+        if ((ret = splice_output_write(STDOUT_FILENO, map, size, outputs[i])) > 0) {
+            total += ret;
+        }
+        arena_release(outputs[i]);
+    }
+    if (total > 0) {
+        run_stats_output(runStats_G);
+        run_stats_span(runStats_G, RUN_PRINT, start, total);
+    }
+}
+
+
+/****************************************************************************
+ * function    : writeMatches
+ * description : write out the outputs of a file like writeOutput(). With
+ *               --offsets the path record of the file goes before its
+ *               first records, in the same system call.
+ * argument(s) : outputs , the outputs in order
+ *               num     , the number of outputs
+ *               id      , the id of the file
+ *               fname   , the file name
+ * return      : NULL
+ ****************************************************************************/
+static void
+writeMatches(arena_t **outputs, int num, long id, const char *fname)
+{
+    arena_t *all[num + 1];
+    size_t   total = 0;
+    int      i     = 0;
+
+    for (i = 0; i < num; i++) {
+        total += arena_len(outputs[i]);
+    }
+    if (offsetFormat == MATCH_TEXT || total == 0 || id == printedPath) {
+        writeOutput(outputs, num);
+        return;
+    }
+    all[0] = arena_get(arenaPool_G[0]);
+    match_record_path(all[0], offsetFormat, id, fname);
+    memcpy(all + 1, outputs, num * sizeof(arena_t *));
+    writeOutput(all, num + 1);
+    printedPath = id;
+}
+
+
+/****************************************************************************
+ * function    : renumber
+ * description : insert the line numbers into the output of a part which 
+ *               doesn't begin the file, once the number of lines in all 
+ *               the parts before it is known. The output is copied into a
+ *               new arena, the old one is released.
+ * argument(s) : output  , the output of the part
+ *               numbers , the lineMarks of the part, released too
+ *               base    , the number of the first line of the part
+ * return      : the output with the line numbers
+ ****************************************************************************/
+static arena_t *
+renumber(arena_t *output, arena_t *numbers, long base)
+{
+    const struct lineMark *marks = (const struct lineMark *)arena_data(numbers);
+    size_t       num    = arena_len(numbers) / sizeof(struct lineMark);
+    const char  *data   = arena_data(output);
+    arena_t     *result = NULL;
+    size_t       done   = 0;
+    size_t       i      = 0;
+
+    if (num == 0) {
+        arena_release(numbers);
+        return output;
+    }
+    result = arena_get(arenaPool_G[0]);
+    for (i = 0; i < num; i++) {
+        arena_append(result, data + done, marks[i].offset - done);
+        arena_commit(result, formatNumber(arena_reserve(result, 22), base + marks[i].line - 1));
+        done = marks[i].offset;
+    }
+    arena_append(result, data + done, arena_len(output) - done);
+    arena_release(output);
+    arena_release(numbers);
+    return result;
+}
+
+
+/****************************************************************************
+ * function    : cancelSearch
+ * description : stop all the searches once -m is reached. The tasks left
+ *               are skipped and the directory walk reads no more directory.
+ * argument(s) : 
+ * return      : 
+ ****************************************************************************/
+static void
+cancelSearch()
+{
+    int i = 0;
+
+    atomic_store(&cancelled, 1);
+    for (i = 0; i < numWalks; i++) {
+        if (dirWalks[i] != NULL) {
+            dir_walk_stop(dirWalks[i]);
+        }
+    }
+}
+
+
+/****************************************************************************
+ * function    : limitOutput
+ * description : cut the outputs after the matched lines allowed by -m, 
+ *               and cancel the search when there are enough. Called only
+ *               by the thread writing out, in the order of the output.
+ * argument(s) : outputs , the outputs in order, one matched line per '\n',
+ *                         or the records of --offsets
+ *               num     , the number of outputs
+ * return      : 
+ ****************************************************************************/
+static void
+limitOutput(arena_t **outputs, int num)
+{
+    const char *data  = NULL;
+    long        left  = 0;
+    long        lines = 0;
+    int         i     = 0;
+
+    for (i = 0; i < num && maxCount != 0; i++) {
+        left  = maxCount - printedCount;
+        data  = arena_data(outputs[i]);
+        lines = match_record_count(offsetFormat, data, arena_len(outputs[i]));
+        if (lines < left) {
+            printedCount += lines;
+            continue;
+        }
+        // Keep the first left lines, nothing after them.
+        arena_truncate(outputs[i], match_record_keep(offsetFormat, data, arena_len(outputs[i]), left));
+        for (++i; i < num; i++) {
+            arena_truncate(outputs[i], 0);
+        }
+        printedCount = maxCount;
+        cancelSearch();
+    }
+}
+
+
+/****************************************************************************
+ * function    : printSummary
+ * description : save the line of -l or -c for a file into an output: the
+ *               file name if it matches, or the number of matched lines.
+ *               -m caps the number, counted over all the files. Called
+ *               only by the thread writing out, in the order of the output.
+ * argument(s) : output     , where to save the line
+ *               fname      , the file name
+ *               outputPath , 1 (print the path) or 0 (don't), for -c
+ *               matches    , the number of matched lines found in the file
+ * return      : 
+ ****************************************************************************/
+static void
+printSummary(arena_t *output, const char *fname, int outputPath, long matches)
+{
+    char   num[22];
+    size_t len = 0;
+
+    if (listFiles != 0 && matches > 1) {
+        matches = 1;
+    }
+    if (maxCount != 0) {
+        if (printedCount >= maxCount) {
+            return;
+        }
+        if (matches >= maxCount - printedCount) {
+            matches = maxCount - printedCount;
+            cancelSearch();
+        }
+        printedCount += matches;
+    }
+    if (listFiles != 0) {
+        if (matches > 0) {
+            arena_append(output, fname, strlen(fname));
+            arena_append(output, "\n", 1);
+        }
+        return;
+    }
+    if (outputPath != 0) {
+        arena_append(output, fname, strlen(fname));
+        arena_append(output, ":", 1);
+    }
+    len = formatNumber(num, matches);
+    num[len - 1] = '\n';
+    arena_append(output, num, len);
+}
+
 
-    //TODO: Hardcode now, will enhance in the future for usability. 
-    if (!strcmp(string[1],"-r")) {
-        useOption          = 1;
-        grepDirRec         = 1;
-        indexFile          = 3;
-        targetString_G     = string[2];
+/****************************************************************************
+ * function    : writeTask
+ * description : write out the output of a file searched as a whole by the
+ *               main thread, or only its line of -l or -c.
+ * argument(s) : file , the task after grepFile()
+ * return      : 
+ ****************************************************************************/
+static void
+writeTask(struct task *file)
+{
+    if (listFiles != 0 || countMatches != 0) {
+        printSummary(file->output, file->fname, file->outputPath, file->matches);
     } else {
-        useOption          = 0;
-        grepDirRec         = 0;
-        // The search destination is from the argv[2] since the argv[0] and argv[1] are program name and target string.
-        indexFile          = 2;
-        targetString_G     = string[1];
+        limitOutput(&file->output, 1);
+    }
+    writeMatches(&file->output, 1, file->id, file->fname);
+}
+
+
+/****************************************************************************
+ * function    : stopSearch
+ * description : tell whether a task may stop searching: -m is reached, or
+ *               with -l the file matches already, or with -m the part has
+ *               found as many lines as could ever be printed.
+ * argument(s) : file , the task
+ * return      : 1 to stop, 0 to go on
+ ****************************************************************************/
+static int
+stopSearch(struct task *file)
+{
+    if (atomic_load(&cancelled) != 0) {
+        return 1;
+    }
+    if (listFiles != 0) {
+        return file->matches > 0 || (file->found != NULL && atomic_load(file->found) != 0);
+    }
+    return maxCount != 0 && file->matches >= maxCount;
+}
+
+
+/****************************************************************************
+ * function    : grepMap
+ * description : search the PATTERN in place inside the mapping of a file.
+ *               Nothing is copied and the whole part is scanned for the 
+ *               PATTERNs at once by findPattern(). Only 
+ *               when there is a hit the line around it is looked for, so
+ *               most of the bytes are touched only once.
+ * argument(s) : file       , the task the output is saved into
+ *               map        , the mapping of the whole file
+ *               start      , the location to begin search, beginning of a line
+ *               end        , one past the location to end search
+ *               With -n, the lines are counted up to every matched line
+ *               and the count of the whole part is saved into the task.
+ *               With -l and -m the part is searched SLICESIZE at a time,
+ *               thus it stops soon after stopSearch() tells so.
+ * return      : NULL
+ ****************************************************************************/
+static void
+grepMap(struct task *file, const char *map, long start, long end)
+{
+    const char *line    = map + start;
+    const char *stop    = map + end;
+    const char *hit     = NULL;
+    const char *bol     = NULL;
+    const char *eol     = NULL;
+    const char *counted = line;     // the lines before it are counted
+    const char *slice   = stop;     // the end of what is searched at once
+    long        num     = 1;        // the number of the line at counted
+
+    while (line < stop && stopSearch(file) == 0) {
+        if ((listFiles != 0 || maxCount != 0) && stop - line > SLICESIZE) {
+            slice = line + SLICESIZE;
+        } else {
+            slice = stop;
+        }
+        hit = findPattern(line, slice - line);
+        if (hit == NULL && slice < stop) {
+            // Go on from the beginning of the last line in the slice, a 
+            // PATTERN may be cut by the end of the slice.
+            if ((eol = memrchr(line, '\n', slice - line)) != NULL) {
+                line = eol + 1;
+                continue;
+            }
+            hit = findPattern(line, stop - line);
+        }
+        if (hit == NULL) {
+            break;
+        }
+        // line is always the beginning of a line, so the matched line 
+        // begins after the last '\n' between it and the hit.
+        bol = memrchr(line, '\n', hit - line);
+        bol = (bol == NULL) ? line : bol + 1;
+        eol = memchr(hit, '\n', stop - hit);
+        if (eol == NULL) {
+            // The last line of the file may have no '\n'.
+            eol = stop;
+        }
+        if (lineNumber != 0) {
+            num    += literal_count(counted, bol - counted, '\n');
+            counted = bol;
+        }
+        printLine(file, bol, eol - bol, num, bol - map);
+        line = eol + 1;
+    }
+    if (lineNumber != 0) {
+        file->lines = num - 1 + literal_count(counted, stop - counted, '\n');
+    }
+}
+
+
+/****************************************************************************
+ * function    : grepStream
+ * description : search the PATTERN by reading the file line by line. 
+ *               Only used for the files which can't be mapped, such as pipes.
+ * argument(s) : a structure same as grepFile.
+ * return      : NULL 
+ ****************************************************************************/
+static void
+grepStream(struct task *file)
+{
+    FILE   *fp_status;
+    char   *buf      = NULL;
+    size_t  bufSize  = 0;
+    ssize_t ret      = 0;
+    long    leftSize = file->end - file->start;
+    long    num      = 0;
+    long    offset   = 0;
+
+    if(!(fp_status = fopen(file->fname, "r"))) {
+	    printf("Error: File open failed : %s\n", file->fname);
+        return;
+    }
+    
+    // Starting from the first line beginning at or after the specified point,
+    // the line across it belongs to the former part.
+    if (file->start != 0) {
+        if (fseek(fp_status, file->start - 1, SEEK_SET) != 0 ||
+            (ret = getline(&buf, &bufSize, fp_status)) <= 0) {
+            free(buf);
+            fclose(fp_status);
+            return;
+        }
+        leftSize -= ret - 1;
     }
+
+    // getline() reads the whole line whatever its length, thus the leftSize
+    // is always decreased by the real size of the line.
+    // The line begins where the leftSize bytes before the end begin.
+    while (leftSize > 0 && stopSearch(file) == 0 &&
+           (ret = getline(&buf, &bufSize, fp_status)) > 0) {
+        offset    = file->end - leftSize;
+        leftSize -= ret;
+        ++num;
+        if (buf[ret - 1] == '\n') {
+            --ret;
+        }
+        if (findPattern(buf, ret) != NULL) {
+            printLine(file, buf, ret, num, offset);
+        }
+    }
+    file->lines = num;
+    free(buf);
+    fclose(fp_status);
+}
+
+
+/****************************************************************************
+ * function    : grepGzip
+ * description : search the PATTERN in a gzip file. The file is inflated
+ *               ahead by the threads of a gzip reader while the lines 
+ *               already inflated are searched, see gzip-reader.c. A file
+ *               found by -r gets one such thread, the others run in the
+ *               pool already. A file searched by the main thread gets 
+ *               threadsNum of them, and its output is written out after
+ *               every block, since the inflated file may be huge.
+ * argument(s) : file , the task, searched as a whole
+ *               map  , the mapping of the compressed file
+ *               size , the size of the mapping
+ * return      : 
+ ****************************************************************************/
+static void
+grepGzip(struct task *file, const char *map, long size)
+{
+    gzip_reader_t *reader = NULL;
+    const char    *buf    = NULL;
+    size_t         len    = 0;
+    long           lines  = 0;
+    long           bytes  = 0;
+    int            alone  = (file->file == NULL);
+
+    reader = gzip_reader_new(map, size, alone ? threadsNum : 1);
+    while (stopSearch(file) == 0 && (buf = gzip_reader_next(reader, &len)) != NULL) {
+        uint64_t clock = run_stats_now(runStats_G);
+        file->lineBase = lines;
+        file->byteBase = bytes;
+        grepMap(file, buf, 0, len);
+        bytes += len;
+        run_stats_span(runStats_G, RUN_MATCH, clock, len);
+        run_stats_count(runStats_G, len, 0, 1, 0);
+        if (lineNumber != 0) {
+            lines += file->lines;
+        }
+        if (alone && listFiles == 0 && countMatches == 0 && arena_len(file->output) > 0) {
+            limitOutput(&file->output, 1);
+            writeMatches(&file->output, 1, file->id, file->fname);
+            file->output = arena_get(arenaPool_G[0]);
+        }
+    }
+    if (gzip_reader_failed(reader)) {
+        printf("Error: Invalid compressed data : %s\n", file->fname);
+    }
+    gzip_reader_free(reader);
+    file->lines    = lines;
+    file->lineBase = 0;
+    file->byteBase = 0;
+}
+
+
+/****************************************************************************
+ * function    : mapFile
+ * description : map the whole file read-only and tell the kernel that it is
+ *               going to be read sequentially.
+ * argument(s) : fname , file name
+ *               size  , returns the size of the file
+ * return      : the mapping, or NULL if the file can't be mapped.
+ *               The caller should munmap() it with the returned size.
+ ****************************************************************************/
+static char *
+mapFile(const char *fname, long *size)
+{
+    struct stat info;
+    char  *map = NULL;
+    int    fd  = -1;
+
+    if ((fd = open(fname, O_RDONLY)) == -1) {
+        return NULL;
+    }
+    if (fstat(fd, &info) == -1 || !S_ISREG(info.st_mode) || info.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping keeps a reference to the file, so the fd isn't needed anymore.
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    madvise(map, info.st_size, MADV_SEQUENTIAL);
+
+    *size = info.st_size;
+    return map;
 }
 
+
 /****************************************************************************
  * function    : grepFile
- * description : search the PATTERN in the specified file and print out the results.
- * argument(s) : a structure with four elements.
+ * description : search the PATTERN in the specified file and save the results
+ *               into the output of the task.
+ * argument(s) : a structure, the elements used are
  *               fname ,  file name
+ *               map   ,  the mapping of the whole file shared by the threads 
+ *                        searching the same file. If it is NULL, the file is
+ *                        mapped by itself.
+ *               size  ,  the size of the mapping
  *               start ,  the location to begin search. For sequential algorithm, 
  *                        start point is zero.
- *               end   ,  the location to end search. For sequential algorithm,
- *                        this is the size of the file.
+ *               end   ,  one past the location to end search. For sequential 
+ *                        algorithm, this is the size of the file.
+ *                        The part owns the lines beginning between start and
+ *                        end, so start and end don't need to be at the 
+ *                        beginning of a line.
  *               outputPath  ,  1 (print the path) or 0 ( don't print the path)         
+ *               output,  the buffer the matched lines are saved into
+ *               A whole file compressed by gzip is searched by grepGzip().
  * return      : NULL 
  ****************************************************************************/
 void* 
 grepFile(void *arg) {
     struct task *file = arg;
-    FILE *fp_status;
-    char  buf[LINEBUF];
-    long  ret = 0;
-    long  totalSize = file->end - file->start;
-    long  leftSize  = totalSize;
-
-    if(!(fp_status = fopen(file->fname, "r"))) {
-	    printf("Error: File open failed : %s\n", file->fname);
+    const char *map  = file->map;
+    const char *eol  = NULL;
+    char  *own  = NULL;
+    long   size = file->size;
+    long   start;
+    long   end;
+    long   pageStart;
+    uint64_t clock = run_stats_now(runStats_G);
+
+    file->lines   = 0;
+    file->matches = 0;
+    if (file->start >= file->end || atomic_load(&cancelled) != 0) {
         return NULL;
     }
-    
-    // Starting from the specified point.
-    if (fseek(fp_status, file->start, SEEK_SET) != 0) {
-        fclose(fp_status);
+
+    if (map == NULL) {
+        if ((own = mapFile(file->fname, &size)) == NULL) {
+            grepStream(file);
+            run_stats_span(runStats_G, RUN_MATCH, clock, -1);
+            run_stats_count(runStats_G, 0, file->start == 0, 1, file->matches);
+            return NULL;
+        }
+        map = own;
+        run_stats_span(runStats_G, RUN_READ, clock, size);
+    }
+    if (file->start == 0 && file->end >= size && gzip_reader_is_gzip(map, size)) {
+        grepGzip(file, map, size);
+        run_stats_count(runStats_G, 0, 1, 0, file->matches);
+        if (own != NULL) {
+            munmap(own, size);
+        }
         return NULL;
     }
-
-    while (leftSize > 0 && fgets(buf, LINEBUF, fp_status)) {
-        if (strstr(buf, targetString_G) != NULL) {
-            if ( file->outputPath == 0 ) {
-                printf("%s", buf);
-            } else {
-                printf("%s:%s", file->fname, buf);
-            }
-        } 
-        ret = strlen(buf);
-        leftSize -= ret;
+    // The file may be truncated after stat().
+    start = file->start < size ? file->start : size;
+    end   = file->end < size ? file->end : size;
+    // Move both ends to the beginning of the next line, unless they are
+    // there already, thus a line across two parts is searched only once.
+    if (start > 0) {
+        eol   = memchr(map + start - 1, '\n', size - start + 1);
+        start = (eol == NULL) ? size : eol - map + 1;
+    }
+    if (end > 0 && end < size) {
+        eol   = memchr(map + end - 1, '\n', size - end + 1);
+        end   = (eol == NULL) ? size : eol - map + 1;
+    }
+    if (start < end && (start > 0 || end < size)) {
+        // Start reading ahead our own part so that all parts of the file
+        // are loaded at the same time. madvise() needs a page aligned address.
+        pageStart = start & ~(sysconf(_SC_PAGESIZE) - 1);
+        madvise((char *)map + pageStart, end - pageStart, MADV_WILLNEED);
+    }
+    if (start < end) {
+        clock = run_stats_now(runStats_G);
+        grepMap(file, map, start, end);
+        run_stats_span(runStats_G, RUN_MATCH, clock, end - start);
+    }
+    run_stats_count(runStats_G, start < end ? end - start : 0, file->start == 0, 1, file->matches);
+    if (own != NULL) {
+        munmap(own, size);
     }
-    fclose(fp_status);
 
 	return NULL;
 }
 
 
+/****************************************************************************
+ * function    : splitFile
+ * description : map a file found by the directory walk, and divide it into
+ *               parts of CHUNKSIZE if it is big, so that the threads search
+ *               it together. A gzip file can only be searched as a whole.
+ *               The first part stays in the task, the others are added
+ *               into the pool. All parts share one fileOutput, thus the
+ *               outputs are written out together in order.
+ * argument(s) : task , the task of the whole file
+ * return      : 
+ ****************************************************************************/
+static void
+splitFile(struct task *task)
+{
+    struct fileOutput *file = NULL;
+    struct task       *part = NULL;
+    char  *map  = NULL;
+    long   size = 0;
+    int    num  = 1;
+    int    i    = 0;
+    uint64_t clock = run_stats_now(runStats_G);
+
+    // A file read by the io_uring reader is in memory already, and one
+    // which won't be searched after -m is reached isn't even mapped.
+    if (task->map == NULL && atomic_load(&cancelled) == 0 &&
+        (map = mapFile(task->fname, &size)) != NULL) {
+        task->map  = map;
+        task->size = size;
+        run_stats_span(runStats_G, RUN_READ, clock, size);
+    }
+    if (task->map != NULL) {
+        size       = task->size;
+        task->end  = size;
+        num        = (size + CHUNKSIZE - 1) / CHUNKSIZE;
+        if (gzip_reader_is_gzip(task->map, size) || task->batched != 0) {
+            num = 1;
+        }
+    }
+    if (num < 1) {
+        num = 1;
+    }
+
+    file = (struct fileOutput *) calloc (1, sizeof(struct fileOutput));
+    if (file == NULL || (num > 1 && 
+        (file->outputs = malloc(num * sizeof(arena_t *))) == NULL)) {
+        printf("Error: No enough memory for the output!\n");
+        exit (0);
+    }
+    if (num == 1) {
+        file->outputs = &file->first;
+    } else if (lineNumber != 0) {
+        // The parts after the first one are renumbered by the writer.
+        file->numbers = malloc(num * sizeof(arena_t *));
+        file->lines   = malloc(num * sizeof(long));
+        if (file->numbers == NULL || file->lines == NULL) {
+            printf("Error: No enough memory for the output!\n");
+            exit (0);
+        }
+    }
+    file->num = num;
+    atomic_init(&file->left, num);
+    atomic_init(&file->matches, 0);
+    atomic_init(&file->found, 0);
+    file->id    = task->id;
+    task->file  = file;
+    task->part  = 0;
+    task->found = &file->found;
+
+    for (i = 1; i < num; i++) {
+        part = (struct task *) malloc (sizeof(struct task));
+        if (part == NULL) {
+            printf("Error: No enough memory for the tasks!\n");
+            exit (0);
+        }
+        *part       = *task;
+        part->fname = strdup(task->fname);
+        part->map   = NULL;    // mapped again by the thread searching it
+        part->size  = 0;
+        part->fromRing = 0;
+        part->start = (long)i * CHUNKSIZE;
+        part->end   = (i == num - 1) ? size : (long)(i + 1) * CHUNKSIZE;
+        part->part  = i;
+        run_stats_queue(runStats_G, 1);
+        ws_pool_push(workPool, part);
+    }
+    if (num > 1) {
+        task->end = CHUNKSIZE;
+    }
+}
+
+
+/****************************************************************************
+ * function    : grepPart
+ * description : search a file or a part of a file found by the directory 
+ *               walk. The thread finishing the last part of a file hands 
+ *               the outputs of the file to the writer thread.
+ * argument(s) : task , the file or the part
+ *               id   , the index of the work thread
+ * return      : 
+ ****************************************************************************/
+static void
+grepPart(struct task *task, int id)
+{
+    struct fileOutput *file = NULL;
+
+    if (task->file == NULL) {
+        splitFile(task);
+    }
+    file          = task->file;
+    task->output  = arena_get(arenaPool_G[id]);
+    task->numbers = (file->numbers != NULL && task->part > 0) ? arena_get(arenaPool_G[id]) : NULL;
+    grepFile((void *)task);
+    if (task->map != NULL && task->fromRing == 0) {
+        munmap((char *)task->map, task->size);
+    }
+
+    file->outputs[task->part] = task->output;
+    if (file->numbers != NULL) {
+        file->numbers[task->part] = task->numbers;
+        file->lines[task->part]   = task->lines;
+    }
+    atomic_fetch_add(&file->matches, task->matches);
+    if (atomic_fetch_sub(&file->left, 1) == 1) {
+        // The writer prints the name for -l, -c and --offsets, it keeps the copy.
+        if (listFiles != 0 || countMatches != 0 || offsetFormat != MATCH_TEXT) {
+            file->fname = task->fname;
+            task->fname = NULL;
+        }
+        // The files of a batch are handed over together by grepBatch().
+        if (task->batched == 0) {
+            uint64_t clock = run_stats_now(runStats_G);
+            reorder_buffer_put(outputOrder, task->seq, file);
+            run_stats_span(runStats_G, RUN_HANDOFF, clock, task->seq);
+        }
+    }
+}
+
+
+/****************************************************************************
+ * function    : grepBatch
+ * description : search the small files of a batch one after another, and
+ *               hand their outputs to the writer together, chained in the
+ *               order of the args, so the batch takes a single place in
+ *               the order of the output.
+ * argument(s) : batch , the first file of the batch, the others follow
+ *                       by next. The caller frees it like a single task.
+ *               id    , the index of the work thread
+ * return      : 
+ ****************************************************************************/
+static void
+grepBatch(struct task *batch, int id)
+{
+    struct task        *task  = batch;
+    struct task        *next  = NULL;
+    struct fileOutput  *first = NULL;
+    struct fileOutput **last  = &first;
+    uint64_t            clock = 0;
+
+    for (; task != NULL; task = next) {
+        next = task->next;
+        grepPart(task, id);
+        *last = task->file;
+        last  = &task->file->next;
+        if (task != batch) {
+            free(task->fname);
+            free(task);
+        }
+    }
+    clock = run_stats_now(runStats_G);
+    reorder_buffer_put(outputOrder, batch->seq, first);
+    run_stats_span(runStats_G, RUN_HANDOFF, clock, batch->seq);
+}
+
+
 /****************************************************************************
  * function    : workThreadPoolFun
  * description : The work thread from thread pool. 
- *               Retrieve the file from free list and grep.Exit when no any available task in the list.
- * argument(s) : Needn't
+ *               Retrieve the file or the directory from its own deque, or 
+ *               steal one from the other threads, and grep or list it.
+ *               With -u the whole files are queued into the io_uring 
+ *               reader of the thread instead, and searched once the 
+ *               reader has read a batch of them.
+ *               The output is handed to the writer thread. Exit when no 
+ *               any available task.
+ * argument(s) : the index of the thread in the pool
  * return      : NULL
  ****************************************************************************/
 void*
 workThreadPoolFun(void *arg)
 {
-    struct tasklist *plTmp = NULL;
+    int             id   = (int)(intptr_t)arg;
+    struct task    *task = NULL;
+    uring_reader_t *ring = NULL;
+    const char     *buf  = NULL;
+    size_t          len  = 0;
+    char            name[32];
+    uint64_t        clock = 0;
+    uint64_t        idleSince = 0;   // the time the thread ran out of tasks
+    int             idle = 0;
+
+    // NULL without -u, or if io_uring can't be used, then read as usual.
+    ring = uring_reader_new(uringDepth, URINGMAXFILE);
+    snprintf(name, sizeof(name), "worker %d", id);
+    run_stats_thread(runStats_G, id, name);
 
     while (1) {
-        pthread_mutex_lock(&workThreadPoolMux);
-		    // TODO: Awake by a signal from main thread to avoid "while" loop 
-		    //       in order to save the CPU resources.
-        //pthread_cond_wait(&workThreadPoolCond, &workThreadPoolMux);
-        if (plHead != NULL && plHead->next != NULL) {
-           // Get task from the tail of the list.
-           if (plHead->next == plTail) {
-                plTmp        = plTail;
-                plTail       = plHead;
-                plTail->next = NULL;
+        task  = NULL;
+        clock = run_stats_now(runStats_G);
+        if (ring == NULL || !uring_reader_full(ring)) {
+            task = ws_pool_pop(workPool, id);
+        }
+        // The idle time ends with a task, or with the search.
+        if (idle != 0 && (task != NULL || (ring != NULL && !uring_reader_empty(ring)) ||
+                          ws_pool_finished(workPool))) {
+            run_stats_span(runStats_G, RUN_IDLE, idleSince, -1);
+            idle = 0;
+        }
+        if (task != NULL) {
+            run_stats_queue(runStats_G, -1);
+            run_stats_span(runStats_G, RUN_DEQUEUE, clock, task->dir != NULL ? -1 : task->seq);
+            if (task->dir != NULL) {
+                clock = run_stats_now(runStats_G);
+                dir_walk_list(*task->walk, task->dir);
+                run_stats_span(runStats_G, RUN_LIST, clock, -1);
+            } else if (task->next != NULL) {
+                grepBatch(task, id);
+            } else if (ring != NULL && task->file == NULL && atomic_load(&cancelled) == 0) {
+                // Read together with the next files, searched later.
+                uring_reader_add(ring, task->fname, task);
+                continue;
             } else {
-                plTmp        = plHead->next;
-                plHead->next = plTmp->next;
-                plTmp->next  = NULL;
+                grepPart(task, id);
             }
-            pthread_mutex_unlock(&workThreadPoolMux);
-            
-            grepFile((void *)&plTmp->task);
         
-			      // free memory from malloc/strdup by addFilesIntoFreeList
-            if (plTmp->task.fname != NULL) {
-                free(plTmp->task.fname);
-                plTmp->task.fname = NULL;
+            // free memory from malloc/strdup by addFilesIntoFreeList
+            free(task->fname);
+            free(task);
+            ws_pool_done(workPool);
+        } else if (ring != NULL && !uring_reader_empty(ring)) {
+            // No more task to queue, search the files read meanwhile.
+            clock = run_stats_now(runStats_G);
+            if ((task = uring_reader_next(ring, &buf, &len)) != NULL) {
+                if (buf != NULL) {
+                    task->map      = buf;
+                    task->size     = len;
+                    task->fromRing = 1;
+                    run_stats_span(runStats_G, RUN_READ, clock, len);
+                }
+                grepPart(task, id);
+                free(task->fname);
+                free(task);
+                ws_pool_done(workPool);
             }
-            
-            if (plTmp != NULL) {
-                free(plTmp);
-                plTmp = NULL;
+        } else if (ws_pool_finished(workPool)) {
+            // All tasks are finished so exit, the parts of a big file
+            // split by another thread are pushed before its task is done.
+            if (ring != NULL) {
+                uring_reader_free(ring);
             }
+            pthread_exit(NULL);
         } else {
-            // All tasks are finished so exit, otherwise continue wait the new task
-            // added into list.
-            if (finishedGrepSubDir == 1) {
-                pthread_mutex_unlock(&workThreadPoolMux);
-                pthread_exit(NULL);
+            if (idle == 0) {
+                idle      = 1;
+                idleSince = clock;
             }
-            pthread_mutex_unlock(&workThreadPoolMux);
+            // Sleep until a task is added, see work-stealing-pool.c.
+            ws_pool_wait(workPool, id);
+        }
+    }
+}
+
+
+/****************************************************************************
+ * function    : writeFileOutput
+ * description : write out the outputs of the parts of a file in order, and
+ *               free them.
+ * argument(s) : file , the outputs of the file
+ * return      : 
+ ****************************************************************************/
+static void
+writeFileOutput(struct fileOutput *file)
+{
+    long base = 1;
+    int  i    = 0;
+
+    if (listFiles != 0 || countMatches != 0) {
+        // Nothing is saved in the outputs but the summary.
+        printSummary(file->outputs[0], file->fname, 1, atomic_load(&file->matches));
+    }
+    if (file->numbers != NULL) {
+        // Every part begins after the lines of the parts before it.
+        for (i = 1, base = 1 + file->lines[0]; i < file->num; i++) {
+            file->outputs[i] = renumber(file->outputs[i], file->numbers[i], base);
+            base += file->lines[i];
         }
     }
+    if (maxCount != 0 && listFiles == 0 && countMatches == 0) {
+        limitOutput(file->outputs, file->num);
+    }
+    writeMatches(file->outputs, file->num, file->id, file->fname);
+    if (file->num > 1) {
+        free(file->outputs);
+    }
+    free(file->fname);
+    free(file->numbers);
+    free(file->lines);
+    free(file);
+}
+
+
+/****************************************************************************
+ * function    : writerThreadFun
+ * description : The only thread writing out the results of the recursive
+ *               search. The outputs are taken in the order the files are 
+ *               found, so the results of a file are never mixed with others.
+ *               With -n the line numbers of the parts of a big file are
+ *               inserted here, when the lines of all its parts are counted.
+ *               The lines of -l and -c, and the limit of -m, are applied 
+ *               here too, since they depend on the files before.
+ *               All the parts of a big file are written by one writev().
+ * argument(s) : 
+ * return      : NULL
+ ****************************************************************************/
+void*
+writerThreadFun(void *arg)
+{
+    struct fileOutput *file = NULL;
+    struct fileOutput *next = NULL;
+    uint64_t           clock = 0;
+
+    run_stats_thread(runStats_G, poolThreadsNum, "writer");
+    // The time the writer waits for the next file is idle.
+    while ((clock = run_stats_now(runStats_G),
+            file = reorder_buffer_take(outputOrder)) != NULL) {
+        run_stats_span(runStats_G, RUN_IDLE, clock, -1);
+        // A batch is a chain of files, written one after another.
+        for (; file != NULL; file = next) {
+            next = file->next;
+            writeFileOutput(file);
+        }
+    }
+    return NULL;
 }
 
 
 /****************************************************************************
  * function    : initThreadPool
- * description : create THREADSNUM threads to work later.
+ * description : create poolThreadsNum threads to work later.
  * argument(s) : 
  * return      : return number of available threads.
  ****************************************************************************/
@@ -256,8 +1455,8 @@ initThreadPool()
     int error = 0;
     int num   = 0;
 
-    for (i = 0; i < THREADSNUM; i++) {
-        error = pthread_create(&workThreadPool[i], NULL, workThreadPoolFun, NULL);
+    for (i = 0; i < poolThreadsNum; i++) {
+        error = pthread_create(&workThreadPool[i], NULL, workThreadPoolFun, (void *)(intptr_t)i);
         if (error != 0) {
             break;
         } 
@@ -280,7 +1479,7 @@ joinThreadPool()
     int i = 0;
 
     // wait working thread to join
-    for (i = 0; i < THREADSNUM; i++) {
+    for (i = 0; i < poolThreadsNum; i++) {
         pthread_join(workThreadPool[i],NULL);
     }
     
@@ -289,178 +1488,409 @@ joinThreadPool()
 
 
 /****************************************************************************
- * function    : addFilesIntoFreeList 
- * description : add the file into the tail of free list.
- * argument(s) : 
- * return      : 0 (continue) or other (break from nftw)
+ * function    : pushTask 
+ * description : add a file, or a batch of small files, into the deques of
+ *               the work threads in turn. It takes the next place in the
+ *               order of the output.
+ * argument(s) : task , the file or the first file of the batch
+ * return      : 
  ****************************************************************************/
-static int
-addFilesIntoFreeList(const char *fpath, const struct stat *sb,
-             int tflag, struct FTW *ftwbuf)
+static long numTasks = 0;  //^_^ the number of tasks added, a batch is one
+
+static void
+pushTask(struct task *task)
 {
+    struct task *member = NULL;
+    uint64_t     clock  = run_stats_now(runStats_G);
+
+    // Wait for the writer if the work threads are too far ahead.
+    reorder_buffer_reserve(outputOrder, numTasks);
+    run_stats_span(runStats_G, RUN_WAIT, clock, numTasks);
+    for (member = task; member != NULL; member = member->next) {
+        member->seq = numTasks;
+    }
+    numTasks++;
 
-    struct tasklist *plTmp = NULL;
+    // Wait for the work threads if the pool is full.
+    clock = run_stats_now(runStats_G);
+    run_stats_queue(runStats_G, 1);
+    ws_pool_push_wait(workPool, task);
+    run_stats_span(runStats_G, RUN_WAIT, clock, numTasks - 1);
+}
 
-    if (tflag == FTW_F) {
 
-       // Add a file in tail of the task list. 
-       plTmp = (struct tasklist *) malloc (sizeof(struct tasklist));
-       if (plTmp == NULL) {
-           // No enough memory to save file info so that the program will exit
-           // by returning a non-zero number.
-           return 1;
-       }
-       // Save file info. strdup will allocate additional memory so don't forget free it.
-       plTmp->task.fname      = strdup(fpath);
-       plTmp->task.start      = 0;
-       plTmp->task.end        = sb->st_size;
-       plTmp->task.outputPath = 1;
-       plTmp->next            = NULL;
+/****************************************************************************
+ * function    : flushBatch 
+ * description : add the batch of small files gathered so far, a batch of a
+ *               single file as a plain task.
+ * argument(s) : 
+ * return      : 
+ ****************************************************************************/
+static struct task *batchFirst = NULL;  //^_^ the small files not added yet
+static struct task *batchLast  = NULL;  //^_^ the last of them
+static long         batchBytes = 0;     //^_^ their size
+static int          batchFiles = 0;     //^_^ their number
+
+static void
+flushBatch()
+{
+    if (batchFirst == NULL) {
+        return;
+    }
+    if (batchFirst->next == NULL) {
+        batchFirst->batched = 0;
+    }
+    pushTask(batchFirst);
+    batchFirst = NULL;
+    batchLast  = NULL;
+    batchBytes = 0;
+    batchFiles = 0;
+}
 
-       // When tail and head point to the same node, will have conflict thus using lock protect.
-       pthread_mutex_lock(&workThreadPoolMux);
-       plTail->next = plTmp;
-       plTail       = plTail->next;
 
-       // TODO: Awake sleeped thread but the signal will lose if all thread is working now.
-	     //       Need a new approach.
-       //pthread_cond_signal(&workThreadPoolCond);
-       pthread_mutex_unlock(&workThreadPoolMux);
+/****************************************************************************
+ * function    : addFilesIntoFreeList 
+ * description : add the file into the deques of the work threads in turn.
+ *               The file is split later by the thread searching it, so the
+ *               size of a file found by the walk is not needed here. The
+ *               small files of the args are gathered into batches instead,
+ *               searched by one thread each, so a long list of them costs
+ *               a task and a place in the order of the output per batch.
+ * argument(s) : fpath , the path of the file
+ *               size  , the size of the file, -1 if it is not known
+ * return      : 
+ ****************************************************************************/
+static void
+addFilesIntoFreeList(const char *fpath, long size)
+{
+    struct task *task = NULL;
+    uint64_t     clock = run_stats_now(runStats_G);
 
+    task = (struct task *) calloc (1, sizeof(struct task));
+    if (task == NULL) {
+        printf("Error: No enough memory for the tasks!\n");
+        exit (0);
+    }
+    // Save file info. strdup will allocate additional memory so don't forget free it.
+    task->fname      = strdup(fpath);
+    task->start      = 0;
+    task->end        = LONG_MAX;    // up to the end of the file
+    task->outputPath = 1;
+    task->id         = nextFileId++;
+    run_stats_span(runStats_G, RUN_ENQUEUE, clock, numTasks);
+
+    // With -u the io_uring readers batch the small files already.
+    if (size < 0 || size > BATCHFILESIZE || uringDepth > 0) {
+        // The files before it go first.
+        flushBatch();
+        pushTask(task);
+        return;
+    }
+    task->batched = 1;
+    if (batchFirst == NULL) {
+        batchFirst = task;
+    } else {
+        batchLast->next = task;
+    }
+    batchLast   = task;
+    batchBytes += size;
+    batchFiles++;
+    if (batchFiles >= BATCHFILES || batchBytes >= BATCHBYTES) {
+        flushBatch();
     }
-
-    // return 0 to continue.
-    return 0;
 }
 
 
 /****************************************************************************
- * function    : testList 
- * description : just for testing.
- * argument(s) : 
+ * function    : addDirIntoFreeList 
+ * description : add a directory to list into the deques of the work threads.
+ *               Called by the directory walk, from any thread.
+ * argument(s) : dir , the directory of the walk
+ *               arg , the place of the walk in dirWalks. The first dir is
+ *                     added before the walk is returned, so the walk is
+ *                     only looked up by the thread listing it.
  * return      : 
  ****************************************************************************/
-void 
-testList(struct tasklist * head) {
-    struct tasklist *plTmp = NULL;
-    while (head != plTail && head->next != NULL) {
-        plTmp = head->next;
-        head->next = plTmp->next;
-        plTmp->next= NULL;
-       // printf("Patric name = %s, size = %d\n", plTmp->task.fname, plTmp->task.end - plTmp->task.start);
-        if (plTmp->task.fname != NULL) {
-            free(plTmp->task.fname);
-            plTmp->task.fname = NULL;
-        }
-        if (plTmp != NULL) {
-            free(plTmp);
-            plTmp = NULL;
-        }
+static void
+addDirIntoFreeList(void *dir, void *arg)
+{
+    struct task *task = NULL;
+
+    task = (struct task *) calloc (1, sizeof(struct task));
+    if (task == NULL) {
+        printf("Error: No enough memory for the tasks!\n");
+        exit (0);
     }
+    task->dir  = dir;
+    task->walk = (dir_walk_t **)arg;
+    run_stats_queue(runStats_G, 1);
+    ws_pool_push(workPool, task);
 }
 
+
 /****************************************************************************
- * function    : grepDirParallel 
- * description : search the directory recursively
- *               create and join the thread pool
- * argument(s) : 
+ * function    : grepPathsParallel 
+ * description : search all the files and directories of the args with one
+ *               thread pool, the directories recursively with -r. The pool
+ *               and the writer are started only once for all of them.
+ *               Every file is a task, a big one is divided into parts by
+ *               the thread taking it, see splitFile(), and the small files
+ *               of the args are batched, see addFilesIntoFreeList(). The
+ *               directories are listed by the work threads, while the main
+ *               thread adds the files in the order of the args, and of
+ *               nftw() inside a directory, which is the order of the
+ *               output.
+ * argument(s) : paths , the files and directories
+ *               num   , the number of them
  * return      : 
  ****************************************************************************/
 void 
-grepDirParallel(const char *path) {
-    int    flag = 0;
-    pthread_mutex_lock(&workThreadPoolMux);
-    // The head node used to point to files that need to be searched.
-    // Don't save actual file info into head node and just use for a pointer.
-    plHead =  (struct tasklist *) malloc (sizeof(struct tasklist)); 
-    if (plHead == NULL) {
-        return;
+grepPathsParallel(char *paths[], int num) {
+    const char *fpath = NULL;
+    struct stat info;
+    long       *sizes = NULL;
+    int         i     = 0;
+    uint64_t    clock = 0;
+
+    workPool    = ws_pool_new(poolThreadsNum);
+    ws_pool_set_capacity(workPool, QUEUECAPACITY);
+    if (adaptiveThreads) {
+        // Start with one thread per CPU, add more while they wait for IO.
+        ws_pool_set_adaptive(workPool, threadsNum);
+    }
+    outputOrder = reorder_buffer_new(ORDERWINDOW);
+    numTasks    = 0;
+    dirWalks    = (dir_walk_t **) calloc (num, sizeof(dir_walk_t *));
+    sizes       = (long *) malloc (num * sizeof(long));
+    if (dirWalks == NULL || sizes == NULL) {
+        printf("Error: No enough memory for the tasks!\n");
+        exit (0);
     }
-    plHead->next = NULL;
-    plTail       = plHead;
-
-    // Don't go into the linked dir.
-    flag |= FTW_PHYS;
 
-    // Tell work threads that new tasks will be added into list, keep working. 
-    finishedGrepSubDir = 0;
-    pthread_mutex_unlock(&workThreadPoolMux);
+    // Walk all files, don't go into the linked dir. The walks are made before
+    // the work threads start, they list the first dirs as soon as they are
+    // added. The directories without -r are skipped, like the missing paths.
+    clock = run_stats_now(runStats_G);
+    for (i = 0; i < num; i++) {
+        // Only a regular file is batched, a link may lead to a big one.
+        sizes[i] = -1;
+        if (lstat(paths[i], &info) == -1) {
+            printf("Error: Could not open the specified file or directory.\n");
+            paths[i] = NULL;
+        } else if (S_ISREG(info.st_mode)) {
+            sizes[i] = info.st_size;
+        } else if (S_ISDIR(info.st_mode) && grepDirRec == 1) {
+            dirWalks[i] = dir_walk_new(paths[i], 0, addDirIntoFreeList, &dirWalks[i]);
+        } else if (S_ISDIR(info.st_mode)) {
+            paths[i] = NULL;
+        }
+    }
+    numWalks = num;
+    // The errors go before the output of the writer.
+    fflush(stdout);
 
     initThreadPool();
+    pthread_create(&writerThread, NULL, writerThreadFun, NULL);
 
-    // Using nftw() recursive search all files.
-    nftw(path, addFilesIntoFreeList, MAXFILES, flag);
-
-    // Tell work threads that they could exit when finished current task. 
-    pthread_mutex_lock(&workThreadPoolMux);
-    finishedGrepSubDir = 1;
-    pthread_mutex_unlock(&workThreadPoolMux);
+    for (i = 0; i < num && atomic_load(&cancelled) == 0; i++) {
+        if (dirWalks[i] != NULL) {
+            while ((fpath = dir_walk_next(dirWalks[i])) != NULL) {
+                addFilesIntoFreeList(fpath, -1);
+            }
+        } else if (paths[i] != NULL) {
+            addFilesIntoFreeList(paths[i], sizes[i]);
+        }
+    }
+    flushBatch();
+    // The walks left after -m only have their scheduled dirs to go through.
+    for (; i < num; i++) {
+        while (dirWalks[i] != NULL && dir_walk_next(dirWalks[i]) != NULL) {
+        }
+    }
+    run_stats_traversal(runStats_G, clock);
 
-	  // Intenal testing. Exclusive with thread pool.
-    //testList(plHead);
+    // Tell work threads that they could exit when all the tasks are done. 
+    ws_pool_close(workPool);
+    reorder_buffer_close(outputOrder, numTasks);
 
     joinThreadPool();
-
-    if (plHead != NULL) {
-        free (plHead);
-        plHead = NULL;
+    pthread_join(writerThread, NULL);
+
+    ws_pool_free(workPool);
+    workPool = NULL;
+    reorder_buffer_free(outputOrder);
+    outputOrder = NULL;
+    numWalks = 0;
+    for (i = 0; i < num; i++) {
+        if (dirWalks[i] != NULL) {
+            dir_walk_free(dirWalks[i]);
+        }
     }
+    free(dirWalks);
+    dirWalks = NULL;
+    free(sizes);
 
     return;
 }
 
 
+/****************************************************************************
+ * function    : grepPartThread
+ * description : search a part of a big file in a thread of its own, which
+ *               records its statistics in the slot of its part.
+ * argument(s) : arg , the task of the part, seq is the index of the part
+ * return      : NULL
+ ****************************************************************************/
+static void *
+grepPartThread(void *arg)
+{
+    struct task *part = arg;
+    char         name[32];
+
+    snprintf(name, sizeof(name), "worker %ld", part->seq);
+    run_stats_thread(runStats_G, part->seq, name);
+    return grepFile(arg);
+}
+
+
 /****************************************************************************
  * function    : grepFileParallel 
  * description : divide a big file into several small parts.
+ *               The file is mapped only once and every thread searches its
+ *               own part of the mapping in place. The results are written
+ *               out part by part in the order of the file, as soon as a
+ *               part and all the ones before it are finished.
  * argument(s) : 
  * return      : 
  ****************************************************************************/
 void 
 grepFileParallel(const char *file, long size, int threadNum) {
-    FILE*  fp     = NULL;
+    char  *map    = NULL;
+    char  *eol    = NULL;
     int    i      = 0;
-    int    posAdd = 0;
-    long   blockSize =  size / threadNum;
+    int    done   = 0;
+    long   base   = 1;      // the number of the first line of the next part
+    long   matches = 0;     // the matched lines of the parts, for -l and -c
+    long   blockSize;
+    atomic_int found = 0;   // a part has matched, the others stop with -l
+    arena_t *summary = NULL;
     struct  task arg[threadNum];
+    arena_t *outputs[threadNum];
+    long     id     = nextFileId++;  // the id of the file for --offsets
+    uint64_t clock = run_stats_now(runStats_G);
     
-    if ((fp = fopen(file,"r")) == NULL) {
-		printf("Error: Could not open the file! \n");
+    if ((map = mapFile(file, &size)) == NULL) {
+        // Can't be mapped, fall back to read the whole file by one thread.
+        arg[0].fname      = (char *)file;
+        arg[0].map        = NULL;
+        arg[0].size       = 0;
+        arg[0].start      = 0;
+        arg[0].end        = size;
+        arg[0].outputPath = 0;
+        arg[0].output     = arena_get(arenaPool_G[0]);
+        arg[0].numbers    = NULL;
+        arg[0].lineBase   = 0;
+        arg[0].found      = NULL;
+        arg[0].file       = NULL;
+        arg[0].id         = id;
+        arg[0].byteBase   = 0;
+        arg[0].ranges     = 0;
+        grepFile((void *)&arg[0]);
+        writeTask(&arg[0]);
+        return;
+    }
+    if (gzip_reader_is_gzip(map, size)) {
+        // The inflated lines can't be divided beforehand, the whole file
+        // is inflated ahead by several threads instead.
+        arg[0].fname      = (char *)file;
+        arg[0].map        = map;
+        arg[0].size       = size;
+        arg[0].start      = 0;
+        arg[0].end        = size;
+        arg[0].outputPath = 0;
+        arg[0].output     = arena_get(arenaPool_G[0]);
+        arg[0].numbers    = NULL;
+        arg[0].lineBase   = 0;
+        arg[0].found      = NULL;
+        arg[0].file       = NULL;
+        arg[0].id         = id;
+        arg[0].byteBase   = 0;
+        arg[0].ranges     = 0;
+        grepFile((void *)&arg[0]);
+        writeTask(&arg[0]);
+        munmap(map, size);
         return;
     }
+    run_stats_span(runStats_G, RUN_READ, clock, size);
+    blockSize = size / threadNum;
 
-    for (i = 0; i < threadNum - 1; i++) {
+    for (i = 0; i < threadNum; i++) {
         // Basic size of each block for threads.
         arg[i].fname       = (char *)file;
-        arg[i].start       = i       * blockSize + posAdd;
-        arg[i].end         = (i + 1) * blockSize - 1 ;
+        arg[i].map         = map;
+        arg[i].size        = size;
+        arg[i].start       = (i == 0) ? 0 : arg[i - 1].end;
+        arg[i].end         = (i + 1) * blockSize;
         arg[i].outputPath  = 0;
+        arg[i].seq         = i;
+        arg[i].output      = arena_get(arenaPool_G[i % poolThreadsNum]);
+        arg[i].numbers     = (lineNumber != 0 && i > 0) ? arena_get(arenaPool_G[i % poolThreadsNum]) : NULL;
+        arg[i].lineBase    = 0;
+        arg[i].id          = id;
+        arg[i].byteBase    = 0;
+        arg[i].ranges      = spliceOutput;
+        arg[i].found       = &found;
         
         // Adjust the size to the next '\n', thus the file could be divided by line.
-        fseek(fp, arg[i].end, SEEK_SET);
-        for (posAdd = 0; fgetc(fp) != '\n'; posAdd++ );
-        
-        arg[i].end += posAdd ;
+        // The last domain is an irregular block compared with former blocks.
+        if (i == threadNum - 1 || arg[i].end <= arg[i].start) {
+            arg[i].end = (i == threadNum - 1) ? size : arg[i].start;
+        } else if ((eol = memchr(map + arg[i].end - 1, '\n', size - arg[i].end + 1)) != NULL) {
+            arg[i].end = eol - map + 1;
+        } else {
+            arg[i].end = size;
+        }
 
         // Start thread to grep sub-domain.
-        pthread_create(&workThread[i], NULL, grepFile, (void *)&arg[i]); 
+        pthread_create(&workThread[i], NULL, grepPartThread, (void *)&arg[i]); 
     }
 
-    // The last domain is an irregular block compared with former blocks.
-    arg[threadNum - 1].fname      = (char *) file;
-    arg[threadNum - 1].start      = (threadNum - 1) * blockSize + posAdd;
-    arg[threadNum - 1].end        = size - 1;
-    arg[threadNum - 1].outputPath = 0;
-    pthread_create(&workThread[i], NULL, grepFile, (void *)&arg[i]); 
-    
-    // The file descriptor is only used in main thread. 
-    // Thus, close it without influence for other threads.
-    fclose(fp);
-
-
-    for (i = 0; i < threadNum; i++) {
-        pthread_join(workThread[i],NULL);
+    // Write out the finished parts together in order. The later parts are
+    // likely to be finished by the time the first one is. With -n a part
+    // is renumbered from the sum of the lines of the parts before it. With
+    // -m the parts after the limit are cancelled by limitOutput().
+    while (done < threadNum) {
+        // The time waiting here shows the stragglers.
+        clock = run_stats_now(runStats_G);
+        pthread_join(workThread[done], NULL);
+        run_stats_span(runStats_G, RUN_WAIT, clock, done);
+        for (i = done; i < threadNum; i++) {
+            if (i > done && pthread_tryjoin_np(workThread[i], NULL) != 0) {
+                break;
+            }
+            outputs[i] = arg[i].output;
+            if (arg[i].numbers != NULL) {
+                outputs[i] = renumber(outputs[i], arg[i].numbers, base);
+            }
+            base    += arg[i].lines;
+            matches += arg[i].matches;
+        }
+        limitOutput(outputs + done, i - done);
+        if (spliceOutput != 0) {
+            writeRanges(outputs + done, i - done, map, size);
+        } else {
+            writeMatches(outputs + done, i - done, id, file);
+        }
+        done = i;
     }
+    // With -l and -c the outputs were empty, only the summary is printed.
+    if (listFiles != 0 || countMatches != 0) {
+        summary = arena_get(arenaPool_G[0]);
+        printSummary(summary, file, 0, matches);
+        writeOutput(&summary, 1);
+    }
+
+    munmap(map, size);
 }
     
 
@@ -476,41 +1906,68 @@ int
 main(int argc, char *argv[]) {
 
     struct stat info;
+    int         i = 0;
 
     parseArg(argc,argv);
+    // Only the bare lines are in the mapping, anything else is formatted.
+    spliceOutput = splice_output_usable(STDOUT_FILENO) && lineNumber == 0 && listFiles == 0
+                   && countMatches == 0 && maxCount == 0 && offsetFormat == MATCH_TEXT;
+
+    workThread     = malloc(threadsNum * sizeof(pthread_t));
+    workThreadPool = malloc(poolThreadsNum * sizeof(pthread_t));
+    arenaPool_G    = malloc(poolThreadsNum * sizeof(arena_pool_t *));
+    if (workThread == NULL || workThreadPool == NULL || arenaPool_G == NULL) {
+        printf("Error: No enough memory for the threads!\n");
+        exit (0);
+    }
+    for (i = 0; i < poolThreadsNum; i++) {
+        arenaPool_G[i] = arena_pool_new();
+    }
+    if (showStats != 0 || tracePath != NULL) {
+        runStats_G = run_stats_new(poolThreadsNum + 2, showStats != 0, tracePath);
+        run_stats_thread(runStats_G, poolThreadsNum + 1, "main");
+    }
 
-    while (indexFile < argc) {
-        if (lstat(argv[indexFile], &info) == -1) {
-            printf("Error: Could not open the specified file or directory.\n");
-        }
+    // Several args, or a directory, are all searched by the thread pool,
+    // with the path before every line. A single file is searched alone.
+    if (numFiles == 1 && lstat(argv[indexFile], &info) == -1) {
+        printf("Error: Could not open the specified file or directory.\n");
+    } else if (numFiles > 1 || S_ISDIR(info.st_mode)) {
+        grepPathsParallel(argv + indexFile, numFiles);
+    } else if (info.st_size > threshold * MB) {
+        // For small files don't bother PARALLEL algrithm. 
+        grepFileParallel(argv[indexFile], info.st_size, threadsNum);
+    } else {
+        struct task fileInfo;
+        fileInfo.fname = argv[indexFile];
+        fileInfo.map   = NULL;
+        fileInfo.size  = 0;
+        fileInfo.start = 0;
+        fileInfo.end   = info.st_size;
+        fileInfo.seq   = 0;
+        fileInfo.output = arena_get(arenaPool_G[0]);
+        fileInfo.numbers = NULL;
+        fileInfo.lineBase = 0;
+        fileInfo.found = NULL;
+        fileInfo.file  = NULL;
+        fileInfo.id    = nextFileId++;
+        fileInfo.byteBase = 0;
+        fileInfo.ranges = 0;
+        fileInfo.outputPath = 0;
+        grepFile((void *)&fileInfo);
+        writeTask(&fileInfo);
+    }
 
-        // The marco S_ISDIR is defined in stat.h
-        if (S_ISDIR(info.st_mode)) {
-            // Recursive search if "-r" option is used. 
-            if (grepDirRec == 1) {
-                grepDirParallel(argv[indexFile]);
-            }
-        } else {
-            // For small files don't bother PARALLEL algrithm. 
-            if ( info.st_size > threshold * MB ) { 
-                grepFileParallel(argv[indexFile], info.st_size, THREADSNUM);
-            } else {
-                struct task fileInfo;
-                fileInfo.fname = argv[indexFile];
-                fileInfo.start = 0;
-                fileInfo.end   = info.st_size;
-				// Print out the file path when search more than one file.
-				if (indexFile > 3) {
-                    fileInfo.outputPath = 1;
-				} else {
-                    fileInfo.outputPath = 0;
-				}
-                grepFile((void *)&fileInfo);
-            }
-        }
-        // Deal with the next one.
-        ++indexFile;
+    if (!run_stats_finish(runStats_G)) {
+        printf("Error: Could not write the trace : %s\n", tracePath);
+    }
+    run_stats_free(runStats_G);
+    for (i = 0; i < poolThreadsNum; i++) {
+        arena_pool_free(arenaPool_G[i]);
     }
+    free(arenaPool_G);
+    free(workThreadPool);
+    free(workThread);
 
     return 0;
 }
@@ -0,0 +1,200 @@
+/*
+An Aho-Corasick automaton for finding many literal strings in one pass.
+The patterns are put into a trie, and the failure links are folded into
+the transitions so that the automaton is a DFA: every byte of the buffer
+costs one table lookup, however many patterns there are. The bytes which
+don't appear in any pattern share one column of the table, which keeps the
+table small for large pattern lists.
+*/
+#include "aho-corasick.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/** @brief The automaton the user receives */
+typedef struct aho_corasick {
+    unsigned char byte_class[256]; // Column of each byte in the table
+    int num_classes;
+    int num_states;
+    int *delta; // num_states * num_classes transitions
+    int *out; // The pattern spelled by the path to each state, or -1
+    int *dict; // The next state on the failure chain with an output, or -1
+    int *same; // The next pattern equal to a pattern, or -1
+    size_t *lens;
+} aho_corasick_t;
+
+static void *xrealloc(void *ptr, size_t size) {
+    if ((ptr = realloc(ptr, size)) == NULL) {
+        perror("malloc failed in aho-corasick");
+        exit(1);
+    }
+    return ptr;
+}
+
+/**
+ * @brief Builds the automaton. Empty patterns are ignored, the caller
+ * should handle them since they match everywhere.
+ *
+ * @param patterns the literal strings, don't need to be NUL terminated
+ * @param lens the length of each pattern
+ * @param num the number of patterns
+ * @return aho_corasick_t* a pointer to the automaton
+ */
+aho_corasick_t *aho_corasick_build(const char **patterns, const size_t *lens, int num) {
+    aho_corasick_t *ac;
+    int capacity = 64;
+
+    if ((ac = calloc(1, sizeof(aho_corasick_t))) == NULL) {
+        perror("malloc failed in aho-corasick: aho_corasick_build");
+        exit(1);
+    }
+    ac->lens = xrealloc(NULL, (num > 0 ? num : 1) * sizeof(size_t));
+    ac->same = xrealloc(NULL, (num > 0 ? num : 1) * sizeof(int));
+    memcpy(ac->lens, lens, num * sizeof(size_t));
+
+    // Class 0 is for the bytes which aren't in any pattern
+    ac->num_classes = 1;
+    for (int i = 0; i < num; i++) {
+        for (size_t j = 0; j < lens[i]; j++) {
+            unsigned char c = patterns[i][j];
+            if (ac->byte_class[c] == 0)
+                ac->byte_class[c] = ac->num_classes++;
+        }
+    }
+
+    // Build the trie, -1 is a missing edge
+    int k = ac->num_classes;
+    ac->delta = xrealloc(NULL, capacity * k * sizeof(int));
+    ac->out = xrealloc(NULL, capacity * sizeof(int));
+    memset(ac->delta, -1, k * sizeof(int));
+    ac->out[0] = -1;
+    ac->num_states = 1;
+    for (int i = 0; i < num; i++) {
+        int state = 0;
+        for (size_t j = 0; j < lens[i]; j++) {
+            int c = ac->byte_class[(unsigned char)patterns[i][j]];
+            if (ac->delta[state * k + c] == -1) {
+                if (ac->num_states == capacity) {
+                    capacity *= 2;
+                    ac->delta = xrealloc(ac->delta, (size_t)capacity * k * sizeof(int));
+                    ac->out = xrealloc(ac->out, capacity * sizeof(int));
+                }
+                memset(ac->delta + (size_t)ac->num_states * k, -1, k * sizeof(int));
+                ac->out[ac->num_states] = -1;
+                ac->delta[state * k + c] = ac->num_states++;
+            }
+            state = ac->delta[state * k + c];
+        }
+        // Equal patterns end at the same state, chain them
+        if (lens[i] > 0) {
+            ac->same[i] = ac->out[state];
+            ac->out[state] = i;
+        }
+    }
+
+    // Walk the trie breadth first, the failure state of a state is always
+    // closer to the root so it is complete when the state is reached
+    int *fail = xrealloc(NULL, ac->num_states * sizeof(int));
+    int *queue = xrealloc(NULL, ac->num_states * sizeof(int));
+    int head = 0, tail = 0;
+    ac->dict = xrealloc(NULL, ac->num_states * sizeof(int));
+    fail[0] = 0;
+    ac->dict[0] = -1;
+    for (int c = 0; c < k; c++) {
+        int next = ac->delta[c];
+        if (next == -1) {
+            ac->delta[c] = 0;
+        } else {
+            fail[next] = 0;
+            ac->dict[next] = -1;
+            queue[tail++] = next;
+        }
+    }
+    while (head < tail) {
+        int state = queue[head++];
+        for (int c = 0; c < k; c++) {
+            int next = ac->delta[state * k + c];
+            int fallback = ac->delta[fail[state] * k + c];
+            if (next == -1) {
+                ac->delta[state * k + c] = fallback;
+                continue;
+            }
+            fail[next] = fallback;
+            ac->dict[next] = ac->out[fallback] != -1 ? fallback : ac->dict[fallback];
+            queue[tail++] = next;
+        }
+    }
+    free(fail);
+    free(queue);
+    return ac;
+}
+
+/**
+ * @brief Finds the occurrence which ends first in the buffer.
+ *
+ * @param ac the automaton
+ * @param buf the buffer to search, doesn't need to be NUL terminated
+ * @param len the length of the buffer
+ * @param pattern_id set to the index of the pattern found, may be NULL
+ * @return a pointer to the first byte of the occurrence, or NULL
+ */
+const char *aho_corasick_search(aho_corasick_t *ac, const char *buf, size_t len, int *pattern_id) {
+    const int k = ac->num_classes;
+    const int *delta = ac->delta;
+    const unsigned char *byte_class = ac->byte_class;
+    int state = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        state = delta[state * k + byte_class[(unsigned char)buf[i]]];
+        int id = ac->out[state];
+        if (id == -1 && ac->dict[state] != -1)
+            id = ac->out[ac->dict[state]];
+        if (id != -1) {
+            if (pattern_id != NULL)
+                *pattern_id = id;
+            return buf + i + 1 - ac->lens[id];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Reports every occurrence of every pattern in the buffer, in the
+ * order they end.
+ *
+ * @param ac the automaton
+ * @param buf the buffer to search, doesn't need to be NUL terminated
+ * @param len the length of the buffer
+ * @param fn called with the pattern index and the first byte of the
+ * occurrence, returns false to stop
+ * @param arg passed to fn
+ */
+void aho_corasick_scan(aho_corasick_t *ac, const char *buf, size_t len, ac_match_fn *fn, void *arg) {
+    const int k = ac->num_classes;
+    int state = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        state = ac->delta[state * k + ac->byte_class[(unsigned char)buf[i]]];
+        for (int s = ac->out[state] != -1 ? state : ac->dict[state]; s != -1; s = ac->dict[s]) {
+            for (int id = ac->out[s]; id != -1; id = ac->same[id]) {
+                if (!fn(id, buf + i + 1 - ac->lens[id], arg))
+                    return;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Frees the automaton.
+ *
+ * @param ac the automaton
+ */
+void aho_corasick_free(aho_corasick_t *ac) {
+    free(ac->delta);
+    free(ac->out);
+    free(ac->dict);
+    free(ac->same);
+    free(ac->lens);
+    free(ac);
+}
@@ -0,0 +1,17 @@
+#ifndef AHO_CORASICK_INCLUDED
+#define AHO_CORASICK_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct aho_corasick aho_corasick_t;
+
+/* Called on every occurrence, return false to stop the scan */
+typedef bool (ac_match_fn)(int pattern_id, const char *start, void *arg);
+
+aho_corasick_t *aho_corasick_build(const char **patterns, const size_t *lens, int num);
+const char *aho_corasick_search(aho_corasick_t *ac, const char *buf, size_t len, int *pattern_id);
+void aho_corasick_scan(aho_corasick_t *ac, const char *buf, size_t len, ac_match_fn *fn, void *arg);
+void aho_corasick_free(aho_corasick_t *ac);
+
+#endif
@@ -0,0 +1,181 @@
+/*
+Growable output buffers which are recycled instead of freed.
+A task appends everything it produces to one contiguous arena, so the
+output of a whole file costs a few reallocations instead of one malloc
+per line, and it can be written out with a single call. A released arena
+goes back to the pool it came from, usually owned by one worker thread,
+and the next task of that worker reuses its memory. Releasing is safe
+from any thread, since the free arenas are kept in a lock-free queue.
+*/
+#include "arena.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "lock-free-queue.h"
+
+#define ARENA_INIT_CAPACITY 4096
+#define ARENA_KEEP_MAX (4 * 1024 * 1024) // Bigger arenas aren't kept
+#define POOL_CAPACITY 64 // Free arenas kept by a pool
+
+/** @brief A contiguous buffer, the arena the user receives */
+typedef struct arena {
+    char *data;
+    size_t len;
+    size_t capacity;
+    arena_pool_t *pool; // Where the arena goes back when released
+} arena_t;
+
+/** @brief The free arenas of one owner */
+typedef struct arena_pool {
+    lf_queue_t *free_arenas;
+} arena_pool_t;
+
+static void arena_free(void *arena) {
+    free(((arena_t *)arena)->data);
+    free(arena);
+}
+
+/**
+ * @brief Dynamically allocates a new, empty pool. Exits only on malloc
+ * error.
+ *
+ * @return arena_pool_t* a pointer to the allocated pool
+ */
+arena_pool_t *arena_pool_new(void) {
+    arena_pool_t *pool;
+    if ((pool = malloc(sizeof(arena_pool_t))) == NULL) {
+        perror("malloc failed in arena");
+        exit(1);
+    }
+    pool->free_arenas = lf_queue_new(POOL_CAPACITY);
+    return pool;
+}
+
+/**
+ * @brief Takes an empty arena from the pool, or allocates one if the
+ * pool has none. Exits only on malloc error.
+ *
+ * @param pool the pool supplied from the user
+ * @return arena_t* an empty arena
+ */
+arena_t *arena_get(arena_pool_t *pool) {
+    arena_t *arena = lf_queue_remove_front(pool->free_arenas);
+    if (arena != NULL)
+        return arena;
+
+    if ((arena = malloc(sizeof(arena_t))) == NULL ||
+        (arena->data = malloc(ARENA_INIT_CAPACITY)) == NULL) {
+        perror("malloc failed in arena");
+        exit(1);
+    }
+    arena->len = 0;
+    arena->capacity = ARENA_INIT_CAPACITY;
+    arena->pool = pool;
+    return arena;
+}
+
+/**
+ * @brief Makes room for len more bytes at the end of the arena. The
+ * bytes written there are kept by arena_commit.
+ *
+ * @param arena the arena supplied from the user
+ * @param len the number of bytes to make room for
+ * @return a pointer to the end of the arena, valid until the next call
+ */
+char *arena_reserve(arena_t *arena, size_t len) {
+    if (arena->capacity - arena->len < len) {
+        size_t capacity = arena->capacity;
+        while (capacity - arena->len < len)
+            capacity *= 2;
+        if ((arena->data = realloc(arena->data, capacity)) == NULL) {
+            perror("malloc failed in arena");
+            exit(1);
+        }
+        arena->capacity = capacity;
+    }
+    return arena->data + arena->len;
+}
+
+/**
+ * @brief Keeps len bytes written after arena_reserve.
+ *
+ * @param arena the arena supplied from the user
+ * @param len the number of bytes written, at most the reserved length
+ */
+void arena_commit(arena_t *arena, size_t len) {
+    arena->len += len;
+}
+
+/**
+ * @brief Copies bytes to the end of the arena.
+ *
+ * @param arena the arena supplied from the user
+ * @param buf the bytes to copy
+ * @param len the number of bytes
+ */
+void arena_append(arena_t *arena, const char *buf, size_t len) {
+    memcpy(arena_reserve(arena, len), buf, len);
+    arena->len += len;
+}
+
+/**
+ * @brief Gives the contents of the arena.
+ *
+ * @param arena the arena supplied from the user
+ * @return a pointer to the first byte, not NUL terminated
+ */
+const char *arena_data(arena_t *arena) {
+    return arena->data;
+}
+
+/**
+ * @brief Gives the number of bytes in the arena.
+ *
+ * @param arena the arena supplied from the user
+ * @return the length of the contents
+ */
+size_t arena_len(arena_t *arena) {
+    return arena->len;
+}
+
+/**
+ * @brief Drops the end of the arena, keeping its first len bytes.
+ *
+ * @param arena the arena supplied from the user
+ * @param len the number of bytes to keep, nothing is dropped if the
+ * arena is shorter
+ */
+void arena_truncate(arena_t *arena, size_t len) {
+    if (len < arena->len)
+        arena->len = len;
+}
+
+/**
+ * @brief Empties the arena and puts it back into its pool. Arenas which
+ * grew too big, or don't fit into the pool, are freed instead. May be
+ * called from any thread.
+ *
+ * @param arena the arena supplied from the user
+ */
+void arena_release(arena_t *arena) {
+    if (arena->capacity > ARENA_KEEP_MAX ||
+        lf_queue_size(arena->pool->free_arenas) >= POOL_CAPACITY) {
+        arena_free(arena);
+        return;
+    }
+    arena->len = 0;
+    lf_queue_insert_back(arena->pool->free_arenas, arena);
+}
+
+/**
+ * @brief Frees the pool and the arenas in it. Arenas which are still in
+ * use must not be released afterwards.
+ *
+ * @param pool the pool supplied from the user
+ */
+void arena_pool_free(arena_pool_t *pool) {
+    lf_queue_free(pool->free_arenas, arena_free);
+    free(pool);
+}
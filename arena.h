@@ -0,0 +1,20 @@
+#ifndef ARENA_INCLUDED
+#define ARENA_INCLUDED
+
+#include <stddef.h>
+
+typedef struct arena arena_t;
+typedef struct arena_pool arena_pool_t;
+
+arena_pool_t *arena_pool_new(void);
+arena_t *arena_get(arena_pool_t *pool);
+char *arena_reserve(arena_t *arena, size_t len);
+void arena_commit(arena_t *arena, size_t len);
+void arena_append(arena_t *arena, const char *buf, size_t len);
+const char *arena_data(arena_t *arena);
+size_t arena_len(arena_t *arena);
+void arena_truncate(arena_t *arena, size_t len);
+void arena_release(arena_t *arena);
+void arena_pool_free(arena_pool_t *pool);
+
+#endif
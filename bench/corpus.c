@@ -0,0 +1,288 @@
+/**
+Writes a synthetic corpus for the benchmarks: a tree of text files whose
+number, size distribution, line length and density of matched lines are
+chosen on the command line, always the same for the same seed. With -e it
+evicts files from the page cache instead, for the cold cache runs.
+ */
+
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <sys/stat.h>
+
+#define KB 1024
+#define MB (1024*1024)
+
+// GLOBALS
+long num_files = 1000;
+long mean_size = 16 * KB; // bytes per file, on average
+const char *distribution = "fixed"; // of the file sizes: fixed, uniform or pareto
+long line_length = 80; // bytes per line, on average
+double density = 0.001; // share of the lines holding the needle
+const char *needle = "Qzx_needle"; // never made by chance, the words are lower case
+long files_per_dir = 100;
+uint64_t rng_state = 1; // from -S
+bool evict = false;
+const char *usage = "Usage: ./corpus [-n files] [-s size] [-z fixed|uniform|pareto] [-l length]\n"
+                    "                [-d density] [-w needle] [-D files] [-S seed] directory\n"
+                    "       ./corpus -e path...\n"
+                    "-n     Number of files, one file is written as directory itself\n"
+                    "-s     Mean size of a file in bytes, K, M and G suffixes allowed\n"
+                    "-z     Distribution of the file sizes around the mean\n"
+                    "-l     Mean length of a line\n"
+                    "-d     Share of the lines holding the needle, from 0 to 1\n"
+                    "-w     The string the benchmarks search\n"
+                    "-D     Files per subdirectory\n"
+                    "-S     Seed of the random generator\n"
+                    "-e     Evict the files under the paths from the page cache\n";
+
+/**
+* @brief the next random number, by xorshift64*
+*/
+uint64_t next_random() {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+/**
+* @brief a random number in [0, 1)
+*/
+double next_unit() {
+    return (next_random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+* @brief parse a size with an optional K, M or G suffix, exit if invalid
+*/
+long parse_size(const char *arg) {
+    char *end;
+    long size = strtol(arg, &end, 10);
+
+    switch (*end) {
+        case 'K': case 'k': size *= KB; end++; break;
+        case 'M': case 'm': size *= MB; end++; break;
+        case 'G': case 'g': size *= (long)KB * MB; end++; break;
+    }
+    if (*end != '\0' || size <= 0) {
+        fprintf(stderr, "Invalid size %s\n%s", arg, usage);
+        exit(1);
+    }
+    return size;
+}
+
+/**
+* @brief parse the arguments, return the index of the first path
+*/
+int parse_args(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "hen:s:z:l:d:w:D:S:")) != -1) {
+        switch (opt) {
+            case 'h':
+                printf("%s", usage);
+                exit(0);
+
+            case 'e':
+                evict = true;
+                break;
+
+            case 'n':
+                if ((num_files = atol(optarg)) <= 0) {
+                    fprintf(stderr, "Invalid number of files %s\n%s", optarg, usage);
+                    exit(1);
+                }
+                break;
+
+            case 's':
+                mean_size = parse_size(optarg);
+                break;
+
+            case 'z':
+                if (strcmp(optarg, "fixed") != 0 && strcmp(optarg, "uniform") != 0 &&
+                    strcmp(optarg, "pareto") != 0) {
+                    fprintf(stderr, "Invalid distribution %s\n%s", optarg, usage);
+                    exit(1);
+                }
+                distribution = optarg;
+                break;
+
+            case 'l':
+                if ((line_length = atol(optarg)) <= 0) {
+                    fprintf(stderr, "Invalid line length %s\n%s", optarg, usage);
+                    exit(1);
+                }
+                break;
+
+            case 'd':
+                density = atof(optarg);
+                if (density < 0 || density > 1) {
+                    fprintf(stderr, "Invalid density %s\n%s", optarg, usage);
+                    exit(1);
+                }
+                break;
+
+            case 'w':
+                needle = optarg;
+                break;
+
+            case 'D':
+                if ((files_per_dir = atol(optarg)) <= 0) {
+                    fprintf(stderr, "Invalid number of files %s\n%s", optarg, usage);
+                    exit(1);
+                }
+                break;
+
+            case 'S':
+                rng_state = strtoull(optarg, NULL, 10) * 0x9E3779B97F4A7C15ULL | 1;
+                break;
+
+            case '?':
+                printf("Error parsing command line arguments\n%s", usage);
+                exit(1);
+        }
+    }
+    if (optind == argc || (!evict && argc - optind != 1)) {
+        fprintf(stderr, "Missing the directory\n%s", usage);
+        exit(1);
+    }
+    return optind;
+}
+
+/**
+* @brief draw the size of the next file. The pareto sizes have the same
+* mean, with a heavy tail: most files are small and a few are huge.
+*/
+long next_size() {
+    if (strcmp(distribution, "uniform") == 0)
+        return (long)(2 * mean_size * next_unit());
+    if (strcmp(distribution, "pareto") == 0) {
+        const double alpha = 1.5; // mean = alpha * min / (alpha - 1)
+        double min = mean_size * (alpha - 1) / alpha;
+        return (long)(min / pow(1 - next_unit(), 1 / alpha));
+    }
+    return mean_size;
+}
+
+/**
+* @brief write size bytes of lines made of random lower case words, a line
+* holds the needle with probability density
+*/
+void write_lines(FILE *file, long size) {
+    char *line = malloc(2 * line_length + strlen(needle) + 16);
+    size_t needle_len = strlen(needle);
+
+    if (line == NULL) {
+        perror("malloc failed in corpus: write_lines");
+        exit(1);
+    }
+    while (size > 0) {
+        long target = line_length / 2 + next_random() % (line_length + 1); // 0.5 to 1.5 times the mean
+        long needle_at = next_unit() < density ? (long)(next_random() % (target + 1)) : -1;
+        long len = 0;
+
+        while (len < target) {
+            if (needle_at >= 0 && len >= needle_at) {
+                memcpy(line + len, needle, needle_len);
+                len += needle_len;
+                needle_at = -1;
+            } else {
+                long word = 2 + next_random() % 9;
+                for (long i = 0; i < word && len < target; i++)
+                    line[len++] = 'a' + next_random() % 26;
+            }
+            if (len < target)
+                line[len++] = ' ';
+        }
+        if (needle_at >= 0) {
+            memcpy(line + len, needle, needle_len);
+            len += needle_len;
+        }
+        line[len++] = '\n';
+        if (len > size) {
+            len = size; // the last line is cut to the size of the file
+            line[len - 1] = '\n';
+        }
+        if (fwrite(line, 1, len, file) != (size_t)len) {
+            perror("fwrite");
+            exit(1);
+        }
+        size -= len;
+    }
+    free(line);
+}
+
+/**
+* @brief write the corpus: the files go into subdirectories of files_per_dir
+* files, or a single file is written at path
+*/
+void write_corpus(const char *path) {
+    char name[4096];
+
+    for (long i = 0; i < num_files; i++) {
+        if (num_files == 1) {
+            snprintf(name, sizeof(name), "%s", path);
+        } else {
+            snprintf(name, sizeof(name), "%s/d%04ld", path, i / files_per_dir);
+            if (i % files_per_dir == 0 && mkdir(name, 0755) == -1 && errno != EEXIST) {
+                perror(name);
+                exit(1);
+            }
+            snprintf(name, sizeof(name), "%s/d%04ld/f%06ld.txt", path, i / files_per_dir, i);
+        }
+        FILE *file = fopen(name, "w");
+        if (file == NULL) {
+            perror(name);
+            exit(1);
+        }
+        write_lines(file, next_size());
+        if (fclose(file) != 0) {
+            perror(name);
+            exit(1);
+        }
+    }
+}
+
+/**
+* @brief drop a file from the page cache, its pages are clean
+*/
+int evict_file(const char *path, const struct stat *sb, int type, struct FTW *ftw) {
+    int fd;
+
+    if (type != FTW_F || (fd = open(path, O_RDONLY)) == -1)
+        return 0;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int first = parse_args(argc, argv);
+
+    if (evict) {
+        for (int i = first; i < argc; i++) {
+            if (nftw(argv[i], evict_file, 64, FTW_PHYS) == -1) {
+                perror(argv[i]);
+                exit(1);
+            }
+        }
+        return 0;
+    }
+
+    if (num_files > 1 && mkdir(argv[first], 0755) == -1 && errno != EEXIST) {
+        perror(argv[first]);
+        exit(1);
+    }
+    write_corpus(argv[first]);
+    return 0;
+}
@@ -0,0 +1,151 @@
+#!/bin/bash
+#
+# Compares sequential-grep, pgrep and ParallelGrep, with the system grep as
+# a reference, on synthetic corpora written by corpus.c: a tree of many
+# small files searched with -r, and a single big file. Every tool runs with
+# every thread count, with a warm and a cold page cache, and the median of
+# the runs is written as CSV:
+#
+#   corpus,cache,tool,threads,seconds,speedup,efficiency
+#
+# speedup is the time of sequential-grep on the same corpus and cache over
+# the time of the run, efficiency is speedup / threads.
+#
+# Usage: bench/run.sh [results.csv]
+#
+# Settings, from the environment:
+#   WORK      directory of the binaries and corpora   (/tmp/pgrep-bench)
+#   THREADS   thread counts                           (1 2 4 ... up to the CPUs)
+#   REPEAT    runs of each case, the median is kept   (5)
+#   CACHES    warm and/or cold                        (warm cold)
+#   SCALE     multiplies the size of the corpora      (1)
+#   FILES, FILE_SIZE, DISTRIBUTION, BIG_SIZE, LINE_LENGTH, DENSITY, SEED
+#             passed to corpus.c, see below
+#
+# A cold run drops the page cache before every run when it may (root),
+# otherwise it evicts the files of the corpus with posix_fadvise().
+
+set -e
+
+SRC=$(cd "$(dirname "$0")/.." && pwd)
+WORK=${WORK:-/tmp/pgrep-bench}
+OUT=${1:-results.csv}
+REPEAT=${REPEAT:-5}
+CACHES=${CACHES:-warm cold}
+SCALE=${SCALE:-1}
+FILES=${FILES:-$((20000 * SCALE))}
+FILE_SIZE=${FILE_SIZE:-8K}
+DISTRIBUTION=${DISTRIBUTION:-pareto}
+BIG_SIZE=${BIG_SIZE:-$((256 * SCALE))M}
+LINE_LENGTH=${LINE_LENGTH:-80}
+DENSITY=${DENSITY:-0.001}
+SEED=${SEED:-1}
+NEEDLE=Qzx_needle
+
+if [ -z "$THREADS" ]; then
+    cpus=$(nproc)
+    THREADS=1
+    for ((t = 2; t < cpus; t *= 2)); do THREADS="$THREADS $t"; done
+    [ "$cpus" -gt 1 ] && THREADS="$THREADS $cpus"
+fi
+
+BIN=$WORK/bin
+mkdir -p "$BIN"
+
+# The same sources and flags as the README
+cd "$SRC"
+gcc -O2 bench/corpus.c -o "$BIN/corpus" -lm
+gcc -O2 sequential-grep.c pattern.c lazy-dfa.c literal-search.c aho-corasick.c dir-walk.c \
+    -o "$BIN/sequential-grep" -lpthread
+gcc -O2 pgrep.c thread-safe-linked-list.c work-stealing-pool.c lock-free-queue.c reorder-buffer.c \
+    arena.c dir-walk.c uring-reader.c gzip-reader.c trigram-index.c run-stats.c spill-file.c \
+    match-record.c splice-output.c pattern.c lazy-dfa.c literal-search.c aho-corasick.c \
+    -o "$BIN/pgrep" -lpthread -lz
+gcc -O2 ParallelGrep.c literal-search.c aho-corasick.c work-stealing-pool.c lock-free-queue.c \
+    thread-safe-linked-list.c reorder-buffer.c arena.c dir-walk.c uring-reader.c gzip-reader.c \
+    run-stats.c match-record.c splice-output.c -o "$BIN/ParallelGrep" -lpthread -lz
+cd - > /dev/null
+
+# The corpora are written again only when their settings change
+make_corpus() {
+    local path=$1; shift
+    local stamp="$path.settings"
+    if [ ! -e "$path" ] || [ "$(cat "$stamp" 2>/dev/null)" != "$*" ]; then
+        echo "writing $path" >&2
+        rm -rf "$path"
+        "$BIN/corpus" "$@" "$path"
+        echo "$*" > "$stamp"
+    fi
+}
+
+TREE=$WORK/tree
+BIG=$WORK/big.txt
+make_corpus "$TREE" -n "$FILES" -s "$FILE_SIZE" -z "$DISTRIBUTION" -l "$LINE_LENGTH" \
+    -d "$DENSITY" -w "$NEEDLE" -S "$SEED"
+make_corpus "$BIG" -n 1 -s "$BIG_SIZE" -l "$LINE_LENGTH" -d "$DENSITY" -w "$NEEDLE" -S "$SEED"
+
+drop_cache() {
+    sync
+    if ! (echo 3 > /proc/sys/vm/drop_caches) 2> /dev/null; then
+        "$BIN/corpus" -e "$1"
+    fi
+}
+
+# The command line of a tool on a corpus, the threads given with -j
+command_of() {
+    local tool=$1 corpus=$2 threads=$3 flags=
+    [ "$corpus" = tree ] && flags=-r
+    case $tool in
+        grep)            echo "grep $flags $NEEDLE" ;;
+        sequential-grep) echo "$BIN/sequential-grep $flags $NEEDLE" ;;
+        *)               echo "$BIN/$tool $flags -j $threads $NEEDLE" ;;
+    esac
+}
+
+# Prints the median time in seconds of REPEAT runs
+time_runs() {
+    local path=$1 cache=$2; shift 2
+    local times=()
+    for ((i = 0; i < REPEAT; i++)); do
+        [ "$cache" = cold ] && drop_cache "$path"
+        local start=$(date +%s%N)
+        "$@" "$path" > /dev/null || true
+        local end=$(date +%s%N)
+        times+=($((end - start)))
+    done
+    printf '%s\n' "${times[@]}" | sort -n | awk '{ t[NR] = $1 } END {
+        m = NR % 2 ? t[(NR + 1) / 2] : (t[NR / 2] + t[NR / 2 + 1]) / 2
+        printf "%.4f\n", m / 1e9 }'
+}
+
+echo "corpus,cache,tool,threads,seconds,speedup,efficiency" > "$OUT"
+for corpus in tree big; do
+    path=$TREE
+    [ "$corpus" = big ] && path=$BIG
+
+    # Every tool must find the same lines, or its times mean nothing
+    expected=$(grep -r -c "$NEEDLE" "$path" | awk -F: '{ n += $NF } END { print n }')
+    for tool in sequential-grep pgrep ParallelGrep; do
+        found=$($(command_of $tool $corpus 2) "$path" | wc -l)
+        [ "$found" = "$expected" ] ||
+            echo "warning: $tool finds $found lines in $corpus, grep $expected" >&2
+    done
+
+    for cache in $CACHES; do
+        # Warm the cache for the first run
+        [ "$cache" = warm ] && find "$path" -type f -exec cat {} + > /dev/null
+        base=
+        for tool in sequential-grep grep pgrep ParallelGrep; do
+            counts=$THREADS
+            [ "$tool" = grep ] || [ "$tool" = sequential-grep ] && counts=1
+            for threads in $counts; do
+                seconds=$(time_runs "$path" $cache $(command_of $tool $corpus $threads))
+                [ -z "$base" ] && base=$seconds
+                awk -v c=$corpus -v k=$cache -v t=$tool -v n=$threads -v s=$seconds -v b=$base \
+                    'BEGIN { sp = s > 0 ? b / s : 0
+                             printf "%s,%s,%s,%d,%.4f,%.3f,%.3f\n", c, k, t, n, s, sp, sp / n }' |
+                    tee -a "$OUT"
+            done
+        done
+    done
+done
@@ -0,0 +1,330 @@
+/*
+A directory walker which lists the directories in parallel.
+Every directory is a job: the thread doing it reads all the entries with
+getdents64 and schedules a job for each subdirectory, so many threads can
+wait for the disk at once. The type of an entry comes from d_type, so
+only the entries of file systems which don't fill it in are stat'ed.
+The files are handed out one by one by dir_walk_next, in the same depth
+first order as nftw(), so the output of a search can still be ordered.
+dir_walk_next only waits when it reaches a directory which hasn't been
+listed yet, the other directories are listed ahead of it meanwhile.
+Without a schedule function, dir_walk_next lists the directories itself.
+A walk which is stopped doesn't read any more directory, and hands out
+no more file.
+*/
+#define _GNU_SOURCE // For O_DIRECTORY, AT_FDCWD
+#include "dir-walk.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#define GETDENTS_BUF_SIZE (32 * 1024)
+
+/** @brief The records returned by getdents64 */
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/** @brief An entry of a directory */
+typedef struct walk_entry {
+    size_t name; // Offset of the name in the names of the directory
+    struct dir_node *child; // The subdirectory, or NULL for a file
+} walk_entry_t;
+
+/** @brief A directory, freed once all its entries are handed out */
+typedef struct dir_node {
+    char *path;
+    size_t path_len;
+    struct dir_node *parent;
+    dev_t dev; // For finding loops when following symbolic links
+    ino_t ino;
+    bool listed; // Protected by the mutex of the walk
+    char *names; // All the names, NUL terminated one after another
+    size_t names_len;
+    size_t names_capacity;
+    walk_entry_t *entries;
+    size_t num_entries;
+    size_t entries_capacity;
+    size_t next; // The next entry dir_walk_next looks at
+} dir_node_t;
+
+/** @brief The walk structure the user receives */
+typedef struct dir_walk {
+    pthread_mutex_t mutex;
+    pthread_cond_t listed; // Signaled when a directory is listed
+    bool follow_links;
+    atomic_bool stopped; // Set by dir_walk_stop, from any thread
+    dir_walk_schedule_fn *schedule;
+    void *arg;
+    dir_node_t *current; // The directory dir_walk_next is in
+    char *path; // The last path handed out
+    size_t path_capacity;
+} dir_walk_t;
+
+static void *xrealloc(void *ptr, size_t size) {
+    if ((ptr = realloc(ptr, size)) == NULL) {
+        perror("malloc failed in dir-walk");
+        exit(1);
+    }
+    return ptr;
+}
+
+/**
+ * @brief Allocates a directory which isn't listed yet. The path is the
+ * path of the parent and the name, with a single '/' between them.
+ */
+static dir_node_t *node_new(dir_node_t *parent, const char *name, size_t name_len) {
+    dir_node_t *node = xrealloc(NULL, sizeof(dir_node_t));
+    size_t len = 0;
+
+    memset(node, 0, sizeof(dir_node_t));
+    node->parent = parent;
+    node->path = xrealloc(NULL, (parent ? parent->path_len + 1 : 0) + name_len + 1);
+    if (parent != NULL) {
+        memcpy(node->path, parent->path, parent->path_len);
+        len = parent->path_len;
+        if (len == 0 || node->path[len - 1] != '/')
+            node->path[len++] = '/';
+    }
+    memcpy(node->path + len, name, name_len);
+    node->path_len = len + name_len;
+    node->path[node->path_len] = '\0';
+    return node;
+}
+
+static void node_free(dir_node_t *node) {
+    free(node->path);
+    free(node->names);
+    free(node->entries);
+    free(node);
+}
+
+/**
+ * @brief Appends an entry to a directory being listed.
+ */
+static void node_add(dir_node_t *node, const char *name, dir_node_t *child) {
+    size_t len = strlen(name) + 1;
+
+    if (node->names_len + len > node->names_capacity) {
+        node->names_capacity = 2 * (node->names_len + len);
+        node->names = xrealloc(node->names, node->names_capacity);
+    }
+    if (node->num_entries == node->entries_capacity) {
+        node->entries_capacity = node->entries_capacity ? 2 * node->entries_capacity : 16;
+        node->entries = xrealloc(node->entries, node->entries_capacity * sizeof(walk_entry_t));
+    }
+    memcpy(node->names + node->names_len, name, len);
+    node->entries[node->num_entries].name = node->names_len;
+    node->entries[node->num_entries].child = child;
+    node->num_entries++;
+    node->names_len += len;
+}
+
+/**
+ * @brief Checks whether a directory is one of its own ancestors, which
+ * happens when a symbolic link points upwards.
+ */
+static bool is_loop(dir_node_t *node) {
+    for (dir_node_t *up = node->parent; up != NULL; up = up->parent) {
+        if (up->dev == node->dev && up->ino == node->ino)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Dynamically allocates a new walk of the tree under root. Exits
+ * only on malloc error.
+ *
+ * @param root the directory to walk
+ * @param follow_links whether symbolic links are followed, like ftw(),
+ * or not, like nftw() with FTW_PHYS
+ * @param schedule called for every directory to list, from the thread
+ * calling this or dir_walk_list. NULL to list them in dir_walk_next
+ * @param arg passed to schedule
+ * @return dir_walk_t* a pointer to the allocated walk
+ */
+dir_walk_t *dir_walk_new(const char *root, bool follow_links,
+                         dir_walk_schedule_fn *schedule, void *arg) {
+    dir_walk_t *walk = xrealloc(NULL, sizeof(dir_walk_t));
+    size_t len = strlen(root);
+
+    // The trailing '/' are dropped like nftw() does
+    while (len > 1 && root[len - 1] == '/')
+        len--;
+    pthread_mutex_init(&walk->mutex, NULL);
+    pthread_cond_init(&walk->listed, NULL);
+    walk->follow_links = follow_links;
+    atomic_init(&walk->stopped, false);
+    walk->schedule = schedule;
+    walk->arg = arg;
+    walk->current = node_new(NULL, root, len);
+    walk->path = NULL;
+    walk->path_capacity = 0;
+    if (schedule != NULL)
+        schedule(walk->current, arg);
+    return walk;
+}
+
+/**
+ * @brief Lists a directory scheduled by the walk, and schedules its
+ * subdirectories. Directories which can't be read are left empty.
+ *
+ * @param walk the walk supplied from the user
+ * @param dir the directory passed to the schedule function
+ */
+void dir_walk_list(dir_walk_t *walk, void *dir) {
+    dir_node_t *node = dir;
+    char buf[GETDENTS_BUF_SIZE] __attribute__((aligned(8)));
+    struct stat sb;
+    long num;
+    int fd;
+
+    // A stopped walk leaves the directories empty
+    fd = atomic_load(&walk->stopped) ? -1 :
+         openat(AT_FDCWD, node->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd != -1 && walk->follow_links) {
+        if (fstat(fd, &sb) == -1) {
+            close(fd);
+            fd = -1;
+        } else {
+            node->dev = sb.st_dev;
+            node->ino = sb.st_ino;
+            if (is_loop(node)) {
+                close(fd);
+                fd = -1;
+            }
+        }
+    }
+
+    while (fd != -1 && (num = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+        for (long pos = 0; pos < num;) {
+            struct linux_dirent64 *ent = (struct linux_dirent64 *)(buf + pos);
+            const char *name = ent->d_name;
+            unsigned char type = ent->d_type;
+            pos += ent->d_reclen;
+
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                continue;
+            // Only stat when the type is unknown or a link has to be followed
+            if (type == DT_UNKNOWN || (type == DT_LNK && walk->follow_links)) {
+                if (fstatat(fd, name, &sb, walk->follow_links ? 0 : AT_SYMLINK_NOFOLLOW) == -1)
+                    continue;
+                type = S_ISDIR(sb.st_mode) ? DT_DIR : S_ISLNK(sb.st_mode) ? DT_LNK : DT_REG;
+            }
+            if (type == DT_LNK)
+                continue;
+            node_add(node, name, type == DT_DIR ? node_new(node, name, strlen(name)) : NULL);
+        }
+    }
+    if (fd != -1)
+        close(fd);
+
+    // Schedule the subdirectories before the directory is marked as
+    // listed, dir_walk_next may free it right after
+    for (size_t i = 0; walk->schedule != NULL && i < node->num_entries; i++) {
+        if (node->entries[i].child != NULL)
+            walk->schedule(node->entries[i].child, walk->arg);
+    }
+    pthread_mutex_lock(&walk->mutex);
+    node->listed = true;
+    pthread_cond_broadcast(&walk->listed);
+    pthread_mutex_unlock(&walk->mutex);
+}
+
+/**
+ * @brief Waits until a directory is listed, or lists it if there is no
+ * schedule function.
+ */
+static void wait_listed(dir_walk_t *walk, dir_node_t *node) {
+    if (walk->schedule == NULL) {
+        if (!node->listed)
+            dir_walk_list(walk, node);
+        return;
+    }
+    pthread_mutex_lock(&walk->mutex);
+    while (!node->listed)
+        pthread_cond_wait(&walk->listed, &walk->mutex);
+    pthread_mutex_unlock(&walk->mutex);
+}
+
+/**
+ * @brief Gives the next file of the walk, in depth first order. Only one
+ * thread may call it.
+ *
+ * @param walk the walk supplied from the user
+ * @return the path of the file, valid until the next call, or NULL once
+ * all the files are handed out
+ */
+const char *dir_walk_next(dir_walk_t *walk) {
+    dir_node_t *node = walk->current;
+
+    while (node != NULL) {
+        wait_listed(walk, node);
+        if (node->next < node->num_entries) {
+            walk_entry_t *entry = &node->entries[node->next++];
+            // The subdirectories are still visited after a stop, since they
+            // may be scheduled, only to free them
+            if (entry->child != NULL) {
+                node = walk->current = entry->child;
+                continue;
+            }
+            if (atomic_load(&walk->stopped))
+                continue;
+            const char *name = node->names + entry->name;
+            size_t len = strlen(name);
+            if (node->path_len + len + 2 > walk->path_capacity) {
+                walk->path_capacity = 2 * (node->path_len + len + 2);
+                walk->path = xrealloc(walk->path, walk->path_capacity);
+            }
+            memcpy(walk->path, node->path, node->path_len);
+            size_t pos = node->path_len;
+            if (pos == 0 || walk->path[pos - 1] != '/')
+                walk->path[pos++] = '/';
+            memcpy(walk->path + pos, name, len + 1);
+            return walk->path;
+        }
+        // All the entries are handed out, go back to the parent
+        walk->current = node->parent;
+        node_free(node);
+        node = walk->current;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Stops the walk early: the directories which are not read yet
+ * stay empty, and dir_walk_next returns NULL once it has gone through
+ * the directories already scheduled. May be called from any thread.
+ *
+ * @param walk the walk supplied from the user
+ */
+void dir_walk_stop(dir_walk_t *walk) {
+    atomic_store(&walk->stopped, true);
+}
+
+/**
+ * @brief Frees the walk. dir_walk_next must have returned NULL, so that
+ * no directory is being listed.
+ *
+ * @param walk the walk supplied from the user
+ */
+void dir_walk_free(dir_walk_t *walk) {
+    pthread_mutex_destroy(&walk->mutex);
+    pthread_cond_destroy(&walk->listed);
+    free(walk->path);
+    free(walk);
+}
@@ -0,0 +1,19 @@
+#ifndef DIR_WALK_INCLUDED
+#define DIR_WALK_INCLUDED
+
+#include <stdbool.h>
+
+typedef struct dir_walk dir_walk_t;
+
+/* Called when a directory should be listed, the directory is passed to
+   dir_walk_list by any thread */
+typedef void (dir_walk_schedule_fn)(void *dir, void *arg);
+
+dir_walk_t *dir_walk_new(const char *root, bool follow_links,
+                         dir_walk_schedule_fn *schedule, void *arg);
+void dir_walk_list(dir_walk_t *walk, void *dir);
+const char *dir_walk_next(dir_walk_t *walk);
+void dir_walk_stop(dir_walk_t *walk);
+void dir_walk_free(dir_walk_t *walk);
+
+#endif
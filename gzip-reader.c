@@ -0,0 +1,601 @@
+/*
+A reader of gzip data which decompresses ahead of the search.
+Threads of the reader inflate the data into blocks, and gzip_reader_next
+hands the blocks out in order, so the caller searches one block while
+the next ones are inflated. Each stream of blocks holds at most
+UNIT_BLOCKS blocks, which bounds the memory whatever the size of the
+data. The blocks handed out only hold whole lines, a line cut by the end
+of a block is copied into a buffer of its own.
+A gzip file may be made of several members, e.g. from bgzip, pigz -i or
+cat a.gz b.gz, and every member can be inflated by itself. The
+compressed data is cut into units of UNIT_SIZE bytes, and each unit
+inflates the members which start in it, beginning at the first gzip
+header found in it, so the members of several units are inflated in
+parallel. Such a header may also be a chance match inside a member, so
+the blocks of a unit are only handed out if the unit before it ended
+exactly where this one began, otherwise the unit is inflated again from
+there. A file of a single member is simply inflated by one thread.
+*/
+#define _GNU_SOURCE // For memrchr()
+#include "gzip-reader.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#define BLOCK_SIZE (1024 * 1024)
+#define UNIT_SIZE (1024 * 1024) // Compressed bytes per unit
+#define UNIT_BLOCKS 4 // Blocks a unit may inflate ahead of the caller
+#define UNITS_AHEAD 2 // Units inflated ahead of the caller, per thread
+#define NO_MEMBER SIZE_MAX
+
+/** @brief A block of inflated data */
+typedef struct gz_block {
+    struct gz_block *next;
+    size_t len;
+    char data[BLOCK_SIZE];
+} gz_block_t;
+
+enum unit_state { UNIT_WAITING, UNIT_RUNNING, UNIT_DONE };
+
+/** @brief The members starting in a range of the compressed data */
+typedef struct gz_unit {
+    enum unit_state state;
+    size_t start; // Where the first member is known to start, or NO_MEMBER
+    size_t first; // Where the inflated members start, or NO_MEMBER if none
+    size_t end; // Where the last inflated member ends
+    bool settled; // first won't change anymore
+    bool failed;
+    bool cancelled; // The blocks are not wanted anymore
+    gz_block_t *head; // The blocks inflated and not handed out
+    gz_block_t *tail;
+    int num_blocks;
+} gz_unit_t;
+
+/** @brief The reader structure the user receives */
+typedef struct gzip_reader {
+    const char *data;
+    size_t len;
+    pthread_mutex_t mutex; // Protects everything but the data and the carry
+    pthread_cond_t changed; // Signaled on any change of a unit
+    pthread_t *threads;
+    int num_threads;
+    gz_unit_t *units;
+    size_t num_units;
+    size_t ahead; // Units which may be inflated past the current one
+    size_t current; // The unit handed out
+    size_t expected; // Where the current unit has to start
+    bool checked; // The current unit starts where expected
+    bool closing;
+    bool failed;
+    gz_block_t *free_blocks;
+    // Only used by the caller
+    gz_block_t *block; // The block handed out
+    size_t pos; // The part of the block not handed out yet
+    char *carry; // A line cut by the end of a block
+    size_t carry_len;
+    size_t carry_capacity;
+    bool carry_out; // The carry was handed out, empty it on the next call
+} gzip_reader_t;
+
+enum decode_result { DECODE_OK, DECODE_BAD_START, DECODE_FAILED, DECODE_CANCELLED };
+
+static void *xrealloc(void *ptr, size_t size) {
+    if ((ptr = realloc(ptr, size)) == NULL) {
+        perror("malloc failed in gzip-reader");
+        exit(1);
+    }
+    return ptr;
+}
+
+/**
+ * @brief Checks whether data starts with a gzip header.
+ *
+ * @param data the data to check
+ * @param len the length of the data
+ * @return true if the data is gzip compressed
+ */
+bool gzip_reader_is_gzip(const char *data, size_t len) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    // Magic, deflate and no reserved flag
+    return len >= 18 && bytes[0] == 0x1f && bytes[1] == 0x8b && bytes[2] == 8 && (bytes[3] & 0xe0) == 0;
+}
+
+/**
+ * @brief Gives the end of the range of a unit.
+ */
+static size_t unit_limit(gzip_reader_t *reader, size_t index) {
+    size_t limit = (index + 1) * UNIT_SIZE;
+    return limit < reader->len ? limit : reader->len;
+}
+
+/**
+ * @brief Finds the first possible gzip header from from to to.
+ */
+static size_t find_header(gzip_reader_t *reader, size_t from, size_t to) {
+    const char *found;
+
+    while (from < to && (found = memchr(reader->data + from, 0x1f, to - from)) != NULL) {
+        from = found - reader->data;
+        if (gzip_reader_is_gzip(found, reader->len - from))
+            return from;
+        from++;
+    }
+    return NO_MEMBER;
+}
+
+static gz_block_t *take_block(gzip_reader_t *reader) {
+    gz_block_t *block;
+
+    pthread_mutex_lock(&reader->mutex);
+    if ((block = reader->free_blocks) != NULL)
+        reader->free_blocks = block->next;
+    pthread_mutex_unlock(&reader->mutex);
+    if (block == NULL)
+        block = xrealloc(NULL, sizeof(gz_block_t));
+    block->next = NULL;
+    block->len = 0;
+    return block;
+}
+
+/**
+ * @brief Gives back the blocks of a unit. The mutex must be held.
+ */
+static void drop_blocks(gzip_reader_t *reader, gz_unit_t *unit) {
+    while (unit->head != NULL) {
+        gz_block_t *block = unit->head;
+        unit->head = block->next;
+        block->next = reader->free_blocks;
+        reader->free_blocks = block;
+    }
+    unit->tail = NULL;
+    unit->num_blocks = 0;
+}
+
+/**
+ * @brief Marks where the inflated members of a unit start, once they
+ * can't be given up anymore. The mutex must be held.
+ */
+static void settle(gzip_reader_t *reader, gz_unit_t *unit, size_t first) {
+    if (!unit->settled) {
+        unit->first = first;
+        unit->settled = true;
+        pthread_cond_broadcast(&reader->changed);
+    }
+}
+
+/**
+ * @brief Appends an inflated block to a unit, waiting while the unit has
+ * UNIT_BLOCKS blocks. A unit which has to wait can't give up its first
+ * member anymore, since its blocks must be kept.
+ *
+ * @return false if the blocks of the unit are not wanted anymore
+ */
+static bool push_block(gzip_reader_t *reader, gz_unit_t *unit, gz_block_t *block, size_t first) {
+    bool wanted;
+
+    pthread_mutex_lock(&reader->mutex);
+    while (unit->num_blocks == UNIT_BLOCKS && !unit->cancelled && !reader->closing) {
+        settle(reader, unit, first);
+        pthread_cond_wait(&reader->changed, &reader->mutex);
+    }
+    wanted = !unit->cancelled && !reader->closing;
+    if (wanted) {
+        if (unit->tail != NULL)
+            unit->tail->next = block;
+        else
+            unit->head = block;
+        unit->tail = block;
+        unit->num_blocks++;
+        pthread_cond_broadcast(&reader->changed);
+    } else {
+        block->next = reader->free_blocks;
+        reader->free_blocks = block;
+    }
+    pthread_mutex_unlock(&reader->mutex);
+    return wanted;
+}
+
+/**
+ * @brief Ends a unit on bad data. A unit which can't give up its first
+ * member anymore keeps what was inflated up to the error, like gzip does.
+ */
+static enum decode_result decode_failed(gzip_reader_t *reader, gz_unit_t *unit,
+                                        gz_block_t *block, size_t first) {
+    bool settled;
+
+    pthread_mutex_lock(&reader->mutex);
+    if (!(settled = unit->settled))
+        drop_blocks(reader, unit);
+    pthread_mutex_unlock(&reader->mutex);
+    if (settled && block->len > 0) {
+        push_block(reader, unit, block, first);
+        return DECODE_FAILED;
+    }
+    pthread_mutex_lock(&reader->mutex);
+    block->next = reader->free_blocks;
+    reader->free_blocks = block;
+    pthread_mutex_unlock(&reader->mutex);
+    return settled ? DECODE_FAILED : DECODE_BAD_START;
+}
+
+/**
+ * @brief Inflates the members from first on, up to the first member which
+ * starts past the end of the unit.
+ */
+static enum decode_result decode_members(gzip_reader_t *reader, gz_unit_t *unit, size_t first,
+                                         size_t limit, z_stream *strm) {
+    gz_block_t *block = take_block(reader);
+    size_t pos = first;
+    int ret;
+
+    while (pos < limit) {
+        inflateReset(strm);
+        strm->next_in = (Bytef *)(reader->data + pos);
+        strm->avail_in = 0;
+        do {
+            if (block->len == BLOCK_SIZE) {
+                if (!push_block(reader, unit, block, first))
+                    return DECODE_CANCELLED;
+                block = take_block(reader);
+            }
+            if (strm->avail_in == 0) {
+                size_t left = reader->len - ((const char *)strm->next_in - reader->data);
+                strm->avail_in = left > UINT_MAX ? UINT_MAX : left;
+            }
+            strm->next_out = (Bytef *)(block->data + block->len);
+            strm->avail_out = BLOCK_SIZE - block->len;
+            ret = inflate(strm, Z_NO_FLUSH);
+            block->len = BLOCK_SIZE - strm->avail_out;
+            // No progress with all the input given means truncated data
+            if (ret != Z_OK && ret != Z_STREAM_END)
+                return decode_failed(reader, unit, block, first);
+        } while (ret != Z_STREAM_END);
+
+        pos = (const char *)strm->next_in - reader->data;
+        // A complete member with a good check value is a real one
+        pthread_mutex_lock(&reader->mutex);
+        settle(reader, unit, first);
+        pthread_mutex_unlock(&reader->mutex);
+        // Like gzip, anything else than a member after a member is ignored
+        if (!gzip_reader_is_gzip(reader->data + pos, reader->len - pos))
+            pos = reader->len;
+    }
+
+    // The block belongs to the caller once pushed
+    if (block->len > 0) {
+        if (!push_block(reader, unit, block, first))
+            return DECODE_CANCELLED;
+        pthread_mutex_lock(&reader->mutex);
+    } else {
+        pthread_mutex_lock(&reader->mutex);
+        block->next = reader->free_blocks;
+        reader->free_blocks = block;
+    }
+    unit->end = pos;
+    settle(reader, unit, first);
+    pthread_mutex_unlock(&reader->mutex);
+    return DECODE_OK;
+}
+
+/**
+ * @brief Inflates the members of a unit, from the header the unit is
+ * known to start with, or else from the first header in it which turns
+ * out to start a member.
+ */
+static void decode_unit(gzip_reader_t *reader, size_t index, z_stream *strm) {
+    gz_unit_t *unit = &reader->units[index];
+    size_t from = index * UNIT_SIZE;
+    size_t limit = unit_limit(reader, index);
+    bool known = unit->start != NO_MEMBER;
+    enum decode_result result = DECODE_BAD_START;
+    size_t first = known ? unit->start : find_header(reader, from, limit);
+
+    // The caller may take the blocks of a known member at once
+    if (known) {
+        pthread_mutex_lock(&reader->mutex);
+        settle(reader, unit, first);
+        pthread_mutex_unlock(&reader->mutex);
+    }
+    while (first != NO_MEMBER) {
+        result = decode_members(reader, unit, first, limit, strm);
+        if (result != DECODE_BAD_START || known)
+            break;
+        first = find_header(reader, first + 1, limit);
+    }
+
+    pthread_mutex_lock(&reader->mutex);
+    if (first == NO_MEMBER || result == DECODE_BAD_START) {
+        settle(reader, unit, NO_MEMBER);
+    } else if (result == DECODE_FAILED) {
+        unit->failed = true;
+    }
+    pthread_mutex_unlock(&reader->mutex);
+}
+
+/**
+ * @brief The threads of the reader, which inflate the first waiting
+ * unit in the window of units after the current one.
+ */
+static void *decode_units(void *arg) {
+    gzip_reader_t *reader = arg;
+    z_stream strm;
+
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit2(&strm, 16 + MAX_WBITS) != Z_OK) {
+        perror("inflateInit2 failed in gzip-reader");
+        exit(1);
+    }
+    pthread_mutex_lock(&reader->mutex);
+    while (!reader->closing) {
+        size_t index = reader->current, end = reader->current + reader->ahead;
+        if (end > reader->num_units)
+            end = reader->num_units;
+        while (index < end && reader->units[index].state != UNIT_WAITING)
+            index++;
+        if (index == end) {
+            pthread_cond_wait(&reader->changed, &reader->mutex);
+            continue;
+        }
+        reader->units[index].state = UNIT_RUNNING;
+        pthread_mutex_unlock(&reader->mutex);
+
+        decode_unit(reader, index, &strm);
+
+        pthread_mutex_lock(&reader->mutex);
+        reader->units[index].state = UNIT_DONE;
+        pthread_cond_broadcast(&reader->changed);
+    }
+    pthread_mutex_unlock(&reader->mutex);
+    inflateEnd(&strm);
+    return NULL;
+}
+
+static void reset_unit(gz_unit_t *unit) {
+    unit->state = UNIT_WAITING;
+    unit->start = NO_MEMBER;
+    unit->first = NO_MEMBER;
+    unit->end = NO_MEMBER;
+    unit->settled = false;
+    unit->failed = false;
+    unit->cancelled = false;
+    unit->head = unit->tail = NULL;
+    unit->num_blocks = 0;
+}
+
+/**
+ * @brief Inflates the current unit again from where it has to start.
+ * The units after it are given up too, so that no thread stays stuck on
+ * one of them while the current unit waits. The mutex must be held.
+ */
+static void redo_current(gzip_reader_t *reader) {
+    size_t end = reader->current + reader->ahead;
+    bool running;
+
+    if (end > reader->num_units)
+        end = reader->num_units;
+    for (size_t i = reader->current; i < end; i++)
+        reader->units[i].cancelled = true;
+    pthread_cond_broadcast(&reader->changed);
+    do {
+        running = false;
+        for (size_t i = reader->current; i < end; i++)
+            running |= reader->units[i].state == UNIT_RUNNING;
+        if (running)
+            pthread_cond_wait(&reader->changed, &reader->mutex);
+    } while (running);
+
+    for (size_t i = reader->current; i < end; i++) {
+        drop_blocks(reader, &reader->units[i]);
+        reset_unit(&reader->units[i]);
+    }
+    reader->units[reader->current].start = reader->expected;
+    pthread_cond_broadcast(&reader->changed);
+}
+
+/**
+ * @brief Takes the next block in the order of the data, skipping the
+ * units which the members of the previous ones cover. The mutex must be
+ * held.
+ *
+ * @return the block, or NULL at the end of the data or on an error
+ */
+static gz_block_t *next_block(gzip_reader_t *reader) {
+    while (reader->current < reader->num_units && !reader->failed) {
+        gz_unit_t *unit = &reader->units[reader->current];
+
+        if (!reader->checked) {
+            if (reader->expected >= unit_limit(reader, reader->current)) {
+                unit->cancelled = true;
+                drop_blocks(reader, unit);
+                reader->current++;
+                pthread_cond_broadcast(&reader->changed);
+                continue;
+            }
+            while (!unit->settled && unit->state != UNIT_DONE)
+                pthread_cond_wait(&reader->changed, &reader->mutex);
+            if (unit->first != reader->expected) {
+                redo_current(reader);
+                continue;
+            }
+            reader->checked = true;
+        }
+
+        while (unit->head == NULL && unit->state != UNIT_DONE)
+            pthread_cond_wait(&reader->changed, &reader->mutex);
+        if (unit->head != NULL) {
+            gz_block_t *block = unit->head;
+            if ((unit->head = block->next) == NULL)
+                unit->tail = NULL;
+            unit->num_blocks--;
+            pthread_cond_broadcast(&reader->changed);
+            return block;
+        }
+        if (unit->failed) {
+            reader->failed = true;
+            break;
+        }
+        reader->expected = unit->end;
+        reader->checked = false;
+        reader->current++;
+        pthread_cond_broadcast(&reader->changed);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Dynamically allocates a new reader of gzip data and starts its
+ * threads. Exits only on malloc error.
+ *
+ * @param data the compressed data, which must stay valid until the
+ * reader is freed
+ * @param len the length of the data
+ * @param num_threads the number of threads inflating the data
+ * @return gzip_reader_t* a pointer to the allocated reader
+ */
+gzip_reader_t *gzip_reader_new(const char *data, size_t len, int num_threads) {
+    gzip_reader_t *reader = xrealloc(NULL, sizeof(gzip_reader_t));
+
+    memset(reader, 0, sizeof(gzip_reader_t));
+    if (num_threads < 1)
+        num_threads = 1;
+    reader->data = data;
+    reader->len = len;
+    pthread_mutex_init(&reader->mutex, NULL);
+    pthread_cond_init(&reader->changed, NULL);
+    reader->num_units = (len + UNIT_SIZE - 1) / UNIT_SIZE;
+    reader->units = xrealloc(NULL, (reader->num_units ? reader->num_units : 1) * sizeof(gz_unit_t));
+    for (size_t i = 0; i < reader->num_units; i++)
+        reset_unit(&reader->units[i]);
+    if (reader->num_units > 0)
+        reader->units[0].start = 0;
+    reader->ahead = UNITS_AHEAD * num_threads;
+    reader->num_threads = num_threads;
+    reader->threads = xrealloc(NULL, num_threads * sizeof(pthread_t));
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&reader->threads[i], NULL, decode_units, reader)) {
+            perror("pthread_create failed in gzip-reader");
+            exit(1);
+        }
+    }
+    return reader;
+}
+
+static void add_carry(gzip_reader_t *reader, const char *data, size_t len) {
+    if (reader->carry_len + len > reader->carry_capacity) {
+        reader->carry_capacity = 2 * (reader->carry_len + len);
+        reader->carry = xrealloc(reader->carry, reader->carry_capacity);
+    }
+    memcpy(reader->carry + reader->carry_len, data, len);
+    reader->carry_len += len;
+}
+
+/**
+ * @brief Gives the next lines of the inflated data, in order. Every line
+ * ends with a newline, except the last line of the data if it has none.
+ * Only one thread may call it.
+ *
+ * @param reader the reader supplied from the user
+ * @param len set to the length of the lines
+ * @return the lines, valid until the next call, or NULL once all the
+ * data is handed out or on an error
+ */
+const char *gzip_reader_next(gzip_reader_t *reader, size_t *len) {
+    if (reader->carry_out) {
+        reader->carry_len = 0;
+        reader->carry_out = false;
+    }
+    for (;;) {
+        gz_block_t *block = reader->block;
+        if (block != NULL && reader->pos < block->len) {
+            const char *data = block->data + reader->pos;
+            size_t size = block->len - reader->pos;
+            const char *newline;
+
+            // The line cut by the previous block is completed first
+            if (reader->carry_len > 0) {
+                if ((newline = memchr(data, '\n', size)) == NULL) {
+                    add_carry(reader, data, size);
+                    reader->pos = block->len;
+                    continue;
+                }
+                add_carry(reader, data, newline + 1 - data);
+                reader->pos += newline + 1 - data;
+                reader->carry_out = true;
+                *len = reader->carry_len;
+                return reader->carry;
+            }
+            reader->pos = block->len;
+            if ((newline = memrchr(data, '\n', size)) == NULL) {
+                add_carry(reader, data, size);
+                continue;
+            }
+            add_carry(reader, newline + 1, data + size - newline - 1);
+            *len = newline + 1 - data;
+            return data;
+        }
+
+        pthread_mutex_lock(&reader->mutex);
+        if (block != NULL) {
+            block->next = reader->free_blocks;
+            reader->free_blocks = block;
+        }
+        reader->block = next_block(reader);
+        reader->pos = 0;
+        pthread_mutex_unlock(&reader->mutex);
+        if (reader->block == NULL) {
+            if (reader->carry_len == 0)
+                return NULL;
+            reader->carry_out = true;
+            *len = reader->carry_len;
+            return reader->carry;
+        }
+    }
+}
+
+/**
+ * @brief Checks whether the data turned out to be corrupt or truncated.
+ *
+ * @param reader the reader supplied from the user
+ * @return true if gzip_reader_next stopped on an error
+ */
+bool gzip_reader_failed(gzip_reader_t *reader) {
+    return reader->failed;
+}
+
+/**
+ * @brief Stops the threads of the reader and frees it. May be called
+ * before all the data is handed out.
+ *
+ * @param reader the reader supplied from the user
+ */
+void gzip_reader_free(gzip_reader_t *reader) {
+    pthread_mutex_lock(&reader->mutex);
+    reader->closing = true;
+    pthread_cond_broadcast(&reader->changed);
+    pthread_mutex_unlock(&reader->mutex);
+    for (int i = 0; i < reader->num_threads; i++)
+        pthread_join(reader->threads[i], NULL);
+
+    for (size_t i = 0; i < reader->num_units; i++)
+        drop_blocks(reader, &reader->units[i]);
+    if (reader->block != NULL) {
+        reader->block->next = reader->free_blocks;
+        reader->free_blocks = reader->block;
+    }
+    while (reader->free_blocks != NULL) {
+        gz_block_t *block = reader->free_blocks;
+        reader->free_blocks = block->next;
+        free(block);
+    }
+    pthread_mutex_destroy(&reader->mutex);
+    pthread_cond_destroy(&reader->changed);
+    free(reader->threads);
+    free(reader->units);
+    free(reader->carry);
+    free(reader);
+}
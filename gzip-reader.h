@@ -0,0 +1,15 @@
+#ifndef GZIP_READER_INCLUDED
+#define GZIP_READER_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct gzip_reader gzip_reader_t;
+
+bool gzip_reader_is_gzip(const char *data, size_t len);
+gzip_reader_t *gzip_reader_new(const char *data, size_t len, int num_threads);
+const char *gzip_reader_next(gzip_reader_t *reader, size_t *len);
+bool gzip_reader_failed(gzip_reader_t *reader);
+void gzip_reader_free(gzip_reader_t *reader);
+
+#endif
@@ -0,0 +1,704 @@
+/*
+A regular expression matcher which runs in linear time.
+The basic regular expression is parsed into a syntax tree and compiled
+into a Thompson NFA. The NFA is simulated by a DFA whose states are
+built lazily, only when the input reaches them, and cached. Every thread
+has its own cache, and when a cache grows beyond the memory budget it is
+flushed and rebuilt from the current state, so the memory is bounded and
+every input byte still costs at most one NFA step.
+The supported subset is what we use in practice: characters, '.',
+bracket expressions, '*', '\+', '\?', '\{m,n\}', '\(\)', '\|', '^' and '$'.
+lazy_dfa_compile returns NULL for anything else, such as back references
+and word boundaries, and the caller should fall back to regexec.
+*/
+#include "lazy-dfa.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#define MAX_NFA_STATES 4096
+#define MAX_REPEAT 255
+
+/* ===================== Syntax tree ===================== */
+
+enum { AST_SET, AST_CAT, AST_ALT, AST_REPEAT, AST_BOL, AST_EOL, AST_EMPTY };
+
+typedef struct ast {
+    int type;
+    struct ast *left;
+    struct ast *right;
+    int min;
+    int max; // -1 if unbounded
+    uint32_t set[8];
+} ast_t;
+
+typedef struct parser {
+    const char *src;
+    size_t pos;
+    size_t len;
+    bool error; // Invalid or unsupported
+} parser_t;
+
+static ast_t *ast_new(parser_t *p, int type, ast_t *left, ast_t *right) {
+    ast_t *node;
+    if ((node = calloc(1, sizeof(ast_t))) == NULL) {
+        perror("malloc failed in lazy-dfa: ast_new");
+        exit(1);
+    }
+    node->type = type;
+    node->left = left;
+    node->right = right;
+    return node;
+}
+
+static void ast_free(ast_t *node) {
+    if (node == NULL)
+        return;
+    ast_free(node->left);
+    ast_free(node->right);
+    free(node);
+}
+
+static void set_add(uint32_t *set, unsigned char c) {
+    set[c >> 5] |= 1u << (c & 31);
+}
+
+static bool set_has(const uint32_t *set, unsigned char c) {
+    return set[c >> 5] & (1u << (c & 31));
+}
+
+static void set_add_class(uint32_t *set, int (*is_class)(int), bool negate) {
+    for (int c = 0; c < 256; c++) {
+        if ((is_class(c) != 0) != negate)
+            set_add(set, c);
+    }
+}
+
+static int is_word(int c) {
+    return isalnum(c) || c == '_';
+}
+
+static bool at(parser_t *p, const char *s) {
+    return strncmp(p->src + p->pos, s, strlen(s)) == 0;
+}
+
+static ast_t *parse_regex(parser_t *p, int depth);
+
+/**
+ * @brief Parses a bracket expression, p->pos is at the '['.
+ */
+static ast_t *parse_bracket(parser_t *p) {
+    static const struct {
+        const char *name;
+        int (*fn)(int);
+    } classes[] = {
+        {"alpha", isalpha}, {"digit", isdigit}, {"alnum", isalnum}, {"upper", isupper},
+        {"lower", islower}, {"space", isspace}, {"blank", isblank}, {"punct", ispunct},
+        {"print", isprint}, {"graph", isgraph}, {"cntrl", iscntrl}, {"xdigit", isxdigit},
+    };
+    ast_t *node = ast_new(p, AST_SET, NULL, NULL);
+    bool negate = false;
+    bool first = true;
+
+    p->pos++;
+    if (p->pos < p->len && p->src[p->pos] == '^') {
+        negate = true;
+        p->pos++;
+    }
+    while (true) {
+        if (p->pos >= p->len) {
+            p->error = true;
+            return node;
+        }
+        unsigned char c = p->src[p->pos];
+        if (c == ']' && !first) {
+            p->pos++;
+            break;
+        }
+        first = false;
+        if (c == '[' && p->src[p->pos + 1] == ':') {
+            const char *name = p->src + p->pos + 2;
+            const char *close = strstr(name, ":]");
+            size_t i;
+            if (close == NULL) {
+                p->error = true;
+                return node;
+            }
+            for (i = 0; i < sizeof(classes) / sizeof(classes[0]); i++) {
+                if (strlen(classes[i].name) == (size_t)(close - name) &&
+                    strncmp(classes[i].name, name, close - name) == 0)
+                    break;
+            }
+            if (i == sizeof(classes) / sizeof(classes[0])) {
+                p->error = true;
+                return node;
+            }
+            set_add_class(node->set, classes[i].fn, false);
+            p->pos = close - p->src + 2;
+            continue;
+        }
+        if (c == '[' && (p->src[p->pos + 1] == '.' || p->src[p->pos + 1] == '=')) {
+            // Collating elements and equivalence classes are not supported
+            p->error = true;
+            return node;
+        }
+        p->pos++;
+        if (p->src[p->pos] == '-' && p->pos + 1 < p->len && p->src[p->pos + 1] != ']') {
+            unsigned char hi = p->src[p->pos + 1];
+            if (hi == '[' || hi < c) {
+                p->error = true;
+                return node;
+            }
+            for (int i = c; i <= hi; i++)
+                set_add(node->set, i);
+            p->pos += 2;
+            continue;
+        }
+        set_add(node->set, c);
+    }
+    if (negate) {
+        for (int i = 0; i < 8; i++)
+            node->set[i] = ~node->set[i];
+    }
+    return node;
+}
+
+/**
+ * @brief Parses a single atom.
+ */
+static ast_t *parse_atom(parser_t *p, int depth) {
+    unsigned char c = p->src[p->pos];
+    ast_t *node;
+
+    if (c == '[')
+        return parse_bracket(p);
+
+    if (c == '\\') {
+        if (p->pos + 1 >= p->len) {
+            p->error = true;
+            return ast_new(p, AST_EMPTY, NULL, NULL);
+        }
+        unsigned char next = p->src[p->pos + 1];
+        p->pos += 2;
+        if (next == '(') {
+            node = parse_regex(p, depth + 1);
+            if (!at(p, "\\)")) {
+                p->error = true;
+                return node;
+            }
+            p->pos += 2;
+            return node;
+        }
+        node = ast_new(p, AST_SET, NULL, NULL);
+        switch (next) {
+            case 'w':
+            case 'W':
+                set_add_class(node->set, is_word, next == 'W');
+                break;
+            case 's':
+            case 'S':
+                set_add_class(node->set, isspace, next == 'S');
+                break;
+            case '{': case '+': case '?': case ')': case '|':
+            case '<': case '>': case 'b': case 'B': case '`': case '\'':
+            case '1': case '2': case '3': case '4': case '5':
+            case '6': case '7': case '8': case '9':
+                // Back references and word boundaries can't be done by a DFA
+                p->error = true;
+                break;
+            default:
+                set_add(node->set, next);
+        }
+        return node;
+    }
+
+    node = ast_new(p, AST_SET, NULL, NULL);
+    p->pos++;
+    if (c == '.') {
+        for (int i = 0; i < 8; i++)
+            node->set[i] = ~0u;
+    } else {
+        set_add(node->set, c);
+    }
+    return node;
+}
+
+/**
+ * @brief Parses the repetitions following an atom.
+ */
+static ast_t *parse_postfix(parser_t *p, ast_t *atom) {
+    while (p->pos < p->len && !p->error) {
+        int min, max;
+        if (p->src[p->pos] == '*') {
+            min = 0;
+            max = -1;
+            p->pos++;
+        } else if (at(p, "\\+")) {
+            min = 1;
+            max = -1;
+            p->pos += 2;
+        } else if (at(p, "\\?")) {
+            min = 0;
+            max = 1;
+            p->pos += 2;
+        } else if (at(p, "\\{")) {
+            char *end;
+            p->pos += 2;
+            min = strtol(p->src + p->pos, &end, 10);
+            if (end == p->src + p->pos) {
+                p->error = true;
+                break;
+            }
+            max = min;
+            if (*end == ',') {
+                const char *n = end + 1;
+                max = strtol(n, &end, 10);
+                if (end == n)
+                    max = -1;
+            }
+            if (strncmp(end, "\\}", 2) != 0 || min > MAX_REPEAT || max > MAX_REPEAT ||
+                (max != -1 && max < min)) {
+                p->error = true;
+                break;
+            }
+            p->pos = end + 2 - p->src;
+        } else {
+            break;
+        }
+        atom = ast_new(p, AST_REPEAT, atom, NULL);
+        atom->min = min;
+        atom->max = max;
+    }
+    return atom;
+}
+
+/**
+ * @brief Parses a branch, the sequence of pieces between alternations.
+ */
+static ast_t *parse_branch(parser_t *p, int depth) {
+    ast_t *node = ast_new(p, AST_EMPTY, NULL, NULL);
+    bool branch_start = true;
+
+    while (p->pos < p->len && !p->error) {
+        if (at(p, "\\|") || (depth > 0 && at(p, "\\)")))
+            break;
+        char c = p->src[p->pos];
+        if (c == '^' && branch_start && node->type == AST_EMPTY) {
+            p->pos++;
+            node = ast_new(p, AST_CAT, node, ast_new(p, AST_BOL, NULL, NULL));
+            continue;
+        }
+        if (c == '$') {
+            p->pos++;
+            if (p->pos == p->len || at(p, "\\|") || (depth > 0 && at(p, "\\)"))) {
+                node = ast_new(p, AST_CAT, node, ast_new(p, AST_EOL, NULL, NULL));
+                break;
+            }
+            p->pos--;
+        }
+        // A '*' is only left here at the beginning, where it is taken as itself
+        ast_t *atom = parse_atom(p, depth);
+        branch_start = false;
+        node = ast_new(p, AST_CAT, node, parse_postfix(p, atom));
+    }
+    return node;
+}
+
+static ast_t *parse_regex(parser_t *p, int depth) {
+    ast_t *node = parse_branch(p, depth);
+    while (!p->error && at(p, "\\|")) {
+        p->pos += 2;
+        node = ast_new(p, AST_ALT, node, parse_branch(p, depth));
+    }
+    return node;
+}
+
+/* ===================== NFA ===================== */
+
+enum { NFA_SET, NFA_SPLIT, NFA_BOL, NFA_EOL, NFA_MATCH };
+
+typedef struct nfa_state {
+    int type;
+    int out;
+    int out1; // Only for NFA_SPLIT
+    uint32_t set[8]; // Only for NFA_SET
+} nfa_state_t;
+
+/* ===================== DFA ===================== */
+
+/** @brief A state of the DFA, a set of NFA states */
+typedef struct dfa_state {
+    struct dfa_state *next[256]; // NULL if not built yet
+    bool is_match; // A match has been found
+    bool eol_match; // A match is found if the line ends here
+    bool at_bol;
+    unsigned hash;
+    int num;
+    int nfa[]; // Sorted NFA states
+} dfa_state_t;
+
+/** @brief The states built by one thread */
+typedef struct dfa_cache {
+    dfa_state_t **table; // Open addressing hash table
+    size_t table_size;
+    size_t num_states;
+    size_t mem_used;
+    dfa_state_t *initial;
+    // Scratch space of closure()
+    int *stack;
+    int *list;
+    unsigned *mark;
+    unsigned gen;
+} dfa_cache_t;
+
+/** @brief The compiled regular expression the user receives */
+typedef struct lazy_dfa {
+    nfa_state_t *states;
+    int num_states;
+    int start;
+    size_t cache_budget;
+    pthread_key_t cache_key;
+} lazy_dfa_t;
+
+static int nfa_new(lazy_dfa_t *dfa, parser_t *p, int type, int out, int out1) {
+    if (dfa->num_states == MAX_NFA_STATES) {
+        p->error = true;
+        return 0;
+    }
+    nfa_state_t *s = &dfa->states[dfa->num_states];
+    s->type = type;
+    s->out = out;
+    s->out1 = out1;
+    return dfa->num_states++;
+}
+
+/**
+ * @brief Compiles the tree backward: returns the first state of the
+ * fragment matching node and then continuing at next.
+ */
+static int compile(lazy_dfa_t *dfa, parser_t *p, ast_t *node, int next) {
+    int s;
+    if (p->error)
+        return 0;
+    switch (node->type) {
+        case AST_EMPTY:
+            return next;
+        case AST_SET:
+            s = nfa_new(dfa, p, NFA_SET, next, -1);
+            if (!p->error)
+                memcpy(dfa->states[s].set, node->set, sizeof(node->set));
+            return s;
+        case AST_BOL:
+            return nfa_new(dfa, p, NFA_BOL, next, -1);
+        case AST_EOL:
+            return nfa_new(dfa, p, NFA_EOL, next, -1);
+        case AST_CAT:
+            return compile(dfa, p, node->left, compile(dfa, p, node->right, next));
+        case AST_ALT: {
+            int left = compile(dfa, p, node->left, next);
+            int right = compile(dfa, p, node->right, next);
+            return nfa_new(dfa, p, NFA_SPLIT, left, right);
+        }
+        case AST_REPEAT: {
+            int res = next;
+            if (node->max == -1) {
+                // loop: SPLIT -> body -> SPLIT, or leave
+                int loop = nfa_new(dfa, p, NFA_SPLIT, -1, next);
+                int body = compile(dfa, p, node->left, loop);
+                if (!p->error)
+                    dfa->states[loop].out = body;
+                res = loop;
+            } else {
+                for (int i = 0; i < node->max - node->min; i++)
+                    res = nfa_new(dfa, p, NFA_SPLIT, compile(dfa, p, node->left, res), next);
+            }
+            for (int i = 0; i < node->min; i++)
+                res = compile(dfa, p, node->left, res);
+            return res;
+        }
+    }
+    return next;
+}
+
+static unsigned hash_list(const int *list, int num, bool at_bol) {
+    unsigned h = 2166136261u ^ at_bol;
+    for (int i = 0; i < num; i++)
+        h = (h ^ (unsigned)list[i]) * 16777619u;
+    return h;
+}
+
+static int compare_int(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+/**
+ * @brief Follows the empty transitions from the seeds and collects the
+ * states into cache->list. BOL and EOL are only passed when at_bol or
+ * at_eol, an EOL which can't be passed yet is kept in the list.
+ *
+ * @return the number of states in cache->list, sorted
+ */
+static int closure(lazy_dfa_t *dfa, dfa_cache_t *cache, const int *seeds, int num_seeds,
+                   bool at_bol, bool at_eol) {
+    int top = 0;
+    int num = 0;
+
+    if (++cache->gen == 0) {
+        memset(cache->mark, 0, dfa->num_states * sizeof(unsigned));
+        cache->gen = 1;
+    }
+    for (int i = 0; i < num_seeds; i++)
+        cache->stack[top++] = seeds[i];
+
+    while (top > 0) {
+        int id = cache->stack[--top];
+        if (cache->mark[id] == cache->gen)
+            continue;
+        cache->mark[id] = cache->gen;
+        nfa_state_t *s = &dfa->states[id];
+        switch (s->type) {
+            case NFA_SPLIT:
+                cache->stack[top++] = s->out1;
+                cache->stack[top++] = s->out;
+                break;
+            case NFA_BOL:
+                if (at_bol)
+                    cache->stack[top++] = s->out;
+                break;
+            case NFA_EOL:
+                if (at_eol)
+                    cache->stack[top++] = s->out;
+                else
+                    cache->list[num++] = id;
+                break;
+            default:
+                cache->list[num++] = id;
+        }
+    }
+    qsort(cache->list, num, sizeof(int), compare_int);
+    return num;
+}
+
+static void cache_flush(dfa_cache_t *cache) {
+    for (size_t i = 0; i < cache->table_size; i++) {
+        free(cache->table[i]);
+        cache->table[i] = NULL;
+    }
+    cache->num_states = 0;
+    cache->mem_used = cache->table_size * sizeof(dfa_state_t *);
+    cache->initial = NULL;
+}
+
+static void cache_insert(dfa_cache_t *cache, dfa_state_t *state) {
+    if (2 * (cache->num_states + 1) > cache->table_size) {
+        // Grow the table and rehash
+        size_t old_size = cache->table_size;
+        dfa_state_t **old = cache->table;
+        cache->table_size = old_size ? old_size * 2 : 64;
+        if ((cache->table = calloc(cache->table_size, sizeof(dfa_state_t *))) == NULL) {
+            perror("malloc failed in lazy-dfa: cache_insert");
+            exit(1);
+        }
+        cache->mem_used += (cache->table_size - old_size) * sizeof(dfa_state_t *);
+        for (size_t i = 0; i < old_size; i++) {
+            if (old[i] == NULL)
+                continue;
+            size_t j = old[i]->hash & (cache->table_size - 1);
+            while (cache->table[j] != NULL)
+                j = (j + 1) & (cache->table_size - 1);
+            cache->table[j] = old[i];
+        }
+        free(old);
+    }
+    size_t j = state->hash & (cache->table_size - 1);
+    while (cache->table[j] != NULL)
+        j = (j + 1) & (cache->table_size - 1);
+    cache->table[j] = state;
+    cache->num_states++;
+}
+
+/**
+ * @brief Finds the DFA state for the NFA states in cache->list, or
+ * builds it. *flushed is set if the cache had to be flushed first, then
+ * all states built before are gone.
+ */
+static dfa_state_t *get_state(lazy_dfa_t *dfa, dfa_cache_t *cache, int num, bool at_bol,
+                              bool *flushed) {
+    unsigned hash = hash_list(cache->list, num, at_bol);
+    size_t size = sizeof(dfa_state_t) + num * sizeof(int);
+
+    if (cache->table_size > 0) {
+        size_t j = hash & (cache->table_size - 1);
+        for (; cache->table[j] != NULL; j = (j + 1) & (cache->table_size - 1)) {
+            dfa_state_t *s = cache->table[j];
+            if (s->hash == hash && s->num == num && s->at_bol == at_bol &&
+                memcmp(s->nfa, cache->list, num * sizeof(int)) == 0)
+                return s;
+        }
+    }
+
+    *flushed = false;
+    if (cache->mem_used + size > dfa->cache_budget && cache->num_states > 0) {
+        cache_flush(cache);
+        *flushed = true;
+    }
+
+    dfa_state_t *state;
+    if ((state = calloc(1, size)) == NULL) {
+        perror("malloc failed in lazy-dfa: get_state");
+        exit(1);
+    }
+    state->hash = hash;
+    state->num = num;
+    state->at_bol = at_bol;
+    memcpy(state->nfa, cache->list, num * sizeof(int));
+    for (int i = 0; i < num; i++) {
+        if (dfa->states[state->nfa[i]].type == NFA_MATCH)
+            state->is_match = true;
+    }
+    // Check whether the end of line leads to a match
+    int eol_num = closure(dfa, cache, state->nfa, num, at_bol, true);
+    for (int i = 0; i < eol_num; i++) {
+        if (dfa->states[cache->list[i]].type == NFA_MATCH)
+            state->eol_match = true;
+    }
+    cache->mem_used += size;
+    cache_insert(cache, state);
+    return state;
+}
+
+/**
+ * @brief Builds the transition from state on byte c. The start state is
+ * added into every state since a match may begin anywhere in the line.
+ */
+static dfa_state_t *step(lazy_dfa_t *dfa, dfa_cache_t *cache, dfa_state_t *state,
+                         unsigned char c) {
+    int seeds[state->num + 1];
+    int num_seeds = 0;
+    bool flushed;
+
+    for (int i = 0; i < state->num; i++) {
+        nfa_state_t *s = &dfa->states[state->nfa[i]];
+        if (s->type == NFA_SET && set_has(s->set, c))
+            seeds[num_seeds++] = s->out;
+    }
+    seeds[num_seeds++] = dfa->start;
+
+    int num = closure(dfa, cache, seeds, num_seeds, false, false);
+    dfa_state_t *next = get_state(dfa, cache, num, false, &flushed);
+    if (!flushed)
+        state->next[c] = next;
+    return next;
+}
+
+static void cache_free(void *arg) {
+    dfa_cache_t *cache = arg;
+    cache_flush(cache);
+    free(cache->table);
+    free(cache->stack);
+    free(cache->list);
+    free(cache->mark);
+    free(cache);
+}
+
+/**
+ * @brief Returns the cache of the calling thread, creates it at the
+ * first call.
+ */
+static dfa_cache_t *get_cache(lazy_dfa_t *dfa) {
+    dfa_cache_t *cache = pthread_getspecific(dfa->cache_key);
+    if (cache != NULL)
+        return cache;
+
+    if ((cache = calloc(1, sizeof(dfa_cache_t))) == NULL ||
+        (cache->stack = malloc((3 * dfa->num_states + 1) * sizeof(int))) == NULL ||
+        (cache->list = malloc(dfa->num_states * sizeof(int))) == NULL ||
+        (cache->mark = calloc(dfa->num_states, sizeof(unsigned))) == NULL) {
+        perror("malloc failed in lazy-dfa: get_cache");
+        exit(1);
+    }
+    pthread_setspecific(dfa->cache_key, cache);
+    return cache;
+}
+
+/**
+ * @brief Compiles a basic regular expression.
+ *
+ * @param src the pattern given by the user
+ * @param cache_budget the memory in bytes each thread may use for caching
+ * DFA states
+ * @return lazy_dfa_t* the compiled pattern, or NULL if it uses something
+ * which isn't supported
+ */
+lazy_dfa_t *lazy_dfa_compile(const char *src, size_t cache_budget) {
+    parser_t p = {src, 0, strlen(src), false};
+    lazy_dfa_t *dfa;
+
+    ast_t *root = parse_regex(&p, 0);
+    if (p.error || p.pos != p.len) {
+        ast_free(root);
+        return NULL;
+    }
+
+    if ((dfa = calloc(1, sizeof(lazy_dfa_t))) == NULL ||
+        (dfa->states = malloc(MAX_NFA_STATES * sizeof(nfa_state_t))) == NULL) {
+        perror("malloc failed in lazy-dfa: lazy_dfa_compile");
+        exit(1);
+    }
+    int match = nfa_new(dfa, &p, NFA_MATCH, -1, -1);
+    dfa->start = compile(dfa, &p, root, match);
+    ast_free(root);
+    if (p.error) {
+        free(dfa->states);
+        free(dfa);
+        return NULL;
+    }
+    dfa->cache_budget = cache_budget;
+    pthread_key_create(&dfa->cache_key, cache_free);
+    return dfa;
+}
+
+/**
+ * @brief Checks whether the pattern matches anywhere in the line.
+ *
+ * @param dfa the compiled pattern
+ * @param line the beginning of the line, doesn't need to be NUL terminated
+ * @param len the length of the line without '\n'
+ * @return true if the line matches
+ */
+bool lazy_dfa_match_line(lazy_dfa_t *dfa, const char *line, size_t len) {
+    dfa_cache_t *cache = get_cache(dfa);
+    dfa_state_t *state = cache->initial;
+    bool flushed;
+
+    if (state == NULL) {
+        int num = closure(dfa, cache, &dfa->start, 1, true, false);
+        state = cache->initial = get_state(dfa, cache, num, true, &flushed);
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (state->is_match)
+            return true;
+        unsigned char c = line[i];
+        state = state->next[c] ? state->next[c] : step(dfa, cache, state, c);
+    }
+    return state->is_match || state->eol_match;
+}
+
+/**
+ * @brief Frees the compiled pattern, and the cache of the calling
+ * thread. The caches of other threads are freed when they exit.
+ *
+ * @param dfa the compiled pattern
+ */
+void lazy_dfa_free(lazy_dfa_t *dfa) {
+    dfa_cache_t *cache = pthread_getspecific(dfa->cache_key);
+    if (cache != NULL)
+        cache_free(cache);
+    pthread_key_delete(dfa->cache_key);
+    free(dfa->states);
+    free(dfa);
+}
@@ -0,0 +1,13 @@
+#ifndef LAZY_DFA_INCLUDED
+#define LAZY_DFA_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct lazy_dfa lazy_dfa_t;
+
+lazy_dfa_t *lazy_dfa_compile(const char *src, size_t cache_budget);
+bool lazy_dfa_match_line(lazy_dfa_t *dfa, const char *line, size_t len);
+void lazy_dfa_free(lazy_dfa_t *dfa);
+
+#endif
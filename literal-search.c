@@ -0,0 +1,209 @@
+/*
+A vectorized search for a literal string in a buffer.
+Instead of searching line by line, the whole buffer is scanned at once:
+the first and the last byte of the needle are compared against 16 (SSE2)
+or 32 (AVX2) positions of the buffer at a time, and only the positions
+where both of them match are verified with memcmp. The AVX2 version is
+picked at runtime when the CPU supports it.
+Counting a byte, such as the '\n' for line numbers, is vectorized in the
+same way: the comparisons of 16 or 32 bytes are summed up in vector
+registers, without a branch per byte.
+*/
+#define _GNU_SOURCE
+#include "literal-search.h"
+
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define LITERAL_SEARCH_X86
+#include <immintrin.h>
+#endif
+
+typedef const char *(search_fn)(const char *, size_t, const char *, size_t);
+typedef size_t (count_fn)(const char *, size_t, char);
+
+/**
+ * @brief Searches the positions of the buffer which the vector loops
+ * leave behind, from start to the end of the buffer.
+ */
+static const char *search_tail(const char *hay, size_t hay_len, size_t start,
+                               const char *needle, size_t needle_len) {
+    return memmem(hay + start, hay_len - start, needle, needle_len);
+}
+
+/**
+ * @brief The portable version, used when there is no SIMD support.
+ */
+static const char *search_generic(const char *hay, size_t hay_len,
+                                  const char *needle, size_t needle_len) {
+    return search_tail(hay, hay_len, 0, needle, needle_len);
+}
+
+/**
+ * @brief Counts the byte in the part of the buffer which the vector
+ * loops leave behind, also the portable version.
+ */
+static size_t count_generic(const char *buf, size_t len, char c) {
+    size_t count = 0;
+    for (size_t i = 0; i < len; i++)
+        count += buf[i] == c;
+    return count;
+}
+
+#ifdef LITERAL_SEARCH_X86
+/**
+ * @brief The SSE2 version, compares 16 candidate positions per iteration.
+ */
+static const char *search_sse2(const char *hay, size_t hay_len,
+                               const char *needle, size_t needle_len) {
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[needle_len - 1]);
+    size_t i = 0;
+
+    // Both loads must stay inside the buffer
+    for (; i + 16 + needle_len - 1 <= hay_len; i += 16) {
+        __m128i block_first = _mm_loadu_si128((const __m128i *)(hay + i));
+        __m128i block_last = _mm_loadu_si128((const __m128i *)(hay + i + needle_len - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, block_first),
+                                                        _mm_cmpeq_epi8(last, block_last)));
+        while (mask != 0) {
+            unsigned bit = __builtin_ctz(mask);
+            if (memcmp(hay + i + bit + 1, needle + 1, needle_len - 2) == 0)
+                return hay + i + bit;
+            mask &= mask - 1;
+        }
+    }
+    return search_tail(hay, hay_len, i, needle, needle_len);
+}
+
+/**
+ * @brief The AVX2 version, compares 32 candidate positions per iteration.
+ */
+__attribute__((target("avx2")))
+static const char *search_avx2(const char *hay, size_t hay_len,
+                               const char *needle, size_t needle_len) {
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[needle_len - 1]);
+    size_t i = 0;
+
+    // Both loads must stay inside the buffer
+    for (; i + 32 + needle_len - 1 <= hay_len; i += 32) {
+        __m256i block_first = _mm256_loadu_si256((const __m256i *)(hay + i));
+        __m256i block_last = _mm256_loadu_si256((const __m256i *)(hay + i + needle_len - 1));
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(first, block_first),
+                                                              _mm256_cmpeq_epi8(last, block_last)));
+        while (mask != 0) {
+            unsigned bit = __builtin_ctz(mask);
+            if (memcmp(hay + i + bit + 1, needle + 1, needle_len - 2) == 0)
+                return hay + i + bit;
+            mask &= mask - 1;
+        }
+    }
+    return search_tail(hay, hay_len, i, needle, needle_len);
+}
+
+/**
+ * @brief The SSE2 version of the count, 16 bytes per iteration. A match
+ * is -1 in the comparison, so subtracting it adds one to the byte counter
+ * of its lane, which are summed up before they can overflow. The sum of
+ * eight lanes fits into 16 bits.
+ */
+static size_t count_sse2(const char *buf, size_t len, char c) {
+    const __m128i target = _mm_set1_epi8(c);
+    size_t count = 0;
+    size_t i = 0;
+
+    while (i + 16 <= len) {
+        __m128i counters = _mm_setzero_si128();
+        for (int round = 0; round < 255 && i + 16 <= len; round++, i += 16) {
+            __m128i block = _mm_loadu_si128((const __m128i *)(buf + i));
+            counters = _mm_sub_epi8(counters, _mm_cmpeq_epi8(block, target));
+        }
+        __m128i sums = _mm_sad_epu8(counters, _mm_setzero_si128());
+        count += _mm_extract_epi16(sums, 0) + _mm_extract_epi16(sums, 4);
+    }
+    return count + count_generic(buf + i, len - i, c);
+}
+
+/**
+ * @brief The AVX2 version of the count, 32 bytes per iteration.
+ */
+__attribute__((target("avx2")))
+static size_t count_avx2(const char *buf, size_t len, char c) {
+    const __m256i target = _mm256_set1_epi8(c);
+    size_t count = 0;
+    size_t i = 0;
+
+    while (i + 32 <= len) {
+        __m256i counters = _mm256_setzero_si256();
+        for (int round = 0; round < 255 && i + 32 <= len; round++, i += 32) {
+            __m256i block = _mm256_loadu_si256((const __m256i *)(buf + i));
+            counters = _mm256_sub_epi8(counters, _mm256_cmpeq_epi8(block, target));
+        }
+        __m256i sums = _mm256_sad_epu8(counters, _mm256_setzero_si256());
+        count += _mm256_extract_epi16(sums, 0) + _mm256_extract_epi16(sums, 4) +
+                 _mm256_extract_epi16(sums, 8) + _mm256_extract_epi16(sums, 12);
+    }
+    return count + count_generic(buf + i, len - i, c);
+}
+#endif
+
+static search_fn *search_impl = search_generic;
+static count_fn *count_impl = count_generic;
+static pthread_once_t search_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Picks the fastest version supported by the CPU, only called once.
+ */
+static void search_dispatch(void) {
+#ifdef LITERAL_SEARCH_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        search_impl = search_avx2;
+        count_impl = count_avx2;
+    } else {
+        search_impl = search_sse2;
+        count_impl = count_sse2;
+    }
+#endif
+}
+
+/**
+ * @brief Finds the first occurrence of needle in the buffer. Neither of
+ * them needs to be NUL terminated.
+ *
+ * @param hay the buffer to search
+ * @param hay_len the length of the buffer
+ * @param needle the literal string to look for
+ * @param needle_len the length of the needle
+ * @return a pointer to the first occurrence inside hay, hay itself if the
+ * needle is empty, or NULL if there is no occurrence
+ */
+const char *literal_search(const char *hay, size_t hay_len,
+                           const char *needle, size_t needle_len) {
+    if (needle_len == 0)
+        return hay;
+    if (hay_len < needle_len)
+        return NULL;
+    // memchr is already vectorized by libc
+    if (needle_len == 1)
+        return memchr(hay, needle[0], hay_len);
+
+    pthread_once(&search_once, search_dispatch);
+    return search_impl(hay, hay_len, needle, needle_len);
+}
+
+/**
+ * @brief Counts the occurrences of a byte in the buffer, such as the
+ * '\n' before a line to know its number.
+ *
+ * @param buf the buffer to search, doesn't need to be NUL terminated
+ * @param len the length of the buffer
+ * @param c the byte to count
+ * @return the number of occurrences
+ */
+size_t literal_count(const char *buf, size_t len, char c) {
+    pthread_once(&search_once, search_dispatch);
+    return count_impl(buf, len, c);
+}
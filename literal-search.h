@@ -0,0 +1,10 @@
+#ifndef LITERAL_SEARCH_INCLUDED
+#define LITERAL_SEARCH_INCLUDED
+
+#include <stddef.h>
+
+const char *literal_search(const char *hay, size_t hay_len,
+                           const char *needle, size_t needle_len);
+size_t literal_count(const char *buf, size_t len, char c);
+
+#endif
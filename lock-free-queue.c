@@ -0,0 +1,196 @@
+/*
+A lock-free, multi-producer multi-consumer FIFO queue.
+The elements live in a bounded ring of cells (Dmitry Vyukov's design).
+Each cell has a sequence number which tells whether it is free for the
+producer of a given position or full for the consumer of that position,
+so producers and consumers only race on two counters with compare and
+swap, and nothing is allocated. When the ring is full the elements go
+into a thread-safe linked list instead, which is slow but never fails,
+so the callers can use the queue like a linked list.
+*/
+#include "lock-free-queue.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define CACHE_LINE 64
+
+/** @brief One slot of the ring */
+typedef struct lf_cell {
+    atomic_size_t seq;
+    void *elem;
+} lf_cell_t;
+
+/** @brief The queue structure the user receives */
+typedef struct lf_queue {
+    lf_cell_t *cells;
+    size_t mask; // The capacity minus one, the capacity is a power of two
+    // The two counters are written by different threads, keep them apart
+    _Alignas(CACHE_LINE) atomic_size_t enqueue_pos;
+    _Alignas(CACHE_LINE) atomic_size_t dequeue_pos;
+    _Alignas(CACHE_LINE) atomic_long overflow_size;
+    linked_list_t *overflow; // Used when the ring is full
+} lf_queue_t;
+
+/**
+ * @brief Dynamically allocates a new queue. Exits only on malloc error.
+ *
+ * @param capacity the number of elements the ring holds, rounded up to
+ * a power of two
+ * @return lf_queue_t* a pointer to the allocated queue
+ */
+lf_queue_t *lf_queue_new(size_t capacity) {
+    lf_queue_t *queue;
+    size_t size = 2;
+    while (size < capacity)
+        size *= 2;
+
+    if ((queue = aligned_alloc(CACHE_LINE, sizeof(lf_queue_t))) == NULL ||
+        (queue->cells = malloc(size * sizeof(lf_cell_t))) == NULL) {
+        perror("malloc failed in lock-free-queue");
+        exit(1);
+    }
+    queue->mask = size - 1;
+    for (size_t i = 0; i < size; i++)
+        atomic_init(&queue->cells[i].seq, i);
+    atomic_init(&queue->enqueue_pos, 0);
+    atomic_init(&queue->dequeue_pos, 0);
+    atomic_init(&queue->overflow_size, 0);
+    queue->overflow = linked_list_new();
+    return queue;
+}
+
+/**
+ * @brief Puts an element into the ring without blocking.
+ *
+ * @return true on success, false if the ring is full
+ */
+static bool ring_push(lf_queue_t *queue, void *elem) {
+    size_t pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+    lf_cell_t *cell;
+
+    while (true) {
+        cell = &queue->cells[pos & queue->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            // The cell is free, claim the position
+            if (atomic_compare_exchange_weak_explicit(&queue->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            // The consumer of the previous lap hasn't emptied the cell
+            return false;
+        } else {
+            pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+        }
+    }
+    cell->elem = elem;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    return true;
+}
+
+/**
+ * @brief Takes an element from the ring without blocking.
+ *
+ * @return the element, or NULL if the ring is empty
+ */
+static void *ring_pop(lf_queue_t *queue) {
+    size_t pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+    lf_cell_t *cell;
+
+    while (true) {
+        cell = &queue->cells[pos & queue->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            // The cell is full, claim the position
+            if (atomic_compare_exchange_weak_explicit(&queue->dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            // The producer of this position hasn't filled the cell
+            return NULL;
+        } else {
+            pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+        }
+    }
+    void *elem = cell->elem;
+    // Free the cell for the producer of the next lap
+    atomic_store_explicit(&cell->seq, pos + queue->mask + 1, memory_order_release);
+    return elem;
+}
+
+/**
+ * @brief Inserts an element into the back of the queue. Once the ring
+ * has overflowed, the elements keep going to the overflow list until it
+ * is drained, so the order is kept for a single producer.
+ *
+ * @param queue the queue supplied from the user
+ * @param elem the element to insert
+ */
+void lf_queue_insert_back(lf_queue_t *queue, void *elem) {
+    if (atomic_load(&queue->overflow_size) == 0 && ring_push(queue, elem))
+        return;
+    atomic_fetch_add(&queue->overflow_size, 1);
+    linked_list_insert_back(queue->overflow, elem);
+}
+
+/**
+ * @brief Removes an element from the front of the queue
+ *
+ * @param queue the queue supplied from the user
+ * @return the element, or NULL if the queue is empty
+ */
+void *lf_queue_remove_front(lf_queue_t *queue) {
+    void *elem = ring_pop(queue);
+    if (elem != NULL || atomic_load(&queue->overflow_size) == 0)
+        return elem;
+    if ((elem = linked_list_remove_front(queue->overflow)) != NULL)
+        atomic_fetch_sub(&queue->overflow_size, 1);
+    return elem;
+}
+
+/**
+ * @brief Checks to see if the queue is empty, without taking any lock.
+ * An element which is being inserted may already be counted.
+ *
+ * @param queue the queue supplied from the user
+ * @return true if the queue is empty
+ * @return false otherwise
+ */
+bool lf_queue_empty(lf_queue_t *queue) {
+    return lf_queue_size(queue) == 0;
+}
+
+/**
+ * @brief Counts the elements in the queue, without taking any lock.
+ * The count is only a snapshot when other threads use the queue.
+ *
+ * @param queue the queue supplied from the user
+ * @return the number of elements
+ */
+size_t lf_queue_size(lf_queue_t *queue) {
+    size_t dequeue_pos = atomic_load(&queue->dequeue_pos);
+    size_t enqueue_pos = atomic_load(&queue->enqueue_pos);
+    size_t size = enqueue_pos > dequeue_pos ? enqueue_pos - dequeue_pos : 0;
+    return size + atomic_load(&queue->overflow_size);
+}
+
+/**
+ * @brief Frees the queue and, if elem_free is not NULL, the elements
+ * left in it. No other thread may use the queue.
+ *
+ * @param queue the queue supplied from the user
+ * @param elem_free the function to free each element, may be NULL
+ */
+void lf_queue_free(lf_queue_t *queue, free_fn elem_free) {
+    void *elem;
+    while (elem_free != NULL && (elem = ring_pop(queue)) != NULL)
+        elem_free(elem);
+    linked_list_free(queue->overflow, elem_free);
+    free(queue->cells);
+    free(queue);
+}
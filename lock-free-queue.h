@@ -0,0 +1,18 @@
+#ifndef LOCK_FREE_QUEUE_INCLUDED
+#define LOCK_FREE_QUEUE_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "thread-safe-linked-list.h"
+
+typedef struct lf_queue lf_queue_t;
+
+lf_queue_t *lf_queue_new(size_t capacity);
+void lf_queue_insert_back(lf_queue_t *queue, void *elem);
+void *lf_queue_remove_front(lf_queue_t *queue);
+bool lf_queue_empty(lf_queue_t *queue);
+size_t lf_queue_size(lf_queue_t *queue);
+void lf_queue_free(lf_queue_t *queue, free_fn elem_free);
+
+#endif
@@ -0,0 +1,180 @@
+/*
+Records of the matched lines for programs reading the output, instead of
+the lines themselves. A record tells where a line is: the id of the file,
+the offset of the line in the file and its length without the '\n'. The
+line is never copied nor formatted. The id of a file is given by a path
+record, written before the first record of a line of the file.
+The binary records are made of 64-bit words in the byte order of the
+machine, so a reader may map the output and read them in place:
+  a line: file, offset, length
+  a path: file | MATCH_PATH_FLAG, length of the path, then the path
+          padded with zeros to a whole number of words
+The JSON records are one object per line:
+  {"file":1,"offset":1234,"length":80}
+  {"file":1,"path":"dir/name"}
+The offsets of a gzip file are offsets in its inflated data.
+*/
+#include "match-record.h"
+
+#include <string.h>
+
+#include "literal-search.h"
+
+#define LINE_RECORD_SIZE (3 * sizeof(uint64_t))
+#define NUMBER_SIZE 20 // The digits of the largest uint64_t
+
+/**
+ * @brief Parses the name of a format of records.
+ *
+ * @param name "binary" or "json"
+ * @param format where the format is returned
+ * @return false if the name is unknown
+ */
+bool match_format_parse(const char *name, match_format_t *format) {
+    if (strcmp(name, "binary") == 0)
+        *format = MATCH_BINARY;
+    else if (strcmp(name, "json") == 0)
+        *format = MATCH_JSON;
+    else
+        return false;
+    return true;
+}
+
+/**
+ * @brief Writes the decimal digits of n to dst, returns their number.
+ */
+static size_t format_number(char *dst, uint64_t n) {
+    char digits[NUMBER_SIZE];
+    size_t len = 0;
+    do {
+        digits[len++] = '0' + n % 10;
+        n /= 10;
+    } while (n > 0);
+    for (size_t i = 0; i < len; i++)
+        dst[i] = digits[len - 1 - i];
+    return len;
+}
+
+/**
+ * @brief Appends a string as a JSON string. The bytes which are not
+ * ASCII are copied as they are.
+ */
+static void append_json_string(arena_t *output, const char *str) {
+    static const char hex[] = "0123456789abcdef";
+    size_t len = strlen(str);
+    char *dst = arena_reserve(output, 6 * len + 2);
+    size_t pos = 0;
+
+    dst[pos++] = '"';
+    for (const unsigned char *c = (const unsigned char *)str; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            dst[pos++] = '\\';
+            dst[pos++] = *c;
+        } else if (*c < 0x20) {
+            memcpy(dst + pos, "\\u00", 4);
+            dst[pos + 4] = hex[*c >> 4];
+            dst[pos + 5] = hex[*c & 15];
+            pos += 6;
+        } else {
+            dst[pos++] = *c;
+        }
+    }
+    dst[pos++] = '"';
+    arena_commit(output, pos);
+}
+
+/**
+ * @brief Appends the record giving the path of a file.
+ *
+ * @param output where the record is appended
+ * @param format MATCH_BINARY or MATCH_JSON
+ * @param file the id of the file
+ * @param path the path of the file
+ */
+void match_record_path(arena_t *output, match_format_t format, uint64_t file, const char *path) {
+    size_t len = strlen(path);
+
+    if (format == MATCH_BINARY) {
+        uint64_t words[2] = { file | MATCH_PATH_FLAG, len };
+        size_t padded = (len + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+        arena_append(output, (const char *)words, sizeof(words));
+        char *dst = arena_reserve(output, padded);
+        memcpy(dst, path, len);
+        memset(dst + len, 0, padded - len);
+        arena_commit(output, padded);
+        return;
+    }
+    // {"file":,"path": and a number, the path is appended after
+    char *dst = arena_reserve(output, 16 + NUMBER_SIZE);
+    size_t pos = 0;
+    memcpy(dst, "{\"file\":", 8);
+    pos = 8 + format_number(dst + 8, file);
+    memcpy(dst + pos, ",\"path\":", 8);
+    arena_commit(output, pos + 8);
+    append_json_string(output, path);
+    arena_append(output, "}\n", 2);
+}
+
+/**
+ * @brief Appends the record of a matched line.
+ *
+ * @param output where the record is appended
+ * @param format MATCH_BINARY or MATCH_JSON
+ * @param file the id of the file
+ * @param offset the offset of the line in the file
+ * @param length the length of the line without the '\n'
+ */
+void match_record_line(arena_t *output, match_format_t format, uint64_t file,
+                       uint64_t offset, uint64_t length) {
+    if (format == MATCH_BINARY) {
+        uint64_t words[3] = { file, offset, length };
+        arena_append(output, (const char *)words, sizeof(words));
+        return;
+    }
+    // {"file":,"offset":,"length":}\n and three numbers of 20 digits
+    char *dst = arena_reserve(output, 30 + 3 * NUMBER_SIZE);
+    size_t pos = 0;
+    memcpy(dst, "{\"file\":", 8);
+    pos = 8 + format_number(dst + 8, file);
+    memcpy(dst + pos, ",\"offset\":", 10);
+    pos += 10;
+    pos += format_number(dst + pos, offset);
+    memcpy(dst + pos, ",\"length\":", 10);
+    pos += 10;
+    pos += format_number(dst + pos, length);
+    memcpy(dst + pos, "}\n", 2);
+    arena_commit(output, pos + 2);
+}
+
+/**
+ * @brief Counts the records of the matched lines, or the lines of text.
+ *
+ * @param format the format of the records
+ * @param data the records, without any path record
+ * @param len the length of the records
+ * @return the number of records
+ */
+long match_record_count(match_format_t format, const char *data, size_t len) {
+    if (format == MATCH_BINARY)
+        return len / LINE_RECORD_SIZE;
+    return literal_count(data, len, '\n');
+}
+
+/**
+ * @brief Tells the length of the first records, to cut the others off.
+ *
+ * @param format the format of the records
+ * @param data the records, without any path record
+ * @param len the length of the records
+ * @param num the records to keep, at most match_record_count() of them
+ * @return the length of the first num records
+ */
+size_t match_record_keep(match_format_t format, const char *data, size_t len, long num) {
+    const char *eol = data;
+
+    if (format == MATCH_BINARY)
+        return num * LINE_RECORD_SIZE;
+    for (; num > 0; num--)
+        eol = (const char *)memchr(eol, '\n', data + len - eol) + 1;
+    return eol - data;
+}
@@ -0,0 +1,26 @@
+#ifndef MATCH_RECORD_INCLUDED
+#define MATCH_RECORD_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+#define MATCH_PATH_FLAG (1ULL << 63) // Set in the first word of a binary path record
+
+/* How the matched lines are written out */
+typedef enum match_format {
+    MATCH_TEXT, // the lines themselves
+    MATCH_BINARY, // records of offsets, see match-record.c
+    MATCH_JSON // the same records as JSON objects, one per line
+} match_format_t;
+
+bool match_format_parse(const char *name, match_format_t *format);
+void match_record_path(arena_t *output, match_format_t format, uint64_t file, const char *path);
+void match_record_line(arena_t *output, match_format_t format, uint64_t file,
+                       uint64_t offset, uint64_t length);
+long match_record_count(match_format_t format, const char *data, size_t len);
+size_t match_record_keep(match_format_t format, const char *data, size_t len, long num);
+
+#endif
@@ -0,0 +1,531 @@
+/*
+A searching pattern which is compiled only once and shared by all threads.
+The pattern is a set of POSIX basic regular expressions, and a line
+matches when any of them matches. When they are compiled, the literal
+strings which every matching line must contain are pulled out of each
+one. The buffer is scanned for the longest literal with literal_search(),
+or for the longest literal of every expression at once with an
+Aho-Corasick automaton when there are several expressions. The regular
+expressions only run on the lines where a hit was found, and only when
+the other required literals are also in the line. A plain string isn't
+matched any further.
+The lines are matched by the lazy DFA (lazy-dfa.c) when it supports the
+expression, and by regexec otherwise.
+*/
+#define _GNU_SOURCE
+#include "pattern.h"
+#include "literal-search.h"
+#include "lazy-dfa.h"
+#include "aho-corasick.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <regex.h>
+
+#define DFA_CACHE_BUDGET (2 * 1024 * 1024) // Per thread
+
+/** @brief A literal string every matching line contains */
+typedef struct literal {
+    char *str;
+    size_t len;
+} literal_t;
+
+/** @brief One compiled regular expression of the set */
+typedef struct entry {
+    regex_t regex;
+    lazy_dfa_t *dfa; // NULL if the expression isn't supported by the DFA
+    bool is_literal; // The whole expression is a plain string
+    literal_t *literals; // Required literals, the longest one first
+    int num_literals;
+} entry_t;
+
+/** @brief The compiled pattern the user receives */
+typedef struct pattern {
+    entry_t *entries;
+    int num_entries;
+    bool prefilter; // Every entry has a required literal
+    aho_corasick_t *ac; // Finds the longest literal of every entry, if there are several
+    lazy_dfa_t *any_dfa; // All entries joined by '\|', if there are several
+} pattern_t;
+
+/**
+ * @brief Returns the index right after the bracket expression beginning
+ * at src[i], which is '['.
+ */
+static size_t skip_bracket(const char *src, size_t i) {
+    i++;
+    if (src[i] == '^')
+        i++;
+    // A ']' right after the '[' or '[^' is a normal character
+    if (src[i] == ']')
+        i++;
+    while (src[i] != '\0' && src[i] != ']') {
+        // [:alpha:], [.-.] and [=a=] may contain a ']'
+        if (src[i] == '[' && (src[i + 1] == ':' || src[i + 1] == '.' || src[i + 1] == '=')) {
+            char *close = strchr(src + i + 2, src[i + 1]);
+            while (close != NULL && close[1] != ']')
+                close = strchr(close + 1, src[i + 1]);
+            if (close == NULL)
+                return strlen(src);
+            i = close - src + 2;
+            continue;
+        }
+        i++;
+    }
+    return src[i] == ']' ? i + 1 : i;
+}
+
+/**
+ * @brief Saves the current run of literal characters if it isn't empty.
+ */
+static void end_run(entry_t *ent, char *run, size_t *run_len) {
+    if (*run_len == 0)
+        return;
+    literal_t *lit = &ent->literals[ent->num_literals++];
+    lit->str = strndup(run, *run_len);
+    lit->len = *run_len;
+    *run_len = 0;
+}
+
+/**
+ * @brief Walks through the basic regular expression and collects the runs
+ * of literal characters outside of groups which are not followed by
+ * '*', '\{', '\?' or '\+'. If there is an alternation at the top level, no
+ * literal is required at all.
+ */
+static void extract_literals(entry_t *ent, const char *src) {
+    size_t src_len = strlen(src);
+    char *run = malloc(src_len + 1);
+    size_t run_len = 0;
+    bool last_was_char = false; // The last atom is the last char of run
+    bool special = false; // Anything other than plain characters is used
+    size_t i = 0;
+
+    if ((ent->literals = calloc(src_len + 1, sizeof(literal_t))) == NULL || run == NULL) {
+        perror("malloc failed in pattern: extract_literals");
+        exit(1);
+    }
+
+    if (src[0] == '^') {
+        special = true;
+        i++;
+    }
+    while (i < src_len) {
+        char c = src[i];
+        if (c == '\\' && i + 1 < src_len) {
+            char next = src[i + 1];
+            i += 2;
+            if (next == '(') {
+                // Skip the whole group, it may be optional or contain an alternation
+                int depth = 1;
+                special = true;
+                end_run(ent, run, &run_len);
+                while (i < src_len && depth > 0) {
+                    if (src[i] == '[') {
+                        i = skip_bracket(src, i);
+                        continue;
+                    }
+                    if (src[i] == '\\' && i + 1 < src_len) {
+                        if (src[i + 1] == '(')
+                            depth++;
+                        else if (src[i + 1] == ')')
+                            depth--;
+                        i += 2;
+                        continue;
+                    }
+                    i++;
+                }
+                last_was_char = false;
+            } else if (next == '|') {
+                // Any branch may match, so nothing is required
+                for (int j = 0; j < ent->num_literals; j++)
+                    free(ent->literals[j].str);
+                ent->num_literals = 0;
+                ent->is_literal = false;
+                free(run);
+                return;
+            } else if (next == '{' || next == '?' || next == '+') {
+                // The char before '\+' is required, unless '\?' or '*' follows,
+                // so it is dropped as well to keep it simple
+                if (last_was_char)
+                    run_len--;
+                if (next == '{') {
+                    char *close = strstr(src + i, "\\}");
+                    i = (close == NULL) ? src_len : (size_t)(close - src) + 2;
+                }
+                special = true;
+                end_run(ent, run, &run_len);
+                last_was_char = false;
+            } else if (next == ')' || next == '<' || next == '>' ||
+                       next == 'b' || next == 'B' || next == 'w' || next == 'W' ||
+                       next == 's' || next == 'S' || next == '`' || next == '\'' ||
+                       (next >= '0' && next <= '9')) {
+                special = true;
+                end_run(ent, run, &run_len);
+                last_was_char = false;
+            } else {
+                // An escaped normal character, such as \. or \*
+                special = true;
+                run[run_len++] = next;
+                last_was_char = true;
+            }
+            continue;
+        }
+        if (c == '[' || c == '.') {
+            i = (c == '[') ? skip_bracket(src, i) : i + 1;
+            special = true;
+            end_run(ent, run, &run_len);
+            last_was_char = false;
+            continue;
+        }
+        if (c == '*' && !(i == 0 || (i == 1 && src[0] == '^'))) {
+            if (last_was_char)
+                run_len--;
+            special = true;
+            end_run(ent, run, &run_len);
+            last_was_char = false;
+            i++;
+            continue;
+        }
+        if (c == '$' && i == src_len - 1) {
+            special = true;
+            i++;
+            continue;
+        }
+        run[run_len++] = c;
+        last_was_char = true;
+        i++;
+    }
+    end_run(ent, run, &run_len);
+    free(run);
+
+    ent->is_literal = !special && ent->num_literals == 1;
+
+    // Move the longest literal to the front, it is used for scanning
+    for (int j = 1; j < ent->num_literals; j++) {
+        if (ent->literals[j].len > ent->literals[0].len) {
+            literal_t tmp = ent->literals[0];
+            ent->literals[0] = ent->literals[j];
+            ent->literals[j] = tmp;
+        }
+    }
+}
+
+static void *xrealloc(void *ptr, size_t size) {
+    if ((ptr = realloc(ptr, size)) == NULL) {
+        perror("malloc failed in pattern");
+        exit(1);
+    }
+    return ptr;
+}
+
+/**
+ * @brief Compiles one regular expression of the set. Exits if it isn't a
+ * valid basic regular expression.
+ */
+static void entry_compile(entry_t *ent, const char *src) {
+    int regex_errorno;
+    char error_msg[100];
+
+    if ((regex_errorno = regcomp(&ent->regex, src, REG_NOSUB))) {
+        regerror(regex_errorno, &ent->regex, error_msg, sizeof(error_msg));
+        fprintf(stderr, "Regex compile failed: %s\n", error_msg);
+        exit(1);
+    }
+    extract_literals(ent, src);
+    if (!ent->is_literal)
+        ent->dfa = lazy_dfa_compile(src, DFA_CACHE_BUDGET);
+}
+
+/**
+ * @brief Compiles a set of searching patterns, a line matches when any of
+ * them matches. Exits if one isn't a valid basic regular expression.
+ *
+ * @param srcs the patterns given by the user
+ * @param num the number of patterns, nothing matches if it is zero
+ * @return pattern_t* a pointer to the compiled pattern
+ */
+pattern_t *pattern_compile_set(char **srcs, int num) {
+    pattern_t *pat;
+
+    if ((pat = calloc(1, sizeof(pattern_t))) == NULL ||
+        (pat->entries = calloc(num > 0 ? num : 1, sizeof(entry_t))) == NULL) {
+        perror("malloc failed in pattern: pattern_compile_set");
+        exit(1);
+    }
+    pat->num_entries = num;
+    pat->prefilter = true;
+    for (int i = 0; i < num; i++) {
+        entry_compile(&pat->entries[i], srcs[i]);
+        if (pat->entries[i].num_literals == 0)
+            pat->prefilter = false;
+    }
+    if (num == 1)
+        return pat;
+
+    if (pat->prefilter) {
+        const char **lits = xrealloc(NULL, num * sizeof(char *));
+        size_t *lens = xrealloc(NULL, num * sizeof(size_t));
+        for (int i = 0; i < num; i++) {
+            lits[i] = pat->entries[i].literals[0].str;
+            lens[i] = pat->entries[i].literals[0].len;
+        }
+        pat->ac = aho_corasick_build(lits, lens, num);
+        free(lits);
+        free(lens);
+        return pat;
+    }
+
+    // Without a prefilter every line is checked, so check all entries in
+    // one pass of a single DFA when it supports all of them
+    size_t joined_len = 1;
+    for (int i = 0; i < num; i++)
+        joined_len += strlen(srcs[i]) + 6;
+    char *joined = xrealloc(NULL, joined_len);
+    joined[0] = '\0';
+    for (int i = 0; i < num; i++) {
+        strcat(joined, i == 0 ? "\\(" : "\\|\\(");
+        strcat(joined, srcs[i]);
+        strcat(joined, "\\)");
+    }
+    pat->any_dfa = lazy_dfa_compile(joined, DFA_CACHE_BUDGET);
+    free(joined);
+    return pat;
+}
+
+/**
+ * @brief Compiles a single searching pattern.
+ *
+ * @param src the pattern given by the user
+ * @return pattern_t* a pointer to the compiled pattern
+ */
+pattern_t *pattern_compile(char *src) {
+    return pattern_compile_set(&src, 1);
+}
+
+/**
+ * @brief Checks a line the first `checked` required literals of the entry
+ * are already known to be in.
+ */
+static bool match_candidate(entry_t *ent, const char *line, size_t len, int checked) {
+    regmatch_t bounds;
+
+    for (int i = checked; i < ent->num_literals; i++) {
+        if (literal_search(line, len, ent->literals[i].str, ent->literals[i].len) == NULL)
+            return false;
+    }
+    if (ent->is_literal)
+        return true;
+    if (ent->dfa != NULL)
+        return lazy_dfa_match_line(ent->dfa, line, len);
+
+    bounds.rm_so = 0;
+    bounds.rm_eo = len;
+    return regexec(&ent->regex, line, 1, &bounds, REG_STARTEND) == 0;
+}
+
+typedef struct {
+    pattern_t *pat;
+    const char *line;
+    size_t len;
+    bool matched;
+} verify_ctx_t;
+
+/**
+ * @brief Checks the entry whose longest literal was found in the line.
+ */
+static bool verify_hit(int id, const char *start, void *arg) {
+    verify_ctx_t *ctx = arg;
+    ctx->matched = match_candidate(&ctx->pat->entries[id], ctx->line, ctx->len, 1);
+    return !ctx->matched;
+}
+
+/**
+ * @brief Checks a line, hit_id is the entry whose longest literal is known
+ * to be in the line, or -1.
+ */
+static bool match_any(pattern_t *pat, const char *line, size_t len, int hit_id) {
+    if (pat->num_entries == 1)
+        return match_candidate(&pat->entries[0], line, len, hit_id == 0 ? 1 : 0);
+
+    if (pat->prefilter) {
+        // Only the entries whose longest literal is in the line can match
+        verify_ctx_t ctx = {pat, line, len, false};
+        if (hit_id != -1 && pat->entries[hit_id].is_literal)
+            return true;
+        aho_corasick_scan(pat->ac, line, len, verify_hit, &ctx);
+        return ctx.matched;
+    }
+    if (pat->any_dfa != NULL)
+        return lazy_dfa_match_line(pat->any_dfa, line, len);
+    for (int i = 0; i < pat->num_entries; i++) {
+        if (match_candidate(&pat->entries[i], line, len, 0))
+            return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Checks whether a single line matches the pattern.
+ *
+ * @param pat the compiled pattern
+ * @param line the beginning of the line, doesn't need to be NUL terminated
+ * @param len the length of the line without '\n'
+ * @return true if the line matches
+ */
+bool pattern_match_line(pattern_t *pat, const char *line, size_t len) {
+    return match_any(pat, line, len, -1);
+}
+
+/**
+ * @brief Checks whether a text may contain a match, knowing only which
+ * strings the text contains: a match of an entry contains all its
+ * required literals.
+ *
+ * @param pat the compiled pattern
+ * @param fn tells whether the text contains a string
+ * @param arg the argument passed to fn
+ * @return false if no line of the text can match
+ */
+bool pattern_may_match(pattern_t *pat, contains_fn *fn, void *arg) {
+    for (int i = 0; i < pat->num_entries; i++) {
+        entry_t *ent = &pat->entries[i];
+        int j = 0;
+        while (j < ent->num_literals && fn(ent->literals[j].str, ent->literals[j].len, arg))
+            j++;
+        if (j == ent->num_literals)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Counts the lines begin in [from, to).
+ */
+static long count_lines_between(const char *from, const char *to) {
+    return literal_count(from, to - from, '\n');
+}
+
+/**
+ * @brief Searches the whole buffer and calls fn on every matched line.
+ * When every expression has a required literal, the buffer is scanned for
+ * them and only the lines containing one are checked further, otherwise
+ * every line is checked.
+ *
+ * @param pat the compiled pattern
+ * @param buf the buffer holding the lines, doesn't need to be NUL terminated
+ * @param len the length of the buffer
+ * @param count_lines whether the line numbers passed to fn are needed,
+ * 0 is passed otherwise
+ * @param fn called with the line (without '\n'), its length and its line
+ * number, returns false to stop the search
+ * @param arg passed to fn
+ */
+void pattern_search(pattern_t *pat, const char *buf, size_t len,
+                    bool count_lines, line_fn *fn, void *arg) {
+    const char *pos = buf;
+    const char *end = buf + len;
+    const char *counted = buf; // Lines before it have been counted
+    long line_number = 1;
+
+    while (pos < end) {
+        const char *hit = pos;
+        const char *bol = pos;
+        const char *eol;
+        int hit_id = -1;
+        if (pat->prefilter) {
+            if (pat->num_entries == 1) {
+                literal_t *lit = &pat->entries[0].literals[0];
+                hit = literal_search(pos, end - pos, lit->str, lit->len);
+                hit_id = 0;
+            } else {
+                hit = aho_corasick_search(pat->ac, pos, end - pos, &hit_id);
+            }
+            if (hit == NULL)
+                return;
+            // pos is always the beginning of a line
+            bol = memrchr(pos, '\n', hit - pos);
+            bol = (bol == NULL) ? pos : bol + 1;
+        }
+        if ((eol = memchr(hit, '\n', end - hit)) == NULL)
+            eol = end;
+
+        if (match_any(pat, bol, eol - bol, hit_id)) {
+            if (count_lines) {
+                line_number += count_lines_between(counted, bol);
+                counted = bol;
+            }
+            if (!fn(bol, eol - bol, count_lines ? line_number : 0, arg))
+                return;
+        }
+        pos = eol + 1;
+    }
+}
+
+/**
+ * @brief Appends a pattern to a list of patterns.
+ *
+ * @param srcs the list, or NULL if it is empty
+ * @param num the number of patterns in the list, increased by one
+ * @param src the pattern to append, not copied
+ * @return the list, which may have been moved
+ */
+char **pattern_list_add(char **srcs, int *num, char *src) {
+    srcs = xrealloc(srcs, (*num + 1) * sizeof(char *));
+    srcs[(*num)++] = src;
+    return srcs;
+}
+
+/**
+ * @brief Appends every line of a file to a list of patterns. Exits if
+ * the file can't be read.
+ *
+ * @param srcs the list, or NULL if it is empty
+ * @param num the number of patterns in the list, increased by the number
+ * of lines
+ * @param path the file holding one pattern per line
+ * @return the list, which may have been moved
+ */
+char **pattern_list_read_file(char **srcs, int *num, const char *path) {
+    FILE *file;
+    char *buf = NULL;
+    size_t buf_size = 0;
+    ssize_t read;
+
+    if ((file = fopen(path, "r")) == NULL) {
+        perror(path);
+        exit(1);
+    }
+    while ((read = getline(&buf, &buf_size, file)) != -1) {
+        if (read > 0 && buf[read - 1] == '\n')
+            buf[read - 1] = '\0';
+        srcs = pattern_list_add(srcs, num, strdup(buf));
+    }
+    free(buf);
+    fclose(file);
+    return srcs;
+}
+
+/**
+ * @brief Frees the compiled pattern.
+ *
+ * @param pat the compiled pattern
+ */
+void pattern_free(pattern_t *pat) {
+    for (int i = 0; i < pat->num_entries; i++) {
+        entry_t *ent = &pat->entries[i];
+        regfree(&ent->regex);
+        if (ent->dfa != NULL)
+            lazy_dfa_free(ent->dfa);
+        for (int j = 0; j < ent->num_literals; j++)
+            free(ent->literals[j].str);
+        free(ent->literals);
+    }
+    free(pat->entries);
+    if (pat->ac != NULL)
+        aho_corasick_free(pat->ac);
+    if (pat->any_dfa != NULL)
+        lazy_dfa_free(pat->any_dfa);
+    free(pat);
+}
@@ -0,0 +1,24 @@
+#ifndef PATTERN_INCLUDED
+#define PATTERN_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct pattern pattern_t;
+
+/* Called on every matched line, return false to stop the search */
+typedef bool (line_fn)(const char *line, size_t len, long line_number, void *arg);
+/* Tells whether a text contains a string */
+typedef bool (contains_fn)(const char *str, size_t len, void *arg);
+
+pattern_t *pattern_compile(char *src);
+pattern_t *pattern_compile_set(char **srcs, int num);
+bool pattern_match_line(pattern_t *pat, const char *line, size_t len);
+bool pattern_may_match(pattern_t *pat, contains_fn *fn, void *arg);
+void pattern_search(pattern_t *pat, const char *buf, size_t len,
+                    bool count_lines, line_fn *fn, void *arg);
+char **pattern_list_add(char **srcs, int *num, char *src);
+char **pattern_list_read_file(char **srcs, int *num, const char *path);
+void pattern_free(pattern_t *pat);
+
+#endif
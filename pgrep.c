@@ -7,7 +7,6 @@ multithreaded!
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <ftw.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <sys/types.h>
@@ -16,17 +15,38 @@ multithreaded!
 #include <regex.h>
 #include <pthread.h>
 #include <errno.h>
-#include <semaphore.h>
-#include "thread-safe-linked-list.h"
-#include <getopt.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include "work-stealing-pool.h"
+#include "reorder-buffer.h"
+#include "arena.h"
+#include "dir-walk.h"
+#include "uring-reader.h"
+#include "gzip-reader.h"
+#include "trigram-index.h"
+#include "run-stats.h"
+#include "spill-file.h"
+#include "match-record.h"
+#include "splice-output.h"
+#include "pattern.h"
+#include "literal-search.h"
 
-#define MAX_FILE_NUM 4096
+#define REORDER_WINDOW 4096 // files in flight ahead of the printer
+#define QUEUE_CAPACITY 1024 // files queued ahead of the readers
 #define BUF_SIZE 4096
-#define WORK_THREAD_NUM 8
-#define FILE_THREAD_NUM 8
+#define AUTO_THREAD_FACTOR 4 // -j auto runs up to 4 readers per CPU
+#define URING_MAX_FILE MB // bigger files are mapped instead of read with -u
 #define threshold 2
 #define KB 1024
 #define MB (1024*1024)
+#define INDEX_OPTION 256 // the long options have no short one
+#define STATS_OPTION 257
+#define TRACE_OPTION 258
+#define BUFFER_OPTION 259
+#define OFFSETS_OPTION 260
+#define OUTPUT_BUDGET (64 * MB) // default of --buffer
 
 // typedef struct file_grep_task {
 //     char *filename;
@@ -42,57 +62,121 @@ multithreaded!
 typedef struct {
    char *file_name;
    int task_num;
+   void *dir; // a directory to list instead of a file, see dir-walk.c
+   dir_walk_t **walk; // the walk of dir, in dir_walks
+   arena_t *output; // the result, handed to the printer with the task
+   long matches; // matched lines found in the file
+   trigram_file_t *index_file; // with --index, the file in the new index
+   bool skip; // the index tells the file can't match, it isn't read
+   size_t spilled; // the length of the output in the spill file, 0 if in memory
+   off_t spill_offset;
 } task_t;
 
-typedef struct {
-    linked_list_t *output;
-    int output_num;
-} output_t;
-
 
 // GLOBALS
 bool recursive = false;
+bool single_file = false; // one file, not a directory, searched by the main thread alone
+bool print_file_names = false; // -r or several files, the lines begin with the name
 bool print_line_numbers = false;
-char *pattern = NULL;
-const char *usage = "Usage: ./pgrep [-rh] [pattern] [file] \n"
+bool list_files = false; // -l, print only the names of the files which match
+bool count_matches = false; // -c, print only the number of matched lines
+long max_count = 0; // -m, stop after so many matched lines in total, 0 for no limit
+long printed_count = 0; // matched lines printed so far, only by the printer
+atomic_bool cancelled = false; // -m is reached, the remaining files are skipped
+char **patterns = NULL; // from -e, -f or the first argument
+int num_patterns = 0;
+bool patterns_from_options = false;
+pattern_t *compiled_pattern = NULL; // compiled once in main, shared by all threads
+int num_threads = 0; // readers doing the work, from -j or one per CPU
+int num_pool_threads = 0; // readers started, more than num_threads with -j auto
+bool adaptive_threads = false;
+unsigned uring_depth = 0; // files each reader reads at once with io_uring, 0 without -u
+const char *index_path = NULL; // --index, the trigram index of the directory
+trigram_index_t *trigram_index = NULL;
+struct stat index_stat; // the index file is in the directory if it was there
+bool index_existed = false;
+bool show_stats = false; // --stats
+const char *trace_path = NULL; // --trace
+run_stats_t *stats = NULL; // with --stats or --trace, NULL otherwise
+long output_budget = OUTPUT_BUDGET; // --buffer, bytes of output held for the printer
+atomic_long buffered_bytes = 0; // output held in memory for the printer
+atomic_long printing = 0; // the task_num the printer waits for
+spill_file_t *spill_file = NULL; // outputs beyond the budget, see spill-file.c
+arena_pool_t *printer_arenas = NULL; // for the spilled outputs read back and the path records
+match_format_t output_format = MATCH_TEXT; // --offsets, records instead of the lines
+long printed_path = -1; // the last file whose path record is printed, only by the printer
+bool splice_lines = false; // a single file into a pipe, its lines go by vmsplice()
+const char *usage = "Usage: ./pgrep [-rhnlc] [-m num] [-j N|auto] [-u depth] [--index file] [--buffer size]\n"
+                    "               [--offsets binary|json] [--stats] [--trace file]\n"
+                    "               [-e pattern]... [-f file] [pattern] [file]... \n"
                     "-h     Show help message\n"
-                    "-r     Recursively search through directory structure\n"
-                    "-n     Include line numbers\n";
-pthread_t thread_pool[WORK_THREAD_NUM];
-linked_list_t *task_list;
-linked_list_t *output_list;
+                    "-r     Recursively search through the directories, the files\n"
+                    "       given are searched too\n"
+                    "-n     Include line numbers\n"
+                    "-l     Only print the names of the files which match\n"
+                    "-c     Only print the number of matched lines of each file\n"
+                    "-m     Stop after num matched lines, in total over all the files\n"
+                    "-e     Search for this pattern, may be given many times\n"
+                    "-f     Search for the patterns in this file, one per line\n"
+                    "-j     Use N reader threads instead of one per CPU, or adjust\n"
+                    "       the number to the load with auto\n"
+                    "-u     With -r, read up to depth files at once per reader\n"
+                    "       with io_uring, if the kernel allows it\n"
+                    "--index  With -r, keep a trigram index of the directory in\n"
+                    "       file, and skip the files which can't match\n"
+                    "--buffer  With -r, hold at most size bytes of output in memory\n"
+                    "       while an earlier file is searched, the rest goes to a\n"
+                    "       temporary file. K, M and G suffixes allowed, 64M by default\n"
+                    "--offsets  Print the file, offset and length of every matched\n"
+                    "       line as binary or JSON records instead of the line, and\n"
+                    "       the path of every file once, see match-record.c\n"
+                    "--stats  Print the work and the time of every thread on stderr\n"
+                    "--trace  Write the spans of every thread into file, as Chrome\n"
+                    "       trace-event JSON\n";
+pthread_t *thread_pool;
+pthread_t printer;
+ws_pool_t *task_pool; // one deque per reader, see work-stealing-pool.c
+arena_pool_t **arena_pools; // output buffers of each reader
+reorder_buffer_t *output_buffer; // outputs of the files by task_num
+dir_walk_t **dir_walks; // one walk per directory searched, listed by the readers too
+int num_walks = 0;
 
 int task_num = 0;
 
-int next_output = 0;
-pthread_mutex_t next_output_mut;
-bool files_added_to_task_list = false;
-pthread_mutex_t readers_finished_mut;
-int readers_finished = 0;
-pthread_mutex_t reading_mut;
-sem_t reading_sem;
-bool reading = false;
 
 /**
-* @brief inner function for printing out nodes in the linked list
+* @brief parse a size with an optional K, M or G suffix, exit if invalid
 */
-void print_line(void *buf) {
-    printf("%s", (char *)buf);
-}
+long parse_size(const char *arg) {
+    char *end;
+    long size = strtol(arg, &end, 10);
 
-/**
-* @brief traverse and print the output list
-*/
-void output_list_print(void *output) {
-    linked_list_print(((output_t *)output)->output, print_line);
+    switch (*end) {
+        case 'K': case 'k': size *= KB; end++; break;
+        case 'M': case 'm': size *= MB; end++; break;
+        case 'G': case 'g': size *= (long)KB * MB; end++; break;
+    }
+    if (*end != '\0' || size < 0) {
+        fprintf(stderr, "Invalid size %s\n%s", arg, usage);
+        exit(1);
+    }
+    return size;
 }
 
 /**
 * @brief parse the arguments to get flags, searching pattern and files for searching
 */
-char *parse_args(int argc, char **argv) {
+char **parse_args(int argc, char **argv, int *num_paths) {
+    static const struct option long_options[] = {
+        {"index", required_argument, NULL, INDEX_OPTION},
+        {"stats", no_argument, NULL, STATS_OPTION},
+        {"trace", required_argument, NULL, TRACE_OPTION},
+        {"buffer", required_argument, NULL, BUFFER_OPTION},
+        {"offsets", required_argument, NULL, OFFSETS_OPTION},
+        {NULL, 0, NULL, 0}
+    };
     int opt;
-    while ((opt = getopt(argc, argv, "rhn")) != -1) {
+    while ((opt = getopt_long(argc, argv, "rhnlcm:e:f:j:u:", long_options, NULL)) != -1) {
         switch (opt) {
             case 'r':
                 recursive = true;
@@ -106,92 +190,580 @@ char *parse_args(int argc, char **argv) {
                 print_line_numbers = true;
                 break;
 
+            case 'l':
+                list_files = true;
+                break;
+
+            case 'c':
+                count_matches = true;
+                break;
+
+            case 'm':
+                if ((max_count = atol(optarg)) <= 0) {
+                    fprintf(stderr, "Invalid number of matches %s\n%s", optarg, usage);
+                    exit(1);
+                }
+                break;
+
+            case 'e':
+                patterns = pattern_list_add(patterns, &num_patterns, optarg);
+                patterns_from_options = true;
+                break;
+
+            case 'f':
+                patterns = pattern_list_read_file(patterns, &num_patterns, optarg);
+                patterns_from_options = true;
+                break;
+
+            case 'j':
+                if (strcmp(optarg, "auto") == 0) {
+                    adaptive_threads = true;
+                } else if ((num_threads = atoi(optarg)) <= 0) {
+                    fprintf(stderr, "Invalid number of threads %s\n%s", optarg, usage);
+                    exit(1);
+                }
+                break;
+
+            case 'u':
+                if (atoi(optarg) <= 0) {
+                    fprintf(stderr, "Invalid depth %s\n%s", optarg, usage);
+                    exit(1);
+                }
+                uring_depth = atoi(optarg);
+                break;
+
+            case INDEX_OPTION:
+                index_path = optarg;
+                break;
+
+            case STATS_OPTION:
+                show_stats = true;
+                break;
+
+            case TRACE_OPTION:
+                trace_path = optarg;
+                break;
+
+            case BUFFER_OPTION:
+                output_budget = parse_size(optarg);
+                break;
+
+            case OFFSETS_OPTION:
+                if (!match_format_parse(optarg, &output_format)) {
+                    fprintf(stderr, "Invalid format %s\n%s", optarg, usage);
+                    exit(1);
+                }
+                break;
+
             case '?':
                 printf("Error parsing command line arguments\n%s", usage);
                 exit(1);
         }
     }
 
-    // If there are not two arguments left (pattern and file name)
-    if (argc - optind != 2) {
+    // The pattern is the first argument left unless -e or -f is used
+    if (!patterns_from_options && optind < argc)
+        patterns = pattern_list_add(patterns, &num_patterns, argv[optind++]);
+
+    // No line is printed with -l or -c
+    if (list_files || count_matches)
+        print_line_numbers = false;
+
+    if (num_threads == 0)
+        num_threads = ws_pool_num_cpus();
+    num_pool_threads = adaptive_threads ? AUTO_THREAD_FACTOR * num_threads : num_threads;
+
+    // If there is no argument left (file names)
+    if (argc - optind < 1) {
         fprintf(stderr, "Missing either pattern or file name in parsing command line arguments\n%s", usage);
         exit(1);
     }
 
-    pattern = argv[optind];
-    return argv[optind + 1];
+    if (output_format != MATCH_TEXT && (print_line_numbers || list_files || count_matches)) {
+        fprintf(stderr, "--offsets can't be used with -n, -l or -c\n%s", usage);
+        exit(1);
+    }
+
+    *num_paths = argc - optind;
+    return argv + optind;
+}
+
+typedef struct {
+    const char *file_name;
+    size_t file_name_len;
+    long file_id; // the id of the file in the records of --offsets
+    arena_t *output;
+    long matches;
+    long line_base; // lines before the searched buffer, in inflated gzip data
+    const char *data; // the searched buffer
+    long data_offset; // its offset in the file, in inflated gzip data
+    trigram_file_t *index_file; // collect the trigrams of the file, or NULL
+    int worker; // the reader searching the file
+    bool ranges; // save the ranges of the lines in data, see splice-output.c
+} grep_file_ctx_t;
+
+/**
+* @brief write the decimal digits of n to dst, return the number of digits
+*/
+size_t format_number(char *dst, long n) {
+    char digits[20];
+    size_t len = 0;
+    do {
+        digits[len++] = '0' + n % 10;
+        n /= 10;
+    } while (n > 0);
+    for (size_t i = 0; i < len; i++)
+        dst[i] = digits[len - 1 - i];
+    return len;
+}
+
+/**
+* @brief tell whether the search of a file can stop: -m is reached, or the
+* file matches for -l, or it has as many matched lines as -m could print
+*/
+bool stop_search(long matches) {
+    if (cancelled)
+        return true;
+    if (list_files)
+        return matches > 0;
+    return max_count > 0 && matches >= max_count;
+}
+
+/**
+* @brief format a matched line and append it to the output of the file,
+* or only count it with -l and -c. Returns false to stop the search.
+*/
+bool add_output_line(const char *buf, size_t read, long line_number, void *arg) {
+    grep_file_ctx_t *ctx = arg;
+
+    ctx->matches++;
+    if (list_files || count_matches)
+        return !stop_search(ctx->matches);
+    if (output_format != MATCH_TEXT) {
+        match_record_line(ctx->output, output_format, ctx->file_id,
+                          ctx->data_offset + (buf - ctx->data), read);
+        return !stop_search(ctx->matches);
+    }
+    if (ctx->ranges) {
+        splice_output_add(ctx->output, buf - ctx->data, read + 1);
+        return !stop_search(ctx->matches);
+    }
+
+    /* num bytes read + size of file name + 2 bytes for colons, line
+    number + 1 byte for \n */
+    char *line = arena_reserve(ctx->output, read + ctx->file_name_len + 2 + 20 + 1);
+    size_t len = 0;
+
+    if (print_file_names) {
+        memcpy(line, ctx->file_name, ctx->file_name_len);
+        len += ctx->file_name_len;
+        line[len++] = ':';
+    }
+    if (print_line_numbers) {
+        len += format_number(line + len, ctx->line_base + line_number);
+        line[len++] = ':';
+    }
+    memcpy(line + len, buf, read);
+    len += read;
+    line[len++] = '\n';
+    arena_commit(ctx->output, len);
+    return !stop_search(ctx->matches);
 }
 
-linked_list_t *grep_file(const char *file_name) {
-    FILE *file;
+/**
+* @brief read the whole file into memory. Regular files are mapped,
+* others are read until EOF. *mapped tells how to release the buffer.
+*/
+char *load_file(const char *file_name, size_t *len, bool *mapped) {
+    struct stat sb;
     char *buf = NULL;
-    size_t buf_size = 10;
-    size_t read;
-    int regex_errorno; // value returned from regex library functions, zero indicates success
-    regex_t regex; // tmp variable to conduct regex operations
+    size_t size = 0;
+    ssize_t read_size;
+    int fd;
 
-    linked_list_t *output = linked_list_new();
+    if ((fd = open(file_name, O_RDONLY)) == -1)
+        return NULL;
 
-    // compile the searching pattern to a regex object
-    if (regcomp(&regex, pattern, 0)) {
-        fprintf(stderr, "Regex compile failed\n");
-        exit(1);
+    *len = 0;
+    *mapped = false;
+    if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0) {
+        buf = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (buf != MAP_FAILED) {
+            madvise(buf, sb.st_size, MADV_SEQUENTIAL);
+            close(fd);
+            *len = sb.st_size;
+            *mapped = true;
+            return buf;
+        }
+        buf = NULL;
     }
-    if ((file = fopen(file_name, "r")) == NULL) {
-        printf("%s\n", file_name);
-        perror("Error Opening File");
-        exit(1);
+
+    do {
+        if (*len == size) {
+            size = size ? size * 2 : BUF_SIZE;
+            if ((buf = realloc(buf, size)) == NULL) {
+                perror("malloc failed in pgrep: load_file");
+                exit(1);
+            }
+        }
+        read_size = read(fd, buf + *len, size - *len);
+        if (read_size > 0)
+            *len += read_size;
+    } while (read_size > 0 || (read_size == -1 && errno == EINTR));
+    close(fd);
+    return buf;
+}
+
+/**
+* @brief stop all the searches once -m is reached: the files left are
+* skipped and the directory walk reads no more directory
+*/
+void cancel_search() {
+    cancelled = true;
+    for (int i = 0; i < num_walks; i++) {
+        if (dir_walks[i] != NULL)
+            dir_walk_stop(dir_walks[i]);
     }
+}
 
-    int line_number = 1;
-    while ((read = getline(&buf, &buf_size, file)) != -1) {
-        regex_errorno = regexec(&regex, buf, 0, NULL, 0);
-        if (regex_errorno == REG_NOMATCH) {
-            continue;
+/**
+* @brief cut the output of a file after the matched lines -m allows, and
+* cancel the search when there are enough. Called in the order of the output.
+*/
+void limit_output(arena_t *output) {
+    const char *data = arena_data(output);
+    long left = max_count - printed_count;
+    long lines;
+
+    if (max_count == 0)
+        return;
+    // The records of --offsets are counted like the lines
+    lines = match_record_count(output_format, data, arena_len(output));
+    if (lines < left) {
+        printed_count += lines;
+        return;
+    }
+    // keep the first left lines, nothing after them
+    arena_truncate(output, match_record_keep(output_format, data, arena_len(output), left));
+    printed_count = max_count;
+    cancel_search();
+}
+
+/**
+* @brief save the line of -l or -c for a file: its name if it matches, or
+* its number of matched lines. -m caps the number, over all the files.
+* Called in the order of the output.
+*/
+void add_summary(arena_t *output, const char *file_name, long matches) {
+    char *line = arena_reserve(output, strlen(file_name) + 1 + 20 + 1);
+    size_t len = 0;
+
+    if (list_files && matches > 1)
+        matches = 1;
+    if (max_count > 0) {
+        if (printed_count >= max_count)
+            return;
+        if (matches >= max_count - printed_count) {
+            matches = max_count - printed_count;
+            cancel_search();
         }
-        /* num bytes read + size of file name + 3 bytes for colons, line
-        number + 1 byte for \n + 1 byte for nul termiantor */
-        char *line;
-        if ((line = calloc(1, read + strlen(file_name) + 3 + 1 + 1)) == NULL) {
-            perror("malloc failed in pgrep: grep_file 2");
-            free(buf);
-            exit(1);
+        printed_count += matches;
+    }
+    if (list_files && matches == 0)
+        return;
+    if (list_files || print_file_names) {
+        memcpy(line, file_name, strlen(file_name));
+        len += strlen(file_name);
+        line[len++] = list_files ? '\n' : ':';
+    }
+    if (count_matches) {
+        len += format_number(line + len, matches);
+        line[len++] = '\n';
+    }
+    arena_commit(output, len);
+}
+
+/**
+* @brief print out the formatted lines of one file in a single write,
+* and give the arena back to its reader
+*/
+void print_lines(arena_t *output) {
+    uint64_t start = run_stats_now(stats);
+
+    if (arena_len(output) > 0) {
+        run_stats_output(stats);
+        fwrite(arena_data(output), 1, arena_len(output), stdout);
+        run_stats_span(stats, RUN_PRINT, start, arena_len(output));
+    }
+    arena_release(output);
+}
+
+/**
+* @brief with --offsets, print the path record of a file before its first
+* record of a line
+*/
+void print_path(const char *file_name, long file_id, arena_t *output) {
+    if (output_format == MATCH_TEXT || arena_len(output) == 0 || file_id == printed_path)
+        return;
+    arena_t *path = arena_get(printer_arenas);
+    match_record_path(path, output_format, file_id, file_name);
+    print_lines(path);
+    printed_path = file_id;
+}
+
+/**
+* @brief print the result of a file, or only its line of -l or -c, and
+* apply -m. Only one thread prints, in the order of the files.
+*/
+void print_result(const char *file_name, long file_id, arena_t *output, long matches) {
+    if (list_files || count_matches)
+        add_summary(output, file_name, matches);
+    else
+        limit_output(output);
+    print_path(file_name, file_id, output);
+    print_lines(output);
+}
+
+/**
+* @brief search gzip data through its inflated lines, while the threads of
+* a gzip reader inflate the next ones, see gzip-reader.c. A file searched by
+* the readers gets one such thread, they run in parallel already. A single file gets
+* num_threads of them, and its output is printed after every block, since
+* the inflated data may be huge.
+*/
+void grep_gzip(grep_file_ctx_t *ctx, const char *buf, size_t len, arena_pool_t *pool) {
+    gzip_reader_t *reader = gzip_reader_new(buf, len, single_file ? num_threads : 1);
+    const char *lines = buf; // NULL once all the data was inflated
+    size_t size;
+
+    while (!stop_search(ctx->matches) && (lines = gzip_reader_next(reader, &size)) != NULL) {
+        if (ctx->index_file != NULL)
+            trigram_index_scan(trigram_index, ctx->worker, lines, size);
+        uint64_t start = run_stats_now(stats);
+        ctx->data = lines;
+        pattern_search(compiled_pattern, lines, size, print_line_numbers, add_output_line, ctx);
+        run_stats_span(stats, RUN_MATCH, start, size);
+        run_stats_count(stats, size, 0, 1, 0);
+        if (print_line_numbers)
+            ctx->line_base += literal_count(lines, size, '\n');
+        ctx->data_offset += size;
+        if (single_file && !list_files && !count_matches && arena_len(ctx->output) > 0) {
+            limit_output(ctx->output);
+            print_path(ctx->file_name, ctx->file_id, ctx->output);
+            print_lines(ctx->output);
+            ctx->output = arena_get(pool);
         }
+    }
+    if (gzip_reader_failed(reader))
+        fprintf(stderr, "%s: invalid compressed data\n", ctx->file_name);
+    // The trigrams are only complete if all the data was inflated
+    if (ctx->index_file != NULL)
+        trigram_index_finish(trigram_index, ctx->worker, ctx->index_file,
+                             lines == NULL && !gzip_reader_failed(reader));
+    gzip_reader_free(reader);
+}
 
-        if (recursive) {
-            if (print_line_numbers)
-                sprintf(line, "%s:%d:%s", file_name, line_number, buf);
-            else
-                sprintf(line, "%s:%s", file_name, buf);
-        } else {
-            if (print_line_numbers)
-                sprintf(line, "%d:%s", line_number, buf);
-            else
-                sprintf(line, "%s", buf);
+/**
+* @brief search the contents of a file with the shared compiled pattern and
+* return the formatted matched lines in an arena taken from pool, and
+* their number in matches. gzip data is searched inflated. With index_file
+* the trigrams of the contents are collected by the reader worker too.
+* With ranges only the ranges of the lines in buf are returned, for
+* splice_output_write, except for gzip data.
+*/
+arena_t *grep_buffer(const char *file_name, long file_id, const char *buf, size_t len,
+                     trigram_file_t *index_file, int worker,
+                     arena_pool_t *pool, long *matches, bool ranges) {
+    grep_file_ctx_t ctx;
+
+    ctx.file_name = file_name;
+    ctx.file_name_len = strlen(file_name);
+    ctx.file_id = file_id;
+    ctx.output = arena_get(pool);
+    ctx.matches = 0;
+    ctx.line_base = 0;
+    ctx.data = buf;
+    ctx.data_offset = 0;
+    ctx.index_file = cancelled ? NULL : index_file;
+    ctx.worker = worker;
+    ctx.ranges = false;
+    if (!cancelled && gzip_reader_is_gzip(buf, len)) {
+        grep_gzip(&ctx, buf, len, pool);
+    } else if (!cancelled) {
+        ctx.ranges = ranges;
+        if (ctx.index_file != NULL) {
+            trigram_index_scan(trigram_index, worker, buf, len);
+            trigram_index_finish(trigram_index, worker, index_file, true);
         }
-        linked_list_insert_back(output, line);
-        line_number++;
+        uint64_t start = run_stats_now(stats);
+        pattern_search(compiled_pattern, buf, len, print_line_numbers, add_output_line, &ctx);
+        run_stats_span(stats, RUN_MATCH, start, len);
+        run_stats_count(stats, len, 0, 1, 0);
     }
-    fclose(file);
-    free(buf);
+    run_stats_count(stats, 0, 1, 0, ctx.matches);
+    *matches = ctx.matches;
+    return ctx.output;
+}
+
+/**
+* @brief search the file with the shared compiled pattern and return
+* the formatted matched lines in an arena taken from pool, and their
+* number in matches, see grep_buffer
+*/
+arena_t *grep_file(const char *file_name, long file_id, trigram_file_t *index_file, int worker,
+                   arena_pool_t *pool, long *matches) {
+    char *buf;
+    size_t len;
+    bool mapped;
+    uint64_t start = run_stats_now(stats);
+
+    // The files after -m is reached aren't even read
+    if (cancelled) {
+        *matches = 0;
+        return arena_get(pool);
+    }
+
+    if ((buf = load_file(file_name, &len, &mapped)) == NULL) {
+        printf("%s\n", file_name);
+        perror("Error Opening File");
+        exit(1);
+    }
+    run_stats_span(stats, RUN_READ, start, len);
+
+    arena_t *output = grep_buffer(file_name, file_id, buf, len, index_file, worker, pool, matches, false);
+
+    if (mapped)
+        munmap(buf, len);
+    else
+        free(buf);
     return output;
 }
 
-int add_to_task_list(const char *filename, const struct stat *statptr,
-    int fileflags) {
+/**
+* @brief print the matched lines of a file from their ranges in its mapping,
+* and give the arena back
+*/
+void print_ranges(arena_t *ranges, const char *buf, size_t len) {
+    uint64_t start = run_stats_now(stats);
+    ssize_t written;
 
-    if (fileflags == FTW_F) {
-        task_t *task;
-        if ((task = malloc(sizeof(task_t))) == NULL) {
-            perror("malloc failed in pgrep: add_to_task_list");
-            exit(1);
-        }
-        task->task_num = task_num++;
-        // printf("set num: %d\n", task->task_num);
-        task->file_name = strdup(filename);
-        linked_list_insert_front(task_list, task);
+    if (arena_len(ranges) > 0) {
+        run_stats_output(stats);
+        // Anything printed before goes first
+        fflush(stdout);
+        if ((written = splice_output_write(STDOUT_FILENO, buf, len, ranges)) > 0)
+            run_stats_span(stats, RUN_PRINT, start, written);
+    }
+    arena_release(ranges);
+}
+
+/**
+* @brief search the single file without -r and print its result. Into a
+* pipe, see splice_lines, the lines are given to the pipe from the mapping
+* of the file, which is kept until they are written.
+*/
+void grep_single(const char *file_name, arena_pool_t *pool) {
+    char *buf;
+    size_t len;
+    bool mapped;
+    long matches;
+    uint64_t start = run_stats_now(stats);
+
+    if ((buf = load_file(file_name, &len, &mapped)) == NULL) {
+        printf("%s\n", file_name);
+        perror("Error Opening File");
+        exit(1);
+    }
+    run_stats_span(stats, RUN_READ, start, len);
+
+    // The memory read into may be reused before the pipe is read
+    bool ranges = splice_lines && mapped && !gzip_reader_is_gzip(buf, len);
+    arena_t *output = grep_buffer(file_name, 0, buf, len, NULL, 0, pool, &matches, ranges);
+    if (ranges)
+        print_ranges(output, buf, len);
+    else
+        print_result(file_name, 0, output, matches);
+
+    if (mapped)
+        munmap(buf, len);
+    else
+        free(buf);
+}
+
+/**
+* @brief tell whether the indexed file given as arg contains a string
+*/
+bool index_contains(const char *str, size_t len, void *arg) {
+    return trigram_index_contains(trigram_index, arg, str, len);
+}
+
+/**
+* @brief add a file found by the walk to the trigram index. A file known by
+* the index is skipped if it can't match, the others are indexed when they
+* are searched. The index file itself isn't searched.
+*/
+void index_task(task_t *task) {
+    struct stat sb;
+
+    if (stat(task->file_name, &sb) == -1)
+        return;
+    if (index_existed && sb.st_dev == index_stat.st_dev && sb.st_ino == index_stat.st_ino) {
+        task->skip = true;
+        return;
     }
-    return 0; // Tells ftw to continue
+    trigram_file_t *file = trigram_index_add(trigram_index, task->file_name, &sb);
+    if (!trigram_index_known(file))
+        task->index_file = file;
+    else if (!pattern_may_match(compiled_pattern, index_contains, file))
+        task->skip = true;
+}
+
+void add_to_task_list(const char *filename) {
+    task_t *task;
+    uint64_t start = run_stats_now(stats);
+    // Wait for the printer if the readers are too far ahead
+    reorder_buffer_reserve(output_buffer, task_num);
+    run_stats_span(stats, RUN_WAIT, start, task_num);
+    start = run_stats_now(stats);
+    if ((task = malloc(sizeof(task_t))) == NULL) {
+        perror("malloc failed in pgrep: add_to_task_list");
+        exit(1);
+    }
+    task->task_num = task_num++;
+    // printf("set num: %d\n", task->task_num);
+    task->file_name = strdup(filename);
+    task->dir = NULL;
+    task->output = NULL;
+    task->index_file = NULL;
+    task->skip = false;
+    task->spilled = 0;
+    if (trigram_index != NULL)
+        index_task(task);
+    run_stats_span(stats, RUN_ENQUEUE, start, task->task_num);
+    // Wait for the readers if the queue is full, the task is theirs then
+    long num = task->task_num;
+    start = run_stats_now(stats);
+    run_stats_queue(stats, 1);
+    ws_pool_push_wait(task_pool, task);
+    run_stats_span(stats, RUN_WAIT, start, num);
+}
+
+/**
+* @brief called by the directory walk with a directory to list, from any thread
+*/
+void add_dir_to_task_list(void *dir, void *arg) {
+    task_t *task;
+    if ((task = malloc(sizeof(task_t))) == NULL) {
+        perror("malloc failed in pgrep: add_dir_to_task_list");
+        exit(1);
+    }
+    task->file_name = NULL;
+    task->dir = dir;
+    // The first directory is queued before the walk is returned, the
+    // reader listing it looks the walk up later
+    task->walk = arg;
+    run_stats_queue(stats, 1);
+    ws_pool_push(task_pool, task);
 }
 
 // function to grep a file bigger than 2MB
@@ -209,136 +781,307 @@ int add_to_task_list(const char *filename, const struct stat *statptr,
 //     FILE *fp = NULL;
 //     int i = 0;
 //     int posAddress = 0;
-//     long blockSize = info.st_size / FILE_THREAD_NUM;
+//     long blockSize = info.st_size / num_threads;
 // }
 
-bool is_next_output(output_t *output) {
-    pthread_mutex_lock(&next_output_mut);
-    bool flag = output->output_num == next_output;
-    pthread_mutex_unlock(&next_output_mut);
-    return flag;
+/**
+* @brief read a spilled output back into an arena of the printer
+*/
+arena_t *unspill(task_t *task) {
+    uint64_t start = run_stats_now(stats);
+    arena_t *output = arena_get(printer_arenas);
+
+    if (!spill_file_read(spill_file, task->spill_offset,
+                         arena_reserve(output, task->spilled), task->spilled)) {
+        perror("pgrep: reading the spilled output");
+        exit(1);
+    }
+    arena_commit(output, task->spilled);
+    run_stats_span(stats, RUN_READ, start, task->spilled);
+    return output;
+}
+
+/**
+* @brief print the outputs of the files in the order they were found
+*/
+void *print_output(void *arg) {
+    task_t *task;
+    uint64_t start;
+
+    run_stats_thread(stats, num_pool_threads, "printer");
+    // The time the printer waits for the next file is idle
+    while ((start = run_stats_now(stats), task = reorder_buffer_take(output_buffer)) != NULL) {
+        run_stats_span(stats, RUN_IDLE, start, -1);
+        atomic_store(&printing, task->task_num + 1);
+        if (task->spilled > 0)
+            task->output = unspill(task);
+        else
+            atomic_fetch_sub(&buffered_bytes, arena_len(task->output));
+        print_result(task->file_name, task->task_num, task->output, task->matches);
+        free(task->file_name);
+        free(task);
+    }
+    return NULL;
 }
 
-void print_output() {
-    /* Can't test for task list being empty because of state
-    where all tasks have been removed, but a thread is still parsing
-    a file and hasn't yet written it to output list. files_added_to_output_list
-    is only set to true after writing to output list */
-    while (true) {
-        if((linked_list_empty(output_list) && (readers_finished == WORK_THREAD_NUM))) {
-            pthread_mutex_unlock(&readers_finished_mut);
-            reading = false;
-            break;
-        }
-        pthread_mutex_unlock(&readers_finished_mut);
-        output_t *output = linked_list_remove_comp(output_list, (comparator_fn *)is_next_output);
-        if (output == NULL) {
-            pthread_mutex_lock(&reading_mut);
-            reading = false;
-            pthread_mutex_unlock(&reading_mut);
-            sem_wait(&reading_sem);
-            continue;
-        }
-        linked_list_t *list = output->output;
-        while (!linked_list_empty(list)) {
-            char *line = linked_list_remove_front(list);
-            printf("%s", line);
-            free(line);
-        }
-        linked_list_free(list, NULL);
+/**
+* @brief hand the output of a file to the printer, which frees the task.
+* An output which would take the memory held for the printer over
+* --buffer goes to the spill file, unless the printer waits for it.
+*/
+void hand_off(task_t *task) {
+    uint64_t start = run_stats_now(stats);
+    long num = task->task_num;
+    size_t len = arena_len(task->output);
 
-        // printf("loop: %d\n", next_output);
-        next_output++;
+    // If the file can't be written, the output is held anyway
+    if (atomic_fetch_add(&buffered_bytes, len) + (long)len > output_budget && len > 0 &&
+        num != atomic_load(&printing) &&
+        spill_file_write(spill_file, arena_data(task->output), len, &task->spill_offset)) {
+        atomic_fetch_sub(&buffered_bytes, len);
+        arena_release(task->output);
+        task->output = NULL;
+        task->spilled = len;
     }
-    linked_list_free(output_list, NULL);
-    linked_list_free(task_list, NULL);
+    reorder_buffer_put(output_buffer, num, task);
+    run_stats_span(stats, RUN_HANDOFF, start, num);
 }
 
 void *file_reader(void *arg) {
-    if (pthread_detach(pthread_self()) != 0) {
-        perror("thread detach error");
-        exit(1);
-    }
+    int id = (int)(intptr_t)arg; // index of the deque of this reader
+    // With -u the files are queued into a ring of the reader and read in
+    // batches, see uring-reader.c. NULL if io_uring can't be used.
+    uring_reader_t *ring = uring_reader_new(uring_depth, URING_MAX_FILE);
+    const char *buf;
+    size_t len;
+    char name[32];
+    bool idle = false; // no task since idle_since, for --stats and --trace
+    uint64_t idle_since = 0;
+
+    snprintf(name, sizeof(name), "reader %d", id);
+    run_stats_thread(stats, id, name);
     while (true) {
-        if (linked_list_empty(task_list) && files_added_to_task_list) {
-            pthread_mutex_lock(&readers_finished_mut);
-            readers_finished++;
-            pthread_mutex_unlock(&readers_finished_mut);
+        task_t *task = NULL;
+        uint64_t start = run_stats_now(stats);
+        if (ring == NULL || !uring_reader_full(ring))
+            task = ws_pool_pop(task_pool, id);
+        if (idle && (task != NULL || (ring != NULL && !uring_reader_empty(ring)) ||
+                     ws_pool_finished(task_pool))) {
+            run_stats_span(stats, RUN_IDLE, idle_since, -1);
+            idle = false;
+        }
+        if (task != NULL) {
+            run_stats_queue(stats, -1);
+            run_stats_span(stats, RUN_DEQUEUE, start, task->dir != NULL ? -1 : task->task_num);
+        }
+        if (task == NULL && ring != NULL && !uring_reader_empty(ring)) {
+            // Nothing more to queue, search the files read meanwhile
+            start = run_stats_now(stats);
+            if ((task = uring_reader_next(ring, &buf, &len)) == NULL)
+                continue;
+            if (buf != NULL)
+                run_stats_span(stats, RUN_READ, start, len);
+            task->output = buf != NULL ?
+                grep_buffer(task->file_name, task->task_num, buf, len, task->index_file, id,
+                            arena_pools[id], &task->matches, false) :
+                grep_file(task->file_name, task->task_num, task->index_file, id, arena_pools[id],
+                          &task->matches);
+            hand_off(task);
+            ws_pool_done(task_pool);
+            continue;
+        }
+        // Closed, and no reader may push a task anymore
+        if (task == NULL && ws_pool_finished(task_pool)) {
+            if (ring != NULL)
+                uring_reader_free(ring);
             pthread_exit(NULL);
         }
-        task_t *task = linked_list_remove_front(task_list);
-        if (task == NULL)
+        if (task == NULL) {
+            if (!idle) {
+                idle = true;
+                idle_since = start;
+            }
+            // Park until there is a task, see work-stealing-pool.c
+            ws_pool_wait(task_pool, id);
             continue;
-        linked_list_t *res = grep_file(task->file_name);
-        output_t *output;
-        if ((output = malloc(sizeof(output_t))) == NULL) {
-            perror("malloc failed in pgrep: file_reader");
-            exit(1);
         }
-        output->output = res;
-        output->output_num = task->task_num;
-        // printf("task num: %d\n", task->task_num);
-        linked_list_insert_front(output_list, output);
-        pthread_mutex_lock(&reading_mut);
-        if (!reading) {
-            reading = true;
-            sem_post(&reading_sem);
+        if (task->dir != NULL) {
+            start = run_stats_now(stats);
+            dir_walk_list(*task->walk, task->dir);
+            run_stats_span(stats, RUN_LIST, start, -1);
+        } else if (task->skip) {
+            task->output = arena_get(arena_pools[id]);
+            task->matches = 0;
+            hand_off(task);
+            ws_pool_done(task_pool);
+            continue;
+        } else if (ring != NULL && !cancelled) {
+            uring_reader_add(ring, task->file_name, task);
+            continue;
+        } else {
+            task->output = grep_file(task->file_name, task->task_num, task->index_file, id,
+                                     arena_pools[id], &task->matches);
+            hand_off(task);
+            ws_pool_done(task_pool);
+            continue;
         }
-        pthread_mutex_unlock(&reading_mut);
-        free(task->file_name);
         free(task);
+        ws_pool_done(task_pool);
     }
 }
 
 void init_thread_pool() {
-    for (int i = 0; i < WORK_THREAD_NUM; i++) {
-        if ((pthread_create(&thread_pool[i], NULL, file_reader, NULL))) {
+    if ((thread_pool = malloc(num_pool_threads * sizeof(pthread_t))) == NULL ||
+        (arena_pools = malloc(num_pool_threads * sizeof(arena_pool_t *))) == NULL) {
+        perror("malloc failed in pgrep: init_thread_pool");
+        exit(1);
+    }
+    for (int i = 0; i < num_pool_threads; i++) {
+        arena_pools[i] = arena_pool_new();
+        if ((pthread_create(&thread_pool[i], NULL, file_reader, (void *)(intptr_t)i))) {
             perror("pthread_create error");
             exit(1);
         }
     }
 }
 
-void grep_dir(char *path) {
-    // initialize linked lists for producing output
-    task_list = linked_list_new();
-    output_list = linked_list_new();
-    // Iterates over the directory structure starting at path and
-    // calls grep_file_wrapper on each file
+void join_thread_pool() {
+    for (int i = 0; i < num_pool_threads; i++) {
+        if (pthread_join(thread_pool[i], NULL)) {
+            perror("pthread_join error");
+            exit(1);
+        }
+    }
+}
+
+/**
+* @brief search all the files given, and the directories with -r, with one
+* pool of readers and one printer. The files are added in the order of the
+* arguments, and of ftw() inside a directory, which is the order of the output.
+*/
+void grep_paths(char **paths, int num_paths) {
+    // initialize the task pool and the buffer for ordering the output
+    task_pool = ws_pool_new(num_pool_threads);
+    ws_pool_set_capacity(task_pool, QUEUE_CAPACITY);
+    if (adaptive_threads)
+        ws_pool_set_adaptive(task_pool, num_threads);
+    output_buffer = reorder_buffer_new(REORDER_WINDOW);
+    spill_file = spill_file_new();
+    if (index_path != NULL) {
+        char *root = realpath(paths[0], NULL);
+        trigram_index = trigram_index_load(index_path, root != NULL ? root : paths[0], num_pool_threads);
+        index_existed = stat(index_path, &index_stat) == 0;
+        free(root);
+    }
+    // Iterates over the directory structures and calls add_to_task_list
+    // on each file, in the order of ftw(). The readers list the directories
+    // ahead of it, so the walks are made before they start: their roots
+    // are queued right away.
+    const char *file_name;
+    uint64_t start = run_stats_now(stats);
+    if (recursive && (dir_walks = calloc(num_paths, sizeof(dir_walk_t *))) == NULL) {
+        perror("malloc failed in pgrep: grep_paths");
+        exit(1);
+    }
+    // The files among them are searched like the files of the walks
+    struct stat sb;
+    for (int i = 0; recursive && i < num_paths; i++) {
+        if (stat(paths[i], &sb) == 0 && S_ISDIR(sb.st_mode))
+            dir_walks[i] = dir_walk_new(paths[i], true, add_dir_to_task_list, &dir_walks[i]);
+    }
+    num_walks = recursive ? num_paths : 0;
     init_thread_pool();
-    ftw(path, add_to_task_list, MAX_FILE_NUM);
-    files_added_to_task_list = true;
-    print_output();
+    if (pthread_create(&printer, NULL, print_output, NULL)) {
+        perror("pthread_create error");
+        exit(1);
+    }
+    // A walk stopped by -m still goes through the directories it queued
+    for (int i = 0; i < num_paths; i++) {
+        if (!recursive || dir_walks[i] == NULL) {
+            if (!cancelled)
+                add_to_task_list(paths[i]);
+            continue;
+        }
+        while ((file_name = dir_walk_next(dir_walks[i])) != NULL)
+            add_to_task_list(file_name);
+    }
+    run_stats_traversal(stats, start);
+    ws_pool_close(task_pool);
+    reorder_buffer_close(output_buffer, task_num);
+    join_thread_pool();
+    pthread_join(printer, NULL);
+    // A search stopped by -m didn't see every file, the index is kept
+    if (trigram_index != NULL) {
+        if (!cancelled && !trigram_index_save(trigram_index, index_path))
+            perror(index_path);
+        trigram_index_free(trigram_index);
+    }
+    reorder_buffer_free(output_buffer);
+    spill_file_free(spill_file);
+    num_walks = 0;
+    for (int i = 0; recursive && i < num_paths; i++) {
+        if (dir_walks[i] != NULL)
+            dir_walk_free(dir_walks[i]);
+    }
+    free(dir_walks);
+    ws_pool_free(task_pool);
+    for (int i = 0; i < num_pool_threads; i++)
+        arena_pool_free(arena_pools[i]);
+    free(arena_pools);
+    free(thread_pool);
 }
 
 int main(int argc, char *argv[]) {
     struct stat sb;
-    pthread_mutex_init(&readers_finished_mut, NULL);
-    pthread_mutex_init(&next_output_mut, NULL);
-    pthread_mutex_init(&reading_mut, NULL);
-    sem_init(&reading_sem, 0, 0);
-
-    char *file_name = parse_args(argc, argv);
+    int num_paths;
 
-    if (stat(file_name, &sb) == -1) {
-        perror("stat");
-        exit(1);
+    char **paths = parse_args(argc, argv, &num_paths);
+    compiled_pattern = pattern_compile_set(patterns, num_patterns);
+    // The readers, the printer and the main thread record
+    if (show_stats || trace_path != NULL) {
+        stats = run_stats_new(num_pool_threads + 2, show_stats, trace_path);
+        run_stats_thread(stats, num_pool_threads + 1, "main");
     }
+    printer_arenas = arena_pool_new();
 
-    if (recursive && S_ISREG(sb.st_mode)) {
-        fprintf(stderr, "%s is not a directory\n%s", file_name, usage);
-        exit(1);
+    for (int i = 0; i < num_paths; i++) {
+        if (stat(paths[i], &sb) == -1) {
+            perror(paths[i]);
+            exit(1);
+        }
+
+        // With -r the files given are searched as well, like grep does
+        if (!recursive && S_ISDIR(sb.st_mode)) {
+            fprintf(stderr, "%s is not a file\n%s", paths[i], usage);
+            exit(1);
+        }
     }
 
-    if (!recursive && S_ISDIR(sb.st_mode)) {
-        fprintf(stderr, "%s is not a file\n%s", file_name, usage);
+    // The index is kept for a single directory, sb is the last path
+    if (index_path != NULL && (!recursive || num_paths > 1 || !S_ISDIR(sb.st_mode))) {
+        fprintf(stderr, "--index needs -r and a single directory\n%s", usage);
         exit(1);
     }
+    // A single file is searched alone, also with -r
+    single_file = num_paths == 1 && !S_ISDIR(sb.st_mode);
+    print_file_names = !single_file;
+    // Only the bare lines of a single file are in its mapping
+    splice_lines = single_file && !print_line_numbers && !list_files && !count_matches
+                   && max_count == 0 && output_format == MATCH_TEXT
+                   && splice_output_usable(STDOUT_FILENO);
 
-    if (!recursive)
-        grep_file(file_name);
+    if (single_file) {
+        arena_pool_t *pool = arena_pool_new();
+        grep_single(paths[0], pool);
+        arena_pool_free(pool);
+    }
     else
-        grep_dir(file_name);
+        grep_paths(paths, num_paths);
 
-    sem_destroy(&reading_sem);
+    fflush(stdout);
+    if (!run_stats_finish(stats))
+        perror(trace_path);
+    run_stats_free(stats);
+    arena_pool_free(printer_arenas);
+    pattern_free(compiled_pattern);
 }
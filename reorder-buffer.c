@@ -0,0 +1,131 @@
+/*
+A reorder buffer for putting results back into sequence order.
+Results are numbered when their task is created, and each one is stored
+in a ring slot indexed by its number modulo the window size. The consumer
+only ever looks at the slot of the next number, so taking a result costs
+the same however many results arrived early. No more than window tasks
+may be in flight, the producer of the tasks waits in
+reorder_buffer_reserve until the consumer catches up.
+*/
+#include "reorder-buffer.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+/** @brief The reorder buffer structure the user receives */
+typedef struct reorder_buffer {
+    pthread_mutex_t mutex;
+    pthread_cond_t ready; // Signaled when the next result arrives
+    pthread_cond_t space; // Signaled when the consumer takes a result
+    void **slots; // NULL for a result which hasn't arrived
+    size_t window;
+    long next; // The number of the next result to take
+    long total; // The number of results, or -1 until closed
+} reorder_buffer_t;
+
+/**
+ * @brief Dynamically allocates a new reorder buffer. Exits only on
+ * malloc error.
+ *
+ * @param window the number of results which may be in flight
+ * @return reorder_buffer_t* a pointer to the allocated reorder buffer
+ */
+reorder_buffer_t *reorder_buffer_new(size_t window) {
+    reorder_buffer_t *buf;
+    if ((buf = calloc(1, sizeof(reorder_buffer_t))) == NULL ||
+        (buf->slots = calloc(window, sizeof(void *))) == NULL) {
+        perror("malloc failed in reorder-buffer");
+        exit(1);
+    }
+    pthread_mutex_init(&buf->mutex, NULL);
+    pthread_cond_init(&buf->ready, NULL);
+    pthread_cond_init(&buf->space, NULL);
+    buf->window = window;
+    buf->next = 0;
+    buf->total = -1;
+    return buf;
+}
+
+/**
+ * @brief Waits until the result numbered seq fits into the window. The
+ * producer calls it before handing out the task, so that the workers
+ * never get more than a window ahead of the consumer.
+ *
+ * @param buf the reorder buffer supplied from the user
+ * @param seq the number of the task about to be created
+ */
+void reorder_buffer_reserve(reorder_buffer_t *buf, long seq) {
+    pthread_mutex_lock(&buf->mutex);
+    while (seq >= buf->next + (long)buf->window)
+        pthread_cond_wait(&buf->space, &buf->mutex);
+    pthread_mutex_unlock(&buf->mutex);
+}
+
+/**
+ * @brief Stores a result, the slot was reserved by the producer.
+ *
+ * @param buf the reorder buffer supplied from the user
+ * @param seq the number of the result
+ * @param elem the result, must not be NULL
+ */
+void reorder_buffer_put(reorder_buffer_t *buf, long seq, void *elem) {
+    pthread_mutex_lock(&buf->mutex);
+    buf->slots[seq % buf->window] = elem;
+    if (seq == buf->next)
+        pthread_cond_signal(&buf->ready);
+    pthread_mutex_unlock(&buf->mutex);
+}
+
+/**
+ * @brief Takes the next result in sequence order, waiting until it
+ * arrives. Only one thread may take.
+ *
+ * @param buf the reorder buffer supplied from the user
+ * @return the result, or NULL once all results are taken
+ */
+void *reorder_buffer_take(reorder_buffer_t *buf) {
+    void *elem;
+    size_t slot;
+
+    pthread_mutex_lock(&buf->mutex);
+    slot = buf->next % buf->window;
+    while (buf->slots[slot] == NULL && buf->next != buf->total)
+        pthread_cond_wait(&buf->ready, &buf->mutex);
+    elem = buf->slots[slot];
+    if (elem != NULL) {
+        buf->slots[slot] = NULL;
+        buf->next++;
+        pthread_cond_signal(&buf->space);
+    }
+    pthread_mutex_unlock(&buf->mutex);
+    return elem;
+}
+
+/**
+ * @brief Tells the consumer how many results there are, so it stops
+ * after the last one.
+ *
+ * @param buf the reorder buffer supplied from the user
+ * @param total the number of tasks created
+ */
+void reorder_buffer_close(reorder_buffer_t *buf, long total) {
+    pthread_mutex_lock(&buf->mutex);
+    buf->total = total;
+    pthread_cond_signal(&buf->ready);
+    pthread_mutex_unlock(&buf->mutex);
+}
+
+/**
+ * @brief Frees the reorder buffer. The results left in it are not freed.
+ *
+ * @param buf the reorder buffer supplied from the user
+ */
+void reorder_buffer_free(reorder_buffer_t *buf) {
+    pthread_mutex_destroy(&buf->mutex);
+    pthread_cond_destroy(&buf->ready);
+    pthread_cond_destroy(&buf->space);
+    free(buf->slots);
+    free(buf);
+}
@@ -0,0 +1,15 @@
+#ifndef REORDER_BUFFER_INCLUDED
+#define REORDER_BUFFER_INCLUDED
+
+#include <stddef.h>
+
+typedef struct reorder_buffer reorder_buffer_t;
+
+reorder_buffer_t *reorder_buffer_new(size_t window);
+void reorder_buffer_reserve(reorder_buffer_t *buf, long seq);
+void reorder_buffer_put(reorder_buffer_t *buf, long seq, void *elem);
+void *reorder_buffer_take(reorder_buffer_t *buf);
+void reorder_buffer_close(reorder_buffer_t *buf, long total);
+void reorder_buffer_free(reorder_buffer_t *buf);
+
+#endif
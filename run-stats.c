@@ -0,0 +1,339 @@
+/*
+Runtime statistics of the threads of a search, for --stats and --trace.
+Every thread registers itself with a slot, then only ever writes into its
+own slot, so counting needs neither a lock nor an atomic operation: the
+counters and the trace are only read when all the threads are done.
+A span is timed by its start, taken with run_stats_now(), and its end,
+taken when it is recorded. Its time is added to the busy, idle or wait
+time of the thread, and with --trace the span is also saved into a ring of
+the thread, which keeps the last TRACE_EVENTS spans when there are more.
+The rings are written out as Chrome trace-event JSON, loaded as it is by
+chrome://tracing or Perfetto.
+When the statistics are off the caller has a NULL pointer, and every
+function returns at once without even reading the clock.
+*/
+#define _GNU_SOURCE
+#include "run-stats.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#define TRACE_EVENTS (1 << 16) // Spans kept per thread
+#define CACHE_LINE 64
+
+static const char *span_names[RUN_NUM_SPANS] = {
+    "enqueue", "list", "dequeue", "read", "match", "handoff", "print", "idle", "wait"
+};
+// What the argument of a span is, NULL if it has none
+static const char *arg_names[RUN_NUM_SPANS] = {
+    "task", NULL, "task", "bytes", "bytes", "task", "bytes", NULL, "task"
+};
+
+/** @brief A span saved for the trace */
+typedef struct trace_event {
+    uint64_t start; // From the creation of the statistics, in ns
+    uint64_t end;
+    long arg;
+    run_span_t span;
+} trace_event_t;
+
+/** @brief The counters and the trace of one thread */
+typedef struct thread_stats {
+    char *name; // NULL if no thread registered the slot
+    long bytes;
+    long files;
+    long chunks;
+    long matches;
+    uint64_t span_ns[RUN_NUM_SPANS];
+    trace_event_t *events; // A ring of TRACE_EVENTS, with --trace only
+    uint64_t num_events; // All the spans recorded, the ring keeps the last ones
+} __attribute__((aligned(CACHE_LINE))) thread_stats_t;
+
+/** @brief The statistics structure the user receives */
+typedef struct run_stats {
+    thread_stats_t *threads;
+    int num_threads;
+    bool counters; // --stats
+    char *trace_path; // --trace, or NULL
+    uint64_t origin; // The clock when the statistics were created
+    uint64_t traversal_ns;
+    atomic_long queued; // Tasks added but not taken yet
+    atomic_long max_queued;
+    atomic_uint_fast64_t first_output; // 0 until the first write
+} run_stats_t;
+
+static __thread int current = -1; // The slot of the calling thread
+
+static void *xrealloc(void *ptr, size_t size) {
+    if ((ptr = realloc(ptr, size)) == NULL) {
+        perror("malloc failed in run-stats");
+        exit(1);
+    }
+    return ptr;
+}
+
+static uint64_t clock_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * @brief Allocates the statistics of a search. Exits only on malloc error.
+ *
+ * @param num_threads the number of slots, one per thread which may record
+ * @param counters whether the counters are printed by run_stats_finish
+ * @param trace_path the file the trace is written to, or NULL for none
+ * @return run_stats_t* a pointer to the allocated statistics
+ */
+run_stats_t *run_stats_new(int num_threads, bool counters, const char *trace_path) {
+    run_stats_t *stats = xrealloc(NULL, sizeof(run_stats_t));
+    void *threads;
+
+    memset(stats, 0, sizeof(run_stats_t));
+    if (posix_memalign(&threads, CACHE_LINE, num_threads * sizeof(thread_stats_t)) != 0) {
+        perror("malloc failed in run-stats");
+        exit(1);
+    }
+    stats->threads = threads;
+    memset(stats->threads, 0, num_threads * sizeof(thread_stats_t));
+    stats->num_threads = num_threads;
+    stats->counters = counters;
+    if (trace_path != NULL) {
+        stats->trace_path = xrealloc(NULL, strlen(trace_path) + 1);
+        strcpy(stats->trace_path, trace_path);
+    }
+    atomic_init(&stats->queued, 0);
+    atomic_init(&stats->max_queued, 0);
+    atomic_init(&stats->first_output, 0);
+    stats->origin = clock_ns();
+    return stats;
+}
+
+/**
+ * @brief Gives the calling thread a slot, the spans and counts it records
+ * go there. A slot may be taken again by another thread once the former
+ * is done, the two are then shown as one.
+ *
+ * @param stats the statistics, or NULL
+ * @param thread the slot, from 0 to num_threads - 1
+ * @param name the name of the thread in the report and the trace, copied
+ */
+void run_stats_thread(run_stats_t *stats, int thread, const char *name) {
+    thread_stats_t *slot;
+
+    if (stats == NULL)
+        return;
+    current = thread;
+    slot = &stats->threads[thread];
+    if (slot->name == NULL) {
+        slot->name = xrealloc(NULL, strlen(name) + 1);
+        strcpy(slot->name, name);
+    }
+    if (stats->trace_path != NULL && slot->events == NULL)
+        slot->events = xrealloc(NULL, TRACE_EVENTS * sizeof(trace_event_t));
+}
+
+/**
+ * @brief Reads the clock for the start of a span.
+ *
+ * @param stats the statistics, or NULL
+ * @return the time in ns since the statistics were created, 0 if NULL
+ */
+uint64_t run_stats_now(run_stats_t *stats) {
+    return stats == NULL ? 0 : clock_ns() - stats->origin;
+}
+
+/**
+ * @brief Records a span of the calling thread ending now.
+ *
+ * @param stats the statistics, or NULL
+ * @param span what the time was spent on
+ * @param start the start of the span, from run_stats_now
+ * @param arg a number about the span shown by the trace, or -1
+ */
+void run_stats_span(run_stats_t *stats, run_span_t span, uint64_t start, long arg) {
+    thread_stats_t *slot;
+    uint64_t end;
+
+    if (stats == NULL || current == -1)
+        return;
+    slot = &stats->threads[current];
+    end = clock_ns() - stats->origin;
+    slot->span_ns[span] += end - start;
+    if (slot->events != NULL) {
+        trace_event_t *event = &slot->events[slot->num_events++ % TRACE_EVENTS];
+        event->start = start;
+        event->end = end;
+        event->arg = arg;
+        event->span = span;
+    }
+}
+
+/**
+ * @brief Counts the work done by the calling thread.
+ *
+ * @param stats the statistics, or NULL
+ * @param bytes the bytes searched
+ * @param files the files finished
+ * @param chunks the parts of files or blocks of gzip data searched
+ * @param matches the matched lines found
+ */
+void run_stats_count(run_stats_t *stats, long bytes, long files, long chunks, long matches) {
+    thread_stats_t *slot;
+
+    if (stats == NULL || current == -1)
+        return;
+    slot = &stats->threads[current];
+    slot->bytes += bytes;
+    slot->files += files;
+    slot->chunks += chunks;
+    slot->matches += matches;
+}
+
+/**
+ * @brief Counts the tasks added to the queue, or taken with a negative
+ * delta, to find its high-water mark. Any thread may call it.
+ *
+ * @param stats the statistics, or NULL
+ * @param delta the tasks added
+ */
+void run_stats_queue(run_stats_t *stats, long delta) {
+    long queued, max;
+
+    if (stats == NULL)
+        return;
+    queued = atomic_fetch_add(&stats->queued, delta) + delta;
+    max = atomic_load(&stats->max_queued);
+    while (queued > max && !atomic_compare_exchange_weak(&stats->max_queued, &max, queued))
+        ;
+}
+
+/**
+ * @brief Notes that output is written, the first time is kept.
+ *
+ * @param stats the statistics, or NULL
+ */
+void run_stats_output(run_stats_t *stats) {
+    uint_fast64_t none = 0;
+
+    if (stats == NULL || atomic_load(&stats->first_output) != 0)
+        return;
+    atomic_compare_exchange_strong(&stats->first_output, &none, run_stats_now(stats) + 1);
+}
+
+/**
+ * @brief Adds the time of a directory walk ending now.
+ *
+ * @param stats the statistics, or NULL
+ * @param start the start of the walk, from run_stats_now
+ */
+void run_stats_traversal(run_stats_t *stats, uint64_t start) {
+    if (stats != NULL)
+        stats->traversal_ns += run_stats_now(stats) - start;
+}
+
+static double ms(uint64_t ns) {
+    return ns / 1e6;
+}
+
+/**
+ * @brief Prints the counters of every thread and the global ones.
+ */
+static void print_counters(run_stats_t *stats) {
+    uint64_t total = run_stats_now(stats);
+    uint64_t first = atomic_load(&stats->first_output);
+
+    fprintf(stderr, "%-12s %14s %8s %8s %10s %10s %10s %10s\n", "thread", "bytes", "files",
+            "chunks", "matches", "busy ms", "idle ms", "wait ms");
+    for (int i = 0; i < stats->num_threads; i++) {
+        thread_stats_t *slot = &stats->threads[i];
+        uint64_t busy = 0;
+        if (slot->name == NULL)
+            continue;
+        for (int span = 0; span < RUN_NUM_SPANS; span++) {
+            if (span != RUN_IDLE && span != RUN_WAIT && span != RUN_HANDOFF)
+                busy += slot->span_ns[span];
+        }
+        fprintf(stderr, "%-12s %14ld %8ld %8ld %10ld %10.2f %10.2f %10.2f\n", slot->name,
+                slot->bytes, slot->files, slot->chunks, slot->matches, ms(busy),
+                ms(slot->span_ns[RUN_IDLE]), ms(slot->span_ns[RUN_WAIT] + slot->span_ns[RUN_HANDOFF]));
+    }
+    fprintf(stderr, "traversal %.2f ms, queue high-water %ld tasks, ", ms(stats->traversal_ns),
+            atomic_load(&stats->max_queued));
+    if (first == 0)
+        fprintf(stderr, "no output, ");
+    else
+        fprintf(stderr, "first output after %.2f ms, ", ms(first - 1));
+    fprintf(stderr, "total %.2f ms\n", ms(total));
+}
+
+/**
+ * @brief Writes the rings of all the threads as Chrome trace-event JSON,
+ * each span a complete event in microseconds.
+ */
+static bool write_trace(run_stats_t *stats) {
+    FILE *fp = fopen(stats->trace_path, "w");
+    const char *sep = "";
+
+    if (fp == NULL)
+        return false;
+    fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for (int i = 0; i < stats->num_threads; i++) {
+        thread_stats_t *slot = &stats->threads[i];
+        uint64_t first = slot->num_events > TRACE_EVENTS ? slot->num_events - TRACE_EVENTS : 0;
+        if (slot->name == NULL)
+            continue;
+        fprintf(fp, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                "\"args\":{\"name\":\"%s\"}}", sep, i, slot->name);
+        sep = ",";
+        if (first > 0)
+            fprintf(stderr, "%s: the first %lu spans of %s were dropped\n", stats->trace_path,
+                    (unsigned long)first, slot->name);
+        for (uint64_t j = first; j < slot->num_events; j++) {
+            trace_event_t *event = &slot->events[j % TRACE_EVENTS];
+            fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                    span_names[event->span], i, event->start / 1e3, (event->end - event->start) / 1e3);
+            if (arg_names[event->span] != NULL && event->arg >= 0)
+                fprintf(fp, ",\"args\":{\"%s\":%ld}", arg_names[event->span], event->arg);
+            fputc('}', fp);
+        }
+    }
+    fprintf(fp, "\n]}\n");
+    return fclose(fp) == 0;
+}
+
+/**
+ * @brief Prints the counters on stderr with --stats, and writes the trace
+ * with --trace. All the threads recording must be done.
+ *
+ * @param stats the statistics, or NULL
+ * @return false if the trace couldn't be written, errno tells why
+ */
+bool run_stats_finish(run_stats_t *stats) {
+    if (stats == NULL)
+        return true;
+    if (stats->counters)
+        print_counters(stats);
+    return stats->trace_path == NULL || write_trace(stats);
+}
+
+/**
+ * @brief Frees the statistics.
+ *
+ * @param stats the statistics, or NULL
+ */
+void run_stats_free(run_stats_t *stats) {
+    if (stats == NULL)
+        return;
+    for (int i = 0; i < stats->num_threads; i++) {
+        free(stats->threads[i].name);
+        free(stats->threads[i].events);
+    }
+    free(stats->threads);
+    free(stats->trace_path);
+    free(stats);
+}
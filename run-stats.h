@@ -0,0 +1,34 @@
+#ifndef RUN_STATS_INCLUDED
+#define RUN_STATS_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct run_stats run_stats_t;
+
+/* What a thread spends a span of time on */
+typedef enum run_span {
+    RUN_ENQUEUE, // adding a file found by the walk to the tasks
+    RUN_LIST, // listing a directory
+    RUN_DEQUEUE, // taking a task
+    RUN_READ, // opening and reading or mapping a file
+    RUN_MATCH, // searching the contents
+    RUN_HANDOFF, // handing an output to the printing thread
+    RUN_PRINT, // writing out
+    RUN_IDLE, // no task to do
+    RUN_WAIT, // waiting for another thread, on a lock or for room
+    RUN_NUM_SPANS
+} run_span_t;
+
+run_stats_t *run_stats_new(int num_threads, bool counters, const char *trace_path);
+void run_stats_thread(run_stats_t *stats, int thread, const char *name);
+uint64_t run_stats_now(run_stats_t *stats);
+void run_stats_span(run_stats_t *stats, run_span_t span, uint64_t start, long arg);
+void run_stats_count(run_stats_t *stats, long bytes, long files, long chunks, long matches);
+void run_stats_queue(run_stats_t *stats, long delta);
+void run_stats_output(run_stats_t *stats);
+void run_stats_traversal(run_stats_t *stats, uint64_t start);
+bool run_stats_finish(run_stats_t *stats);
+void run_stats_free(run_stats_t *stats);
+
+#endif
@@ -1,31 +1,35 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <ftw.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <string.h>
-#include <regex.h>
+#include "pattern.h"
+#include "dir-walk.h"
 
 
-#define MAX_FILE_NUM 4096
-#define BUF_SIZE 4096
-
 // GLOBALS
 bool recursive = false;
+bool print_file_names = false; // -r or several files, the lines begin with the name
 bool print_line_numbers = false;
-char *pattern = NULL;
+char **patterns = NULL; // from -e, -f or the first argument
+int num_patterns = 0;
+bool patterns_from_options = false;
+pattern_t *compiled_pattern = NULL; // compiled once in main
 char *usage = "Usage:\n"
-              "./grep [-rh]\n"
+              "./grep [-rhn] [-e pattern]... [-f file] [pattern] [file]...\n"
               "-h     Show help message\n"
-              "-r     Recursively search through directory structure\n"
-              "-n     Include line numbers\n";
+              "-r     Recursively search through the directories, the files\n"
+              "       given are searched too\n"
+              "-n     Include line numbers\n"
+              "-e     Search for this pattern, may be given many times\n"
+              "-f     Search for the patterns in this file, one per line\n";
 
-char *parse_args(int argc, char **argv) {
+char **parse_args(int argc, char **argv, int *num_paths) {
     int opt;
 
-    while ((opt = getopt(argc, argv, "rn")) != -1) {
+    while ((opt = getopt(argc, argv, "rhne:f:")) != -1) {
         switch (opt) {
             case 'r':
                 recursive = true;
@@ -39,102 +43,111 @@ char *parse_args(int argc, char **argv) {
                 print_line_numbers = true;
                 break;
 
+            case 'e':
+                patterns = pattern_list_add(patterns, &num_patterns, optarg);
+                patterns_from_options = true;
+                break;
+
+            case 'f':
+                patterns = pattern_list_read_file(patterns, &num_patterns, optarg);
+                patterns_from_options = true;
+                break;
+
             case '?':
                 printf("Error parsing command line arguments\n%s", usage);
                 exit(1);
         }
     }
 
-    // If there are not two arguments left (pattern and file name)
-    if (argc - optind != 2) {
+    // The pattern is the first argument left unless -e or -f is used
+    if (!patterns_from_options && optind < argc)
+        patterns = pattern_list_add(patterns, &num_patterns, argv[optind++]);
+
+    // If there is no argument left (file names)
+    if (argc - optind < 1) {
         fprintf(stderr, "Missing either pattern or file name in parsing command line arguments\n%s", usage);
         exit(1);
     }
 
-    pattern = argv[optind];
-    return argv[optind + 1];
+    *num_paths = argc - optind;
+    return argv + optind;
 }
 
 void grep_file(const char *file_name) {
     FILE *file;
-    char buf[BUF_SIZE]; 
-    char error_msg[100];   
-    int regex_errorno; // value returned from regex library functions, zero indicates success
-    regex_t regex; // tmp variable to conduct regex operations
-    const char *file_display_name = file_name + 2; // Remove proceeding "./" in directory string
-
-    if (regcomp(&regex, pattern, 0)) {
-        fprintf(stderr, "Regex compile failed\n");
-        exit(1);
-    }
+    char *buf = NULL;
+    size_t buf_size = 0;
+    ssize_t read;
+
     if ((file = fopen(file_name, "r")) == NULL) {
         perror("Error Opening File");        
         return;
     }
 
     int line_number = 1;    
-    while (fgets(buf, BUF_SIZE, file)) {
-        regex_errorno = regexec(&regex, buf, 0, NULL, 0);
-        if (!regex_errorno) {
-            if (recursive) {
+    while ((read = getline(&buf, &buf_size, file)) != -1) {
+        // '$' has to match right before the '\n'
+        if (read > 0 && buf[read - 1] == '\n')
+            buf[--read] = '\0';
+        if (pattern_match_line(compiled_pattern, buf, read)) {
+            if (print_file_names) {
                 if (print_line_numbers)
-                    printf("%s:%d:%s\n", file_display_name, line_number, buf);
+                    printf("%s:%d:%s\n", file_name, line_number, buf);
                 else 
-                    printf("%s:%s\n", file_display_name, buf);
+                    printf("%s:%s\n", file_name, buf);
             } else {
                 if (print_line_numbers)
                     printf("%d:%s\n", line_number, buf);
                 else
                     printf("%s\n", buf);
             }
-        } else if (regex_errorno == REG_NOMATCH) {
-            continue;
-        } else {
-            regerror(regex_errorno, &regex, error_msg, sizeof(error_msg));
-            fprintf(stderr, "match failed: %s\n", error_msg);
-            exit(1);
         }
         line_number++;
     }
-}
-
-int grep_file_wrapper(const char *filename, const struct stat *statptr,
-    int fileflags, struct FTW *pfwt) 
-{
-    if (fileflags == FTW_F)
-        grep_file(filename);
-
-    return 0; // Tells nftw to continue
+    free(buf);
+    fclose(file);
 }
 
 void grep_dir(char *path) {
-    /* Iterates over the directory structure starting at path and
-    calls grep_file_wrapper on each file */
-    nftw(path, grep_file_wrapper, MAX_FILE_NUM, 0);
+    /* Iterates over the directory structure starting at path in the
+    order of nftw() and calls grep_file on each file */
+    dir_walk_t *walk = dir_walk_new(path, true, NULL, NULL);
+    const char *file_name;
+    while ((file_name = dir_walk_next(walk)) != NULL)
+        grep_file(file_name);
+    dir_walk_free(walk);
 }
 
 int main(int argc, char *argv[]) {
     struct stat sb;
+    int num_paths;
 
-    char *file_name = parse_args(argc, argv);
+    char **paths = parse_args(argc, argv, &num_paths);
+    compiled_pattern = pattern_compile_set(patterns, num_patterns);
 
-    if (stat(file_name, &sb) == -1) {
-        perror("stat");
-        exit(1);
-    }
+    for (int i = 0; i < num_paths; i++) {
+        if (stat(paths[i], &sb) == -1) {
+            perror(paths[i]);
+            exit(1);
+        }
 
-    if (recursive && S_ISREG(sb.st_mode)) {
-        fprintf(stderr, "%s is not a directory\n%s", file_name, usage);
-        exit(1);
+        // With -r the files given are searched as well, like grep does
+        if (!recursive && S_ISDIR(sb.st_mode)) {
+            fprintf(stderr, "%s is not a file\n%s", paths[i], usage);
+            exit(1);
+        }
     }
 
-    if (!recursive && S_ISDIR(sb.st_mode)) {
-        fprintf(stderr, "%s is not a file\n%s", file_name, usage);
-        exit(1);
+    // sb is the last path, a single file is printed without its name
+    print_file_names = num_paths > 1 || S_ISDIR(sb.st_mode);
+
+    // In the order of the arguments
+    for (int i = 0; i < num_paths; i++) {
+        if (recursive && stat(paths[i], &sb) == 0 && S_ISDIR(sb.st_mode))
+            grep_dir(paths[i]);
+        else
+            grep_file(paths[i]);
     }
 
-    if (!recursive)
-        grep_file(file_name);
-    else
-        grep_dir(file_name);
+    pattern_free(compiled_pattern);
 }
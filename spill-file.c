@@ -0,0 +1,138 @@
+/*
+A temporary file for results which don't fit into memory.
+Any thread may write a result: it takes the next range of the file with
+an atomic add and writes it there with pwrite(), so the writers never
+wait for each other. The file is made at the first write, in $TMPDIR or
+/tmp, and unlinked at once, so it is gone however the process ends.
+A range is read back only once, and its blocks are given back to the
+file system right after with a hole, so the file never takes more disk
+than the results which are still in it.
+*/
+#define _GNU_SOURCE // For fallocate()
+#include "spill-file.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/** @brief The spill file structure the user receives */
+typedef struct spill_file {
+    pthread_mutex_t mutex; // Held to make the file
+    atomic_int fd; // -1 until the first write
+    bool failed; // The file couldn't be made, it isn't tried again
+    atomic_llong end; // The offset of the next write
+} spill_file_t;
+
+/**
+ * @brief Allocates a spill file, the file itself is made at the first
+ * write. Exits only on malloc error.
+ *
+ * @return spill_file_t* a pointer to the allocated spill file
+ */
+spill_file_t *spill_file_new(void) {
+    spill_file_t *spill;
+    if ((spill = malloc(sizeof(spill_file_t))) == NULL) {
+        perror("malloc failed in spill-file");
+        exit(1);
+    }
+    pthread_mutex_init(&spill->mutex, NULL);
+    atomic_init(&spill->fd, -1);
+    spill->failed = false;
+    atomic_init(&spill->end, 0);
+    return spill;
+}
+
+/**
+ * @brief Makes the unlinked file once, the threads writing meanwhile wait.
+ */
+static int open_file(spill_file_t *spill) {
+    int fd = atomic_load(&spill->fd);
+    if (fd != -1)
+        return fd;
+
+    pthread_mutex_lock(&spill->mutex);
+    if ((fd = atomic_load(&spill->fd)) == -1 && !spill->failed) {
+        const char *dir = getenv("TMPDIR");
+        char *path;
+        if (dir == NULL || *dir == '\0')
+            dir = "/tmp";
+        if ((path = malloc(strlen(dir) + sizeof("/pgrep-spill-XXXXXX"))) == NULL) {
+            perror("malloc failed in spill-file");
+            exit(1);
+        }
+        sprintf(path, "%s/pgrep-spill-XXXXXX", dir);
+        if ((fd = mkstemp(path)) != -1)
+            unlink(path);
+        else
+            spill->failed = true;
+        free(path);
+        atomic_store(&spill->fd, fd);
+    }
+    pthread_mutex_unlock(&spill->mutex);
+    return fd;
+}
+
+/**
+ * @brief Writes a result at the end of the file. May be called from any
+ * thread.
+ *
+ * @param spill the spill file supplied from the user
+ * @param buf the result
+ * @param len the length of the result
+ * @param offset where the result was written, for spill_file_read
+ * @return false if the file couldn't be made or written, errno tells why,
+ * the result is then still the caller's to keep
+ */
+bool spill_file_write(spill_file_t *spill, const char *buf, size_t len, off_t *offset) {
+    int fd = open_file(spill);
+    ssize_t written;
+
+    if (fd == -1)
+        return false;
+    *offset = atomic_fetch_add(&spill->end, len);
+    for (size_t done = 0; done < len; done += written) {
+        if ((written = pwrite(fd, buf + done, len - done, *offset + done)) <= 0)
+            return false; // The range stays a hole, nobody reads it
+    }
+    return true;
+}
+
+/**
+ * @brief Reads a result back, and frees its blocks on the disk. Each
+ * result may be read only once.
+ *
+ * @param spill the spill file supplied from the user
+ * @param offset where the result was written
+ * @param buf where the result is read to
+ * @param len the length of the result
+ * @return false if the file couldn't be read, errno tells why
+ */
+bool spill_file_read(spill_file_t *spill, off_t offset, char *buf, size_t len) {
+    int fd = atomic_load(&spill->fd);
+    ssize_t got;
+
+    for (size_t done = 0; done < len; done += got) {
+        if ((got = pread(fd, buf + done, len - done, offset + done)) <= 0)
+            return false;
+    }
+    // Not every file system has holes, the blocks then stay until the end
+    fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len);
+    return true;
+}
+
+/**
+ * @brief Frees the spill file, and so the file on the disk.
+ *
+ * @param spill the spill file supplied from the user
+ */
+void spill_file_free(spill_file_t *spill) {
+    int fd = atomic_load(&spill->fd);
+    if (fd != -1)
+        close(fd);
+    pthread_mutex_destroy(&spill->mutex);
+    free(spill);
+}
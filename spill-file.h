@@ -0,0 +1,15 @@
+#ifndef SPILL_FILE_INCLUDED
+#define SPILL_FILE_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+typedef struct spill_file spill_file_t;
+
+spill_file_t *spill_file_new(void);
+bool spill_file_write(spill_file_t *spill, const char *buf, size_t len, off_t *offset);
+bool spill_file_read(spill_file_t *spill, off_t offset, char *buf, size_t len);
+void spill_file_free(spill_file_t *spill);
+
+#endif
@@ -0,0 +1,136 @@
+/*
+Output of matched lines straight from the mapping of a file into a pipe.
+Instead of copying the lines into a buffer, the search saves the ranges
+of the file they take, a line with its '\n', and the ranges of lines
+next to each other are merged into one. vmsplice() then hands the pages
+of the mapping to the pipe by reference, so the lines are never copied
+by the process, and the reader of the pipe gets them from the page
+cache. The mapping must be read-only and stay mapped until the ranges are
+written, unmapping it afterwards is safe since the pipe holds its own
+references to the pages.
+Where vmsplice() isn't allowed the same ranges are written with writev(),
+still without copying them into a buffer first.
+*/
+#define _GNU_SOURCE // For vmsplice()
+#include "splice-output.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#define BATCH_SIZE 1024 // Ranges given to the kernel at once, at most IOV_MAX
+
+/** @brief A part of the mapping to write out */
+typedef struct output_range {
+    size_t offset;
+    size_t len;
+} output_range_t;
+
+static const char newline = '\n'; // For a last line without one
+
+/**
+ * @brief Tells whether the output goes into a pipe, the only kind of file
+ * vmsplice() writes to.
+ *
+ * @param fd the output
+ * @return true if fd is a pipe
+ */
+bool splice_output_usable(int fd) {
+    struct stat sb;
+    return fstat(fd, &sb) == 0 && S_ISFIFO(sb.st_mode);
+}
+
+/**
+ * @brief Saves the range of a matched line, merged into the range before
+ * it if the two touch.
+ *
+ * @param ranges where the ranges of a file are saved
+ * @param offset the offset of the line in the mapping
+ * @param len the length of the line with its '\n', which may be one byte
+ * past the end of the mapping for a last line without '\n'
+ */
+void splice_output_add(arena_t *ranges, size_t offset, size_t len) {
+    size_t num = arena_len(ranges) / sizeof(output_range_t);
+
+    if (num > 0) {
+        output_range_t *last = (output_range_t *)arena_data(ranges) + num - 1;
+        if (last->offset + last->len == offset) {
+            last->len += len;
+            return;
+        }
+    }
+    output_range_t range = { offset, len };
+    arena_append(ranges, (const char *)&range, sizeof(range));
+}
+
+/**
+ * @brief Writes the whole of iov, with vmsplice() while it is allowed.
+ */
+static bool write_batch(int fd, struct iovec *iov, int num, bool *splice) {
+    ssize_t ret;
+
+    while (num > 0) {
+        ret = *splice ? vmsplice(fd, iov, num, 0) : writev(fd, iov, num);
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+            if (*splice && (errno == EINVAL || errno == ENOSYS || errno == EPERM)) {
+                *splice = false;
+                continue;
+            }
+            return false;
+        }
+        // Skip what has been written, both may stop in the middle
+        while (num > 0 && (size_t)ret >= iov->iov_len) {
+            ret -= iov->iov_len;
+            iov++;
+            num--;
+        }
+        if (num > 0) {
+            iov->iov_base = (char *)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Writes the lines of the ranges out of the mapping, in order, and
+ * empties the ranges.
+ *
+ * @param fd the output, a pipe for vmsplice()
+ * @param map the mapping the ranges are in
+ * @param size the size of the mapping
+ * @param ranges the ranges saved by splice_output_add
+ * @return the bytes written, or -1 on a write error, errno tells why
+ */
+ssize_t splice_output_write(int fd, const char *map, size_t size, arena_t *ranges) {
+    const output_range_t *range = (const output_range_t *)arena_data(ranges);
+    size_t num = arena_len(ranges) / sizeof(output_range_t);
+    struct iovec iov[BATCH_SIZE + 1];
+    bool splice = true;
+    bool ok = true;
+    ssize_t total = 0;
+    int batch = 0;
+
+    for (size_t i = 0; i < num && ok; i++) {
+        size_t len = range[i].len;
+        // The '\n' missing at the end of the file comes from elsewhere
+        bool missing = range[i].offset + len > size;
+        iov[batch].iov_base = (char *)map + range[i].offset;
+        iov[batch++].iov_len = missing ? len - 1 : len;
+        total += len;
+        if (missing) {
+            iov[batch].iov_base = (char *)&newline;
+            iov[batch++].iov_len = 1;
+        }
+        if (batch >= BATCH_SIZE || i == num - 1) {
+            ok = write_batch(fd, iov, batch, &splice);
+            batch = 0;
+        }
+    }
+    arena_truncate(ranges, 0);
+    return ok ? total : -1;
+}
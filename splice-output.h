@@ -0,0 +1,14 @@
+#ifndef SPLICE_OUTPUT_INCLUDED
+#define SPLICE_OUTPUT_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "arena.h"
+
+bool splice_output_usable(int fd);
+void splice_output_add(arena_t *ranges, size_t offset, size_t len);
+ssize_t splice_output_write(int fd, const char *map, size_t size, arena_t *ranges);
+
+#endif
@@ -0,0 +1,199 @@
+/*
+Checks of aho-corasick.c, and of the pattern sets of pattern.c which use
+it, on a fixed corpus.
+Every occurrence reported by aho_corasick_scan must be one found by
+comparing every pattern at every position, and none may be missed;
+aho_corasick_search must stop at the occurrence which ends first. A set
+of patterns, as given with -e and -f, must match the lines which any of
+its expressions matches with regexec.
+*/
+#define _GNU_SOURCE
+#include "aho-corasick.h"
+#include "pattern.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <regex.h>
+
+#define NUM_LINES 2000
+#define MAX_LINE 40
+#define SEARCH_EVERY 20 // aho_corasick_search is checked from every so many lines
+
+/* Overlapping literals, prefixes and suffixes of each other, the same
+ * literal twice, an empty one which is ignored and bytes above 127 */
+static const char *literals[] = {
+    "he", "she", "his", "hers", "a", "ab", "abc", "bc", "c", "ab", "",
+    "\xff\xfe", "e\xff", "xyzzy", "zz", "hehe",
+};
+
+/* Sets of expressions: all with a literal (the Aho-Corasick prefilter),
+ * one without (every line is checked) and one with a back reference */
+static const char *sets[][5] = {
+    {"she", "hers", NULL},
+    {"ab", "abc", "c", NULL},
+    {"he", "h.s", "x*yz", NULL},
+    {"a\\{2\\}", "[hs]e", "^c", "bc$", NULL},
+    {"abc", "x*", NULL},
+    {"hers", "a*", "z\\|b", NULL},
+    {"\\(ab\\)\\1", "she", NULL},
+    {"zzz", "\\(h\\|s\\)e\\{2,\\}", NULL},
+};
+
+static char *lines[NUM_LINES];
+static size_t lens[NUM_LINES];
+static int failures = 0;
+
+/**
+ * @brief Fills the corpus with pseudo-random lines, from the same seed
+ * every time, made of the characters of the literals.
+ */
+static void make_corpus(void) {
+    static const char chars[] = "abcehirsxyz \xff\xfe";
+    unsigned long seed = 7;
+
+    for (int i = 0; i < NUM_LINES; i++) {
+        seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+        size_t len = (seed >> 33) % MAX_LINE;
+        lines[i] = malloc(len + 1);
+        for (size_t j = 0; j < len; j++) {
+            seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+            lines[i][j] = chars[(seed >> 33) % (sizeof(chars) - 1)];
+        }
+        lines[i][len] = '\0';
+        lens[i] = len;
+    }
+}
+
+/** @brief The occurrences reported by the scan, by pattern and start */
+typedef struct {
+    int *count;
+    size_t len;
+    const char *buf;
+} occurrences_t;
+
+static bool save_occurrence(int pattern_id, const char *start, void *arg) {
+    occurrences_t *occ = arg;
+    occ->count[pattern_id * occ->len + (start - occ->buf)]++;
+    return true;
+}
+
+/**
+ * @brief Checks the automaton of all the literals on the whole corpus.
+ */
+static void check_automaton(const char *buf, size_t len) {
+    int num = sizeof(literals) / sizeof(literals[0]);
+    size_t lit_lens[num];
+    occurrences_t occ = {calloc(num * len, sizeof(int)), len, buf};
+
+    for (int i = 0; i < num; i++)
+        lit_lens[i] = strlen(literals[i]);
+    aho_corasick_t *ac = aho_corasick_build(literals, lit_lens, num);
+
+    aho_corasick_scan(ac, buf, len, save_occurrence, &occ);
+    for (int i = 0; i < num; i++) {
+        for (size_t pos = 0; pos < len; pos++) {
+            int expected = lit_lens[i] > 0 && pos + lit_lens[i] <= len &&
+                           memcmp(buf + pos, literals[i], lit_lens[i]) == 0;
+            if (occ.count[i * len + pos] != expected) {
+                fprintf(stderr, "aho_corasick_scan: literal %d '%s' at %zu reported %d times, "
+                        "expected %d\n", i, literals[i], pos, occ.count[i * len + pos], expected);
+                failures++;
+            }
+        }
+    }
+
+    for (size_t from = 0, line = 0; from < len; line++) {
+        if (line % SEARCH_EVERY == 0) {
+            // The first occurrence to end after from, of any literal
+            size_t first_end = len + 1;
+            for (int i = 0; i < num; i++) {
+                const char *hit = lit_lens[i] == 0 ? NULL :
+                                  memmem(buf + from, len - from, literals[i], lit_lens[i]);
+                if (hit != NULL && (size_t)(hit - buf) + lit_lens[i] < first_end)
+                    first_end = hit - buf + lit_lens[i];
+            }
+            int id = -1;
+            const char *hit = aho_corasick_search(ac, buf + from, len - from, &id);
+            if (hit == NULL ? first_end != len + 1 :
+                id < 0 || id >= num || (size_t)(hit - buf) + lit_lens[id] != first_end ||
+                memcmp(hit, literals[id], lit_lens[id]) != 0) {
+                fprintf(stderr, "aho_corasick_search: wrong occurrence from offset %zu\n", from);
+                failures++;
+            }
+        }
+        const char *eol = memchr(buf + from, '\n', len - from);
+        from = eol == NULL ? len : (size_t)(eol - buf) + 1;
+    }
+
+    aho_corasick_free(ac);
+    free(occ.count);
+}
+
+static bool save_line(const char *line, size_t len, long line_number, void *arg) {
+    bool *found = arg;
+    if (line_number >= 1 && line_number <= NUM_LINES)
+        found[line_number - 1] = true;
+    return true;
+}
+
+/**
+ * @brief Checks a set of expressions against regexec, line by line and
+ * with pattern_search over the whole corpus.
+ */
+static void check_set(const char **srcs, const char *buf, size_t len) {
+    regex_t regex[5];
+    bool found[NUM_LINES] = {false};
+    int num = 0;
+
+    while (srcs[num] != NULL) {
+        if (regcomp(&regex[num], srcs[num], REG_NOSUB) != 0) {
+            fprintf(stderr, "set: '%s' is not a valid expression\n", srcs[num]);
+            exit(1);
+        }
+        num++;
+    }
+    pattern_t *pat = pattern_compile_set((char **)srcs, num);
+    pattern_search(pat, buf, len, true, save_line, found);
+
+    for (int i = 0; i < NUM_LINES; i++) {
+        bool expected = false;
+        for (int j = 0; j < num && !expected; j++)
+            expected = regexec(&regex[j], lines[i], 0, NULL, 0) == 0;
+        if (pattern_match_line(pat, lines[i], lens[i]) != expected ||
+            found[i] != expected) {
+            fprintf(stderr, "set '%s', ...: differs from regexec on line %d '%s'\n",
+                    srcs[0], i + 1, lines[i]);
+            failures++;
+        }
+    }
+
+    pattern_free(pat);
+    for (int j = 0; j < num; j++)
+        regfree(&regex[j]);
+}
+
+int main(void) {
+    size_t len = 0;
+    char *buf;
+
+    make_corpus();
+    for (int i = 0; i < NUM_LINES; i++)
+        len += lens[i] + 1;
+    buf = malloc(len);
+    for (size_t i = 0, pos = 0; i < NUM_LINES; i++) {
+        memcpy(buf + pos, lines[i], lens[i]);
+        pos += lens[i];
+        buf[pos++] = '\n';
+    }
+
+    check_automaton(buf, len);
+    for (size_t i = 0; i < sizeof(sets) / sizeof(sets[0]); i++)
+        check_set(sets[i], buf, len);
+
+    free(buf);
+    for (int i = 0; i < NUM_LINES; i++)
+        free(lines[i]);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,173 @@
+/*
+Checks of gzip-reader.c on gzip data made here with zlib.
+The data is several members, as from cat a.gz b.gz, cut at any byte so
+that lines run from one member into the next, of a few MB compressed, so
+the members start in different units of 1MB and some units have none
+starting in them. One member is stored without compression and holds
+a whole gzip member right after the start of a unit, which the unit
+inflates fine from the wrong place, and one line is longer than a block.
+With any number of threads the reader must hand out the data exactly,
+in pieces of whole lines, and a truncated copy must fail after giving a
+part of it.
+*/
+#include "gzip-reader.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <zlib.h>
+
+#define DATA_SIZE (12 * 1024 * 1024)
+#define UNIT (1024 * 1024) // The compressed bytes of a unit of the reader
+#define STORED_BLOCK 65535 // The most a stored deflate block holds
+#define MAX_LINE 3000
+#define LONG_LINE (3 * 1024 * 1024 / 2) // Longer than a block of the reader
+#define STORED_MEMBER 3 // This member is stored, with a gzip member inside
+
+static int failures = 0;
+
+/**
+ * @brief Fills the data with lines of pseudo-random text, from the same
+ * seed every time, which deflate can't shrink much. The last line has no
+ * '\n'.
+ */
+static char *make_data(size_t len) {
+    static const char chars[] =
+        "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789 .";
+    unsigned long seed = 3;
+    char *data = malloc(len);
+    size_t pos = 0;
+    bool long_line = false;
+
+    while (pos < len) {
+        seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+        size_t line = (seed >> 33) % MAX_LINE;
+        if (pos >= len / 3 && !long_line) {
+            line = LONG_LINE;
+            long_line = true;
+        }
+        for (size_t i = 0; i < line && pos < len; i++) {
+            seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+            data[pos++] = chars[(seed >> 33) % (sizeof(chars) - 1)];
+        }
+        if (pos < len - 1)
+            data[pos++] = '\n';
+    }
+    data[len - 1] = 'x';
+    return data;
+}
+
+/**
+ * @brief Appends one gzip member of data to out.
+ */
+static size_t deflate_member(const char *data, size_t len, int level, char *out, size_t room) {
+    z_stream strm;
+
+    memset(&strm, 0, sizeof(strm));
+    if (deflateInit2(&strm, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        fprintf(stderr, "deflateInit2 failed\n");
+        exit(1);
+    }
+    strm.next_in = (unsigned char *)data;
+    strm.avail_in = len;
+    strm.next_out = (unsigned char *)out;
+    strm.avail_out = room;
+    if (deflate(&strm, Z_FINISH) != Z_STREAM_END) {
+        fprintf(stderr, "deflate failed\n");
+        exit(1);
+    }
+    deflateEnd(&strm);
+    return room - strm.avail_out;
+}
+
+/**
+ * @brief Reads gz with num_threads and compares what comes out with data.
+ *
+ * @param truncated whether gz is cut short, then the reader must fail
+ * after giving a part of data
+ */
+static void check_reader(const char *name, const char *gz, size_t gz_len, const char *data,
+                         size_t len, int num_threads, bool truncated) {
+    gzip_reader_t *reader = gzip_reader_new(gz, gz_len, num_threads);
+    const char *lines;
+    size_t lines_len, pos = 0;
+    bool ok = true, cut = false;
+
+    while (ok && (lines = gzip_reader_next(reader, &lines_len)) != NULL) {
+        // Only the last piece may end without '\n', the last line of the
+        // data or what was inflated of a line before an error
+        if (cut) {
+            fprintf(stderr, "%s, %d threads: a line is cut at %zu\n", name, num_threads, pos);
+            ok = false;
+        }
+        if (pos + lines_len > len || memcmp(lines, data + pos, lines_len) != 0) {
+            fprintf(stderr, "%s, %d threads: wrong data at %zu\n", name, num_threads, pos);
+            ok = false;
+        }
+        pos += lines_len;
+        cut = lines_len > 0 && lines[lines_len - 1] != '\n';
+    }
+    if (ok && truncated != gzip_reader_failed(reader)) {
+        fprintf(stderr, "%s, %d threads: %s\n", name, num_threads,
+                truncated ? "no error on truncated data" : "an error on valid data");
+        ok = false;
+    }
+    if (ok && !truncated && pos != len) {
+        fprintf(stderr, "%s, %d threads: %zu bytes out of %zu\n", name, num_threads, pos, len);
+        ok = false;
+    }
+    if (!ok)
+        failures++;
+    gzip_reader_free(reader);
+}
+
+int main(void) {
+    // Where the members of the data begin, any byte, even inside a line
+    static const size_t cuts[] = {
+        0, 700000, 2500000, 2501000, 3100000, 6000001, 6000002, 9876543,
+    };
+    int num_members = sizeof(cuts) / sizeof(cuts[0]);
+    size_t len = DATA_SIZE, room = DATA_SIZE + DATA_SIZE / 8 + 64 * num_members;
+    char *data = make_data(len);
+    char *gz = malloc(room);
+    size_t gz_len = 0;
+    char fake[64];
+    size_t fake_len = deflate_member("a member inside a member\n", 25, 6, fake, sizeof(fake));
+
+    for (int i = 0; i < num_members; i++) {
+        size_t end = i + 1 < num_members ? cuts[i + 1] : len;
+        if (i == STORED_MEMBER) {
+            // A stored member is a header of 10 bytes, then blocks of a
+            // header of 5 bytes and the data, put the fake member right
+            // after the first unit which begins in it
+            size_t unit = (gz_len + 10 + UNIT - 1) / UNIT * UNIT;
+            size_t at = 0;
+            while (gz_len + 10 + 5 * (at / STORED_BLOCK + 1) + at < unit + 16)
+                at++;
+            if (cuts[i] + at + fake_len > end) {
+                fprintf(stderr, "no unit begins in the stored member\n");
+                exit(1);
+            }
+            memcpy(data + cuts[i] + at, fake, fake_len);
+        }
+        gz_len += deflate_member(data + cuts[i], end - cuts[i], i == STORED_MEMBER ? 0 : 6,
+                                 gz + gz_len, room - gz_len);
+    }
+    if (gz_len < 4 * 1024 * 1024)
+        fprintf(stderr, "warning: only %zu bytes compressed, fewer units than meant\n", gz_len);
+
+    for (int threads = 1; threads <= 4; threads *= 2) {
+        check_reader("members", gz, gz_len, data, len, threads, false);
+        check_reader("truncated members", gz, gz_len - 5000, data, len, threads, true);
+    }
+
+    // A single member, inflated by one thread whatever the threads
+    gz_len = deflate_member(data, len, 6, gz, room);
+    check_reader("single member", gz, gz_len, data, len, 4, false);
+    check_reader("truncated single member", gz, gz_len / 2, data, len, 4, true);
+
+    free(gz);
+    free(data);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,228 @@
+/*
+Checks of lock-free-queue.c and of work-stealing-pool.c built on it.
+The queue: a single thread must get the elements back in order, across
+the overflow list of a full ring, and several producers and consumers
+on a tiny ring, so that it overflows all the time, must drain every
+element exactly once. The pool: producers push many more tasks than the
+deques hold, the workers push more tasks while they run, like the parts
+of a split file, and every task must be run exactly once, with no worker
+stopping while a task is still queued or running.
+*/
+#include "lock-free-queue.h"
+#include "work-stealing-pool.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define RING 8 // Elements in the ring of the checked queues
+#define PRODUCERS 4
+#define CONSUMERS 4
+#define PER_PRODUCER 50000
+#define WORKERS 4
+#define TASKS (PRODUCERS * 5000) // Pushed from outside the pool
+#define SPLIT_EVERY 10 // Every so many tasks push CHILDREN more
+#define CHILDREN 3
+#define SPLIT_DELAY_US 20
+#define MAX_TASKS (TASKS + TASKS / SPLIT_EVERY * CHILDREN + CHILDREN)
+
+static int failures = 0;
+
+/* ===================== The queue ===================== */
+
+/**
+ * @brief A single thread gets the elements in order while the ring
+ * overflows and drains in between.
+ */
+static void check_order(void) {
+    lf_queue_t *queue = lf_queue_new(RING);
+    uintptr_t next_in = 1, next_out = 1;
+
+    // Insert more than the ring holds, take some, and so on
+    for (int round = 0; round < 50; round++) {
+        int num_in = (round * 7) % (3 * RING) + 1;
+        int num_out = (round * 5) % (3 * RING) + 1;
+        for (int i = 0; i < num_in; i++)
+            lf_queue_insert_back(queue, (void *)next_in++);
+        if (lf_queue_size(queue) != next_in - next_out) {
+            fprintf(stderr, "lf_queue_size: %zu, expected %lu\n",
+                    lf_queue_size(queue), (unsigned long)(next_in - next_out));
+            failures++;
+        }
+        for (int i = 0; i < num_out && next_out < next_in; i++) {
+            uintptr_t elem = (uintptr_t)lf_queue_remove_front(queue);
+            if (elem != next_out) {
+                fprintf(stderr, "lf_queue_remove_front: %lu, expected %lu\n",
+                        (unsigned long)elem, (unsigned long)next_out);
+                failures++;
+            }
+            next_out++;
+        }
+    }
+    while (next_out < next_in) {
+        if ((uintptr_t)lf_queue_remove_front(queue) != next_out++)
+            failures++;
+    }
+    if (!lf_queue_empty(queue) || lf_queue_remove_front(queue) != NULL) {
+        fprintf(stderr, "lf_queue: not empty after all the elements are removed\n");
+        failures++;
+    }
+    lf_queue_free(queue, NULL);
+}
+
+static lf_queue_t *shared;
+static atomic_int seen[PRODUCERS * PER_PRODUCER];
+static atomic_long removed;
+
+static void *producer(void *arg) {
+    uintptr_t first = (uintptr_t)arg * PER_PRODUCER;
+    for (uintptr_t i = 0; i < PER_PRODUCER; i++)
+        lf_queue_insert_back(shared, (void *)(first + i + 1));
+    return NULL;
+}
+
+static void *consumer(void *arg) {
+    while (atomic_load(&removed) < PRODUCERS * PER_PRODUCER) {
+        uintptr_t elem = (uintptr_t)lf_queue_remove_front(shared);
+        if (elem == 0)
+            continue;
+        atomic_fetch_add(&seen[elem - 1], 1);
+        atomic_fetch_add(&removed, 1);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Producers and consumers at once on a ring which keeps
+ * overflowing, every element must come out exactly once.
+ */
+static void check_drain(void) {
+    pthread_t producers[PRODUCERS], consumers[CONSUMERS];
+
+    shared = lf_queue_new(RING);
+    for (int i = 0; i < CONSUMERS; i++)
+        pthread_create(&consumers[i], NULL, consumer, NULL);
+    for (int i = 0; i < PRODUCERS; i++)
+        pthread_create(&producers[i], NULL, producer, (void *)(uintptr_t)i);
+    for (int i = 0; i < PRODUCERS; i++)
+        pthread_join(producers[i], NULL);
+    for (int i = 0; i < CONSUMERS; i++)
+        pthread_join(consumers[i], NULL);
+
+    for (int i = 0; i < PRODUCERS * PER_PRODUCER; i++) {
+        if (atomic_load(&seen[i]) != 1) {
+            fprintf(stderr, "lf_queue: element %d removed %d times\n", i + 1, atomic_load(&seen[i]));
+            failures++;
+        }
+    }
+    if (!lf_queue_empty(shared)) {
+        fprintf(stderr, "lf_queue: %zu elements left after the drain\n", lf_queue_size(shared));
+        failures++;
+    }
+    lf_queue_free(shared, NULL);
+}
+
+/* ===================== The pool ===================== */
+
+static ws_pool_t *pool;
+static atomic_int runs[MAX_TASKS];
+static atomic_long next_child;
+static atomic_long running; // Tasks taken by a worker and not done yet
+static atomic_long left_early; // Workers which stopped while there was still work
+
+static void *pool_producer(void *arg) {
+    uintptr_t first = (uintptr_t)arg * (TASKS / PRODUCERS);
+    bool wait = (uintptr_t)arg % 2 == 0; // Half of them respect the capacity
+    for (uintptr_t i = 0; i < TASKS / PRODUCERS; i++) {
+        if (wait)
+            ws_pool_push_wait(pool, (void *)(first + i + 1));
+        else
+            ws_pool_push(pool, (void *)(first + i + 1));
+    }
+    return NULL;
+}
+
+static void *pool_worker(void *arg) {
+    int worker = (intptr_t)arg;
+    uintptr_t task;
+
+    while (true) {
+        if ((task = (uintptr_t)ws_pool_pop(pool, worker)) == 0) {
+            if (ws_pool_finished(pool))
+                break;
+            ws_pool_wait(pool, worker);
+            continue;
+        }
+        atomic_fetch_add(&running, 1);
+        atomic_fetch_add(&runs[task - 1], 1);
+        // A task from outside may split, its parts are pushed by the worker
+        // after a while, as a file is mapped first
+        if (task <= TASKS && task % SPLIT_EVERY == 0) {
+            usleep(SPLIT_DELAY_US);
+            for (int i = 0; i < CHILDREN; i++)
+                ws_pool_push(pool, (void *)(uintptr_t)(atomic_fetch_add(&next_child, 1) + 1));
+        }
+        atomic_fetch_sub(&running, 1);
+        ws_pool_done(pool);
+    }
+    // No task may be queued or running, which may push more, once the
+    // pool says it is finished
+    if (!ws_pool_empty(pool) || atomic_load(&running) > 0)
+        atomic_fetch_add(&left_early, 1);
+    return NULL;
+}
+
+/**
+ * @brief Runs all the tasks through a pool, with or without a capacity and
+ * the adaptive mode.
+ */
+static void check_pool(long capacity, bool adaptive) {
+    pthread_t workers[WORKERS], producers[PRODUCERS];
+
+    pool = ws_pool_new(WORKERS);
+    ws_pool_set_capacity(pool, capacity);
+    if (adaptive)
+        ws_pool_set_adaptive(pool, 1);
+    atomic_store(&next_child, TASKS);
+    atomic_store(&running, 0);
+    atomic_store(&left_early, 0);
+    for (int i = 0; i < MAX_TASKS; i++)
+        atomic_store(&runs[i], 0);
+
+    for (int i = 0; i < WORKERS; i++)
+        pthread_create(&workers[i], NULL, pool_worker, (void *)(intptr_t)i);
+    for (int i = 0; i < PRODUCERS; i++)
+        pthread_create(&producers[i], NULL, pool_producer, (void *)(uintptr_t)i);
+    for (int i = 0; i < PRODUCERS; i++)
+        pthread_join(producers[i], NULL);
+    ws_pool_close(pool);
+    for (int i = 0; i < WORKERS; i++)
+        pthread_join(workers[i], NULL);
+
+    long num = atomic_load(&next_child);
+    for (long i = 0; i < num; i++) {
+        if (atomic_load(&runs[i]) != 1) {
+            fprintf(stderr, "ws_pool (capacity %ld%s): task %ld run %d times\n", capacity,
+                    adaptive ? ", adaptive" : "", i + 1, atomic_load(&runs[i]));
+            failures++;
+        }
+    }
+    if (atomic_load(&left_early) > 0) {
+        fprintf(stderr, "ws_pool (capacity %ld%s): %ld workers stopped before the work was done\n",
+                capacity, adaptive ? ", adaptive" : "", atomic_load(&left_early));
+        failures++;
+    }
+    ws_pool_free(pool);
+}
+
+int main(void) {
+    check_order();
+    check_drain();
+    check_pool(0, false);
+    check_pool(256, false);
+    check_pool(256, true);
+    return failures == 0 ? 0 : 1;
+}
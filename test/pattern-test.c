@@ -0,0 +1,175 @@
+/*
+Checks of pattern.c and lazy-dfa.c against regexec.
+A fixed corpus of short lines, made of the characters the patterns are
+about, is matched line by line with every pattern below. The lines the
+pattern, its search over the whole corpus and its lazy DFA (with a big
+and a tiny cache) find must be the lines regexec finds, and the literals
+pulled out of the pattern must all be in every line regexec matches.
+*/
+#define _GNU_SOURCE
+#include "pattern.h"
+#include "lazy-dfa.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <regex.h>
+
+#define NUM_LINES 3000
+#define MAX_LINE 48
+#define TINY_CACHE 1 // Flushes the cache of the DFA on every new state
+
+/* Basic regular expressions with \|, *, \{..\} and bracket expressions,
+ * and the other things extract_literals() and the DFA have to skip */
+static const char *patterns[] = {
+    "abc", "a\\|b", "ab\\|xy", "foo\\|bar\\|baz", "ab\\|", "a*b", "ab*c",
+    "x*", "*a", "^*a", "a\\*", "^a*$", "a\\{2\\}", "a\\{2,3\\}b",
+    "xa\\{1,\\}", "b\\{0,2\\}c", "ab\\{0\\}c", "ab\\+c", "ab\\?c",
+    "[abc]x", "[^a-c]y", "[]a]b", "[^]a]b", "[a-]z", "a[.]c", "a\\.c",
+    "[*]b", "[[:digit:]]\\{2\\}", "[[:alpha:]]*1", "x[[:space:]]y",
+    "\\(ab\\)*c", "\\(a\\|x\\)yz", "\\(ab\\|c\\)\\{2\\}", "za\\(b\\)c",
+    "\\(\\(a\\)b\\)\\|zz", "^ab", "yz$", "^$", ".", "a.c", "x\\|^y", "c$\\|^b",
+    "a\\{1,2\\}\\|zz", "0-1", "\\(ab\\)\\1", "\\<ab", "b\\>", "a\\bc",
+    "[.]\\{2\\}foo", "ba[rz]\\{1,\\}", "f[o]o", "\\(f\\)oo\\|bar",
+};
+
+static char *lines[NUM_LINES];
+static size_t lens[NUM_LINES];
+static int failures = 0;
+
+/**
+ * @brief Fills the corpus: a few fixed lines, then pseudo-random ones from
+ * the same seed every time, mostly of the characters of the patterns.
+ */
+static void make_corpus(void) {
+    static const char *fixed[] = {
+        "", "abc", "a", "b", "aab", "aaab", "xaaa", "ab", "ac", "abbbc",
+        "foo", "bar", "baz", "foobar", "xyz", "ayz", "xy", "yz", "a.c", "a*",
+        "]b", "-z", "12", "x y", "abab", "ababc", "cc", "cabc", "zabc", "*a",
+    };
+    static const char chars[] = "abcxyzfor.*[]\\- 01";
+    unsigned long seed = 1;
+    int num_fixed = sizeof(fixed) / sizeof(fixed[0]);
+
+    for (int i = 0; i < NUM_LINES; i++) {
+        if (i < num_fixed) {
+            lines[i] = strdup(fixed[i]);
+        } else {
+            seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+            size_t len = (seed >> 33) % MAX_LINE;
+            lines[i] = malloc(len + 1);
+            for (size_t j = 0; j < len; j++) {
+                seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+                lines[i][j] = chars[(seed >> 33) % (sizeof(chars) - 1)];
+            }
+            lines[i][len] = '\0';
+        }
+        lens[i] = strlen(lines[i]);
+    }
+}
+
+/**
+ * @brief Tells whether the current line contains a string, for
+ * pattern_may_match.
+ */
+static bool line_contains(const char *str, size_t len, void *arg) {
+    const char *line = arg;
+    return memmem(line, strlen(line), str, len) != NULL;
+}
+
+/** @brief The lines found by pattern_search, by line number */
+typedef struct {
+    bool *found;
+    long num;
+} found_t;
+
+static bool save_line(const char *line, size_t len, long line_number, void *arg) {
+    found_t *found = arg;
+    if (line_number >= 1 && line_number <= NUM_LINES)
+        found->found[line_number - 1] = true;
+    found->num++;
+    return true;
+}
+
+static void fail(const char *src, const char *what, int line) {
+    fprintf(stderr, "pattern '%s': %s differs from regexec on line %d '%s'\n",
+            src, what, line + 1, lines[line]);
+    failures++;
+}
+
+/**
+ * @brief Runs every check on one pattern.
+ */
+static void check_pattern(const char *src, const char *corpus, size_t corpus_len) {
+    regex_t regex;
+    bool expected[NUM_LINES];
+    bool found_lines[NUM_LINES] = {false};
+    found_t found = {found_lines, 0};
+    long num_expected = 0;
+
+    if (regcomp(&regex, src, REG_NOSUB) != 0) {
+        fprintf(stderr, "pattern '%s': not a valid expression\n", src);
+        failures++;
+        return;
+    }
+    pattern_t *pat = pattern_compile((char *)src);
+    lazy_dfa_t *dfa = lazy_dfa_compile(src, 2 * 1024 * 1024);
+    lazy_dfa_t *tiny = lazy_dfa_compile(src, TINY_CACHE);
+
+    for (int i = 0; i < NUM_LINES; i++) {
+        expected[i] = regexec(&regex, lines[i], 0, NULL, 0) == 0;
+        num_expected += expected[i];
+        if (pattern_match_line(pat, lines[i], lens[i]) != expected[i])
+            fail(src, "pattern_match_line", i);
+        if (expected[i] && !pattern_may_match(pat, line_contains, lines[i]))
+            fail(src, "a required literal", i);
+        if (dfa != NULL && lazy_dfa_match_line(dfa, lines[i], lens[i]) != expected[i])
+            fail(src, "the lazy DFA", i);
+        if (tiny != NULL && lazy_dfa_match_line(tiny, lines[i], lens[i]) != expected[i])
+            fail(src, "the lazy DFA with a tiny cache", i);
+    }
+
+    pattern_search(pat, corpus, corpus_len, true, save_line, &found);
+    for (int i = 0; i < NUM_LINES; i++) {
+        if (found_lines[i] != expected[i])
+            fail(src, "pattern_search", i);
+    }
+    if (found.num != num_expected) {
+        fprintf(stderr, "pattern '%s': pattern_search found %ld lines, regexec %ld\n",
+                src, found.num, num_expected);
+        failures++;
+    }
+
+    if (dfa != NULL)
+        lazy_dfa_free(dfa);
+    if (tiny != NULL)
+        lazy_dfa_free(tiny);
+    pattern_free(pat);
+    regfree(&regex);
+}
+
+int main(void) {
+    size_t corpus_len = 0;
+    char *corpus;
+
+    make_corpus();
+    // The corpus as a file would be, without a '\n' after the last line
+    for (int i = 0; i < NUM_LINES; i++)
+        corpus_len += lens[i] + 1;
+    corpus = malloc(corpus_len);
+    for (size_t i = 0, pos = 0; i < NUM_LINES; i++) {
+        memcpy(corpus + pos, lines[i], lens[i]);
+        pos += lens[i];
+        corpus[pos++] = '\n';
+    }
+    corpus_len--;
+
+    for (size_t i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++)
+        check_pattern(patterns[i], corpus, corpus_len);
+
+    free(corpus);
+    for (int i = 0; i < NUM_LINES; i++)
+        free(lines[i]);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,45 @@
+#!/bin/bash
+#
+# Builds and runs the checks of the modules. Each check is a program
+# test/NAME-test.c which prints what went wrong on stderr and exits with
+# 1 if anything did.
+#
+# Usage: test/run.sh [NAME...]    (all the checks by default)
+#
+# Settings, from the environment:
+#   WORK      directory of the binaries   (/tmp/pgrep-test)
+#   CFLAGS    passed to gcc               (-O2 -Wall)
+
+SRC=$(cd "$(dirname "$0")/.." && pwd)
+WORK=${WORK:-/tmp/pgrep-test}
+CFLAGS=${CFLAGS:--O2 -Wall}
+
+mkdir -p "$WORK"
+
+# The sources each check is linked with
+sources_of() {
+    case $1 in
+        pattern|aho-corasick)
+            echo pattern.c lazy-dfa.c literal-search.c aho-corasick.c ;;
+        lock-free-queue)
+            echo lock-free-queue.c thread-safe-linked-list.c work-stealing-pool.c ;;
+        gzip-reader) echo gzip-reader.c ;;
+    esac
+}
+
+names=${*:-$(cd "$SRC/test" && ls *-test.c | sed 's/-test\.c$//')}
+failed=0
+cd "$SRC"
+for name in $names; do
+    if ! gcc $CFLAGS -I. "test/$name-test.c" $(sources_of $name) \
+            -o "$WORK/$name-test" -lpthread -lz; then
+        echo "FAIL $name (build)"
+        failed=1
+    elif "$WORK/$name-test"; then
+        echo "ok   $name"
+    else
+        echo "FAIL $name"
+        failed=1
+    fi
+done
+exit $failed
@@ -271,7 +271,7 @@ void linked_list_free(linked_list_t *list, free_fn elem_free) {
         linked_list_node_t *temp = node;
         node = node->next;
         if (elem_free != NULL)
-            elem_free(node->elem);
+            elem_free(temp->elem);
         free(temp);
     }
     pthread_mutex_unlock(&list->mutex);
@@ -0,0 +1,597 @@
+/*
+A persistent index of the trigrams of the files of a tree, so that a
+search of the tree only reads the files which may match.
+The index file maps every trigram, three bytes in a row of one line, to
+the sorted list of the files which contain it, and keeps the size and
+the modification time of every file. The file is mapped as it is, only
+a hash table of the file names is built when it is loaded.
+While the tree is searched, every file found is added to a new index. A
+file whose size and time didn't change is known: the postings of the
+loaded index tell whether it can contain a string. The other files are
+read anyway, and their trigrams are collected by the threads searching
+them. The new index is written at the end, under a temporary name then
+renamed over the old one, and only when a file was changed, added or
+removed.
+*/
+#define _GNU_SOURCE
+#include "trigram-index.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define INDEX_MAGIC "PGTRIGR1"
+#define NUM_TRIGRAMS (1 << 24)
+#define SORT_BYTES 7 // A posting is sorted on the trigram and the file
+
+/** @brief The beginning of an index file, followed by the tables */
+typedef struct index_header {
+    char magic[8];
+    uint64_t num_files;
+    uint64_t num_trigrams; // The trigrams found in any file
+    uint64_t num_postings;
+    uint64_t names_len;
+    uint64_t root; // Offset of the searched directory in the names
+} index_header_t;
+
+/** @brief A file of an index file */
+typedef struct index_file {
+    uint64_t name; // Offset in the names
+    int64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t indexed; // The trigrams were collected, else it is read anyway
+} index_file_t;
+
+/** @brief The files containing a trigram, in an index file */
+typedef struct index_trigram {
+    uint32_t trigram;
+    uint32_t num;
+    uint64_t postings; // The first of the num files in the postings
+} index_trigram_t;
+
+/** @brief A file of the new index */
+struct trigram_file {
+    char *name;
+    int64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t old_id; // The file in the loaded index if known, else -1
+    uint32_t *trigrams; // Collected from the contents, sorted
+    size_t num_trigrams;
+    bool changed; // New, or changed since the index was saved
+    bool indexed; // The trigrams are known
+};
+
+/** @brief The trigrams a worker collects from one file */
+typedef struct trigram_scan {
+    uint64_t *seen; // One bit per trigram
+    uint32_t *trigrams;
+    size_t num;
+    size_t capacity;
+} trigram_scan_t;
+
+/** @brief The index structure the user receives */
+typedef struct trigram_index {
+    char *root;
+    // The loaded index, empty if there was none
+    char *map;
+    size_t map_size;
+    uint64_t old_num_files;
+    uint64_t old_num_trigrams;
+    const index_file_t *old_files;
+    const index_trigram_t *old_trigrams;
+    const uint32_t *old_postings;
+    const char *old_names;
+    int64_t *names_table; // Hash table of the loaded files, -1 if free
+    size_t table_mask;
+    // The new index
+    trigram_file_t **files;
+    size_t num_files;
+    size_t capacity;
+    trigram_scan_t *scans;
+    int num_workers;
+} trigram_index_t;
+
+static void *xrealloc(void *ptr, size_t size) {
+    if ((ptr = realloc(ptr, size)) == NULL) {
+        perror("malloc failed in trigram-index");
+        exit(1);
+    }
+    return ptr;
+}
+
+static uint64_t hash_name(const char *name) {
+    uint64_t hash = 14695981039346656037ULL; // FNV-1a
+    for (; *name != '\0'; name++)
+        hash = (hash ^ (unsigned char)*name) * 1099511628211ULL;
+    return hash;
+}
+
+/**
+ * @brief Checks that a mapped index file is whole and consistent, so a
+ * broken file is only ignored.
+ */
+static bool check_index(trigram_index_t *index, const char *root) {
+    const index_header_t *header = (const index_header_t *)index->map;
+    uint64_t size;
+
+    if (index->map_size < sizeof(index_header_t) || memcmp(header->magic, INDEX_MAGIC, 8) != 0)
+        return false;
+    size = sizeof(index_header_t) + header->num_files * sizeof(index_file_t) +
+           header->num_trigrams * sizeof(index_trigram_t) + header->num_postings * sizeof(uint32_t);
+    if (header->num_files > UINT32_MAX || header->num_trigrams > NUM_TRIGRAMS ||
+        header->names_len == 0 || size + header->names_len != index->map_size)
+        return false;
+
+    index->old_num_files = header->num_files;
+    index->old_num_trigrams = header->num_trigrams;
+    index->old_files = (const index_file_t *)(header + 1);
+    index->old_trigrams = (const index_trigram_t *)(index->old_files + header->num_files);
+    index->old_postings = (const uint32_t *)(index->old_trigrams + header->num_trigrams);
+    index->old_names = (const char *)(index->old_postings + header->num_postings);
+    if (index->old_names[header->names_len - 1] != '\0' || header->root >= header->names_len ||
+        strcmp(index->old_names + header->root, root) != 0)
+        return false;
+    for (uint64_t i = 0; i < header->num_files; i++) {
+        if (index->old_files[i].name >= header->names_len)
+            return false;
+    }
+    for (uint64_t i = 0; i < header->num_trigrams; i++) {
+        const index_trigram_t *tri = &index->old_trigrams[i];
+        if (tri->trigram >= NUM_TRIGRAMS || tri->postings + tri->num > header->num_postings)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Maps the index file at path, and hashes the names of its files.
+ * A missing or broken index, or one of another directory, is left empty.
+ */
+static void map_index(trigram_index_t *index, const char *path) {
+    struct stat sb;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) == -1)
+        return;
+    if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0) {
+        index->map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        index->map_size = sb.st_size;
+    }
+    close(fd);
+    if (index->map == NULL || index->map == MAP_FAILED) {
+        index->map = NULL;
+        return;
+    }
+    if (!check_index(index, index->root)) {
+        munmap(index->map, index->map_size);
+        index->map = NULL;
+        index->old_num_files = 0;
+        index->old_num_trigrams = 0;
+        return;
+    }
+
+    size_t table_size = 16;
+    while (table_size < 2 * index->old_num_files)
+        table_size *= 2;
+    index->names_table = xrealloc(NULL, table_size * sizeof(int64_t));
+    index->table_mask = table_size - 1;
+    memset(index->names_table, -1, table_size * sizeof(int64_t));
+    for (uint64_t i = 0; i < index->old_num_files; i++) {
+        size_t slot = hash_name(index->old_names + index->old_files[i].name) & index->table_mask;
+        while (index->names_table[slot] != -1)
+            slot = (slot + 1) & index->table_mask;
+        index->names_table[slot] = i;
+    }
+}
+
+/**
+ * @brief Loads the index of a directory, to search it and build the new
+ * index at the same time. Exits only on malloc error.
+ *
+ * @param path the index file, which may not exist yet
+ * @param root the directory searched, the index is only used for it
+ * @param num_workers the number of threads which may collect trigrams
+ * @return trigram_index_t* a pointer to the allocated index
+ */
+trigram_index_t *trigram_index_load(const char *path, const char *root, int num_workers) {
+    trigram_index_t *index = xrealloc(NULL, sizeof(trigram_index_t));
+
+    memset(index, 0, sizeof(trigram_index_t));
+    index->root = xrealloc(NULL, strlen(root) + 1);
+    strcpy(index->root, root);
+    index->num_workers = num_workers;
+    index->scans = xrealloc(NULL, num_workers * sizeof(trigram_scan_t));
+    memset(index->scans, 0, num_workers * sizeof(trigram_scan_t));
+    map_index(index, path);
+    return index;
+}
+
+static int64_t find_old_file(trigram_index_t *index, const char *name) {
+    if (index->names_table == NULL)
+        return -1;
+    size_t slot = hash_name(name) & index->table_mask;
+    for (; index->names_table[slot] != -1; slot = (slot + 1) & index->table_mask) {
+        int64_t id = index->names_table[slot];
+        if (strcmp(index->old_names + index->old_files[id].name, name) == 0)
+            return id;
+    }
+    return -1;
+}
+
+/**
+ * @brief Adds a file found in the directory to the new index, in the
+ * order of the search. Only one thread may add files.
+ *
+ * @param index the index supplied from the user
+ * @param name the path of the file
+ * @param sb the status of the file
+ * @return trigram_file_t* the file, valid until the index is freed
+ */
+trigram_file_t *trigram_index_add(trigram_index_t *index, const char *name, const struct stat *sb) {
+    trigram_file_t *file = xrealloc(NULL, sizeof(trigram_file_t));
+    int64_t old_id = find_old_file(index, name);
+
+    memset(file, 0, sizeof(trigram_file_t));
+    file->name = xrealloc(NULL, strlen(name) + 1);
+    strcpy(file->name, name);
+    file->size = sb->st_size;
+    file->mtime_sec = sb->st_mtim.tv_sec;
+    file->mtime_nsec = sb->st_mtim.tv_nsec;
+    file->old_id = -1;
+    file->changed = old_id == -1 || index->old_files[old_id].size != file->size ||
+                    index->old_files[old_id].mtime_sec != file->mtime_sec ||
+                    index->old_files[old_id].mtime_nsec != file->mtime_nsec;
+    if (!file->changed && index->old_files[old_id].indexed) {
+        file->old_id = old_id;
+        file->indexed = true;
+    }
+
+    if (index->num_files == index->capacity) {
+        index->capacity = index->capacity ? 2 * index->capacity : 1024;
+        index->files = xrealloc(index->files, index->capacity * sizeof(trigram_file_t *));
+    }
+    index->files[index->num_files++] = file;
+    return file;
+}
+
+/**
+ * @brief Tells whether a file is unchanged since the index was saved, so
+ * that its trigrams are known without reading it.
+ *
+ * @param file a file of the index
+ * @return true if the file is known
+ */
+bool trigram_index_known(trigram_file_t *file) {
+    return file->old_id != -1;
+}
+
+/**
+ * @brief Finds the files containing a trigram in the loaded index.
+ */
+static const index_trigram_t *find_trigram(trigram_index_t *index, uint32_t trigram) {
+    size_t low = 0, high = index->old_num_trigrams;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (index->old_trigrams[mid].trigram < trigram)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    if (low < index->old_num_trigrams && index->old_trigrams[low].trigram == trigram)
+        return &index->old_trigrams[low];
+    return NULL;
+}
+
+static bool has_posting(trigram_index_t *index, const index_trigram_t *tri, uint32_t id) {
+    const uint32_t *postings = index->old_postings + tri->postings;
+    size_t low = 0, high = tri->num;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (postings[mid] < id)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low < tri->num && postings[low] == id;
+}
+
+/**
+ * @brief Tells whether a known file may contain a string: all the
+ * trigrams of the string are in the file, though maybe not in a row.
+ * A string shorter than three bytes, or a file which isn't known, may
+ * always be in it.
+ *
+ * @param index the index supplied from the user
+ * @param file a file of the index
+ * @param str the string
+ * @param len the length of the string
+ * @return false if the file can't contain the string
+ */
+bool trigram_index_contains(trigram_index_t *index, trigram_file_t *file, const char *str, size_t len) {
+    const unsigned char *bytes = (const unsigned char *)str;
+    const index_trigram_t *tri;
+
+    if (file->old_id == -1)
+        return true;
+    for (size_t i = 0; i + 3 <= len; i++) {
+        // The trigrams across lines are not collected
+        if (bytes[i] == '\n' || bytes[i + 1] == '\n' || bytes[i + 2] == '\n')
+            continue;
+        uint32_t trigram = bytes[i] << 16 | bytes[i + 1] << 8 | bytes[i + 2];
+        if ((tri = find_trigram(index, trigram)) == NULL || !has_posting(index, tri, file->old_id))
+            return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Collects the trigrams of a part of a file which isn't known. A
+ * file may be scanned in several parts, each ending at a line end.
+ * Every worker collects one file at a time.
+ *
+ * @param index the index supplied from the user
+ * @param worker the index of the thread, from 0 to num_workers - 1
+ * @param buf the part of the file
+ * @param len the length of the part
+ */
+void trigram_index_scan(trigram_index_t *index, int worker, const char *buf, size_t len) {
+    trigram_scan_t *scan = &index->scans[worker];
+    const unsigned char *bytes = (const unsigned char *)buf;
+    uint32_t trigram = 0;
+    int run = 0; // Bytes of the current line in trigram
+
+    if (scan->seen == NULL && (scan->seen = calloc(NUM_TRIGRAMS / 64, sizeof(uint64_t))) == NULL) {
+        perror("malloc failed in trigram-index");
+        exit(1);
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (bytes[i] == '\n') {
+            run = 0;
+            continue;
+        }
+        trigram = (trigram << 8 | bytes[i]) & (NUM_TRIGRAMS - 1);
+        if (++run < 3)
+            continue;
+        uint64_t bit = 1ULL << (trigram & 63);
+        if (scan->seen[trigram >> 6] & bit)
+            continue;
+        scan->seen[trigram >> 6] |= bit;
+        if (scan->num == scan->capacity) {
+            scan->capacity = scan->capacity ? 2 * scan->capacity : 4096;
+            scan->trigrams = xrealloc(scan->trigrams, scan->capacity * sizeof(uint32_t));
+        }
+        scan->trigrams[scan->num++] = trigram;
+    }
+}
+
+static int compare_trigrams(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Ends the scan of a file by a worker and saves its trigrams into
+ * the new index, unless the file wasn't scanned completely, e.g. when its
+ * search stopped early. Then the file is read again by the next search.
+ *
+ * @param index the index supplied from the user
+ * @param worker the index of the thread, from 0 to num_workers - 1
+ * @param file the file scanned
+ * @param complete whether all the contents of the file were scanned
+ */
+void trigram_index_finish(trigram_index_t *index, int worker, trigram_file_t *file, bool complete) {
+    trigram_scan_t *scan = &index->scans[worker];
+
+    for (size_t i = 0; i < scan->num; i++)
+        scan->seen[scan->trigrams[i] >> 6] &= ~(1ULL << (scan->trigrams[i] & 63));
+    file->indexed = complete;
+    if (complete && scan->num > 0) {
+        qsort(scan->trigrams, scan->num, sizeof(uint32_t), compare_trigrams);
+        file->trigrams = xrealloc(NULL, scan->num * sizeof(uint32_t));
+        memcpy(file->trigrams, scan->trigrams, scan->num * sizeof(uint32_t));
+        file->num_trigrams = scan->num;
+    }
+    scan->num = 0;
+}
+
+/**
+ * @brief Sorts the postings, a trigram above a file each, by an LSD radix
+ * sort on the bytes which differ.
+ */
+static void sort_postings(uint64_t *postings, size_t num) {
+    uint64_t *tmp = xrealloc(NULL, (num ? num : 1) * sizeof(uint64_t));
+    size_t counts[256];
+
+    for (int byte = 0; byte < 8; byte++) {
+        int shift = 8 * byte;
+        // Bytes 4 to 6 hold the trigram, 0 to 3 the file
+        if (byte == SORT_BYTES)
+            break;
+        memset(counts, 0, sizeof(counts));
+        for (size_t i = 0; i < num; i++)
+            counts[(postings[i] >> shift) & 0xff]++;
+        if (num == 0 || counts[(postings[0] >> shift) & 0xff] == num)
+            continue;
+        for (size_t i = 0, sum = 0; i < 256; i++) {
+            size_t count = counts[i];
+            counts[i] = sum;
+            sum += count;
+        }
+        for (size_t i = 0; i < num; i++)
+            tmp[counts[(postings[i] >> shift) & 0xff]++] = postings[i];
+        memcpy(postings, tmp, num * sizeof(uint64_t));
+    }
+    free(tmp);
+}
+
+/**
+ * @brief Gathers the postings of the new index: the collected trigrams of
+ * the files read, and the postings of the loaded index for the known ones.
+ */
+static uint64_t *gather_postings(trigram_index_t *index, size_t *num) {
+    int64_t *new_ids = xrealloc(NULL, (index->old_num_files ? index->old_num_files : 1) * sizeof(int64_t));
+    size_t capacity = 0, len = 0;
+    uint64_t *postings;
+
+    for (uint64_t i = 0; i < index->old_num_files; i++)
+        new_ids[i] = -1;
+    for (size_t i = 0; i < index->num_files; i++) {
+        if (index->files[i]->old_id != -1)
+            new_ids[index->files[i]->old_id] = i;
+        capacity += index->files[i]->num_trigrams;
+    }
+    for (uint64_t i = 0; i < index->old_num_trigrams; i++)
+        capacity += index->old_trigrams[i].num;
+    postings = xrealloc(NULL, (capacity ? capacity : 1) * sizeof(uint64_t));
+
+    for (size_t i = 0; i < index->num_files; i++) {
+        trigram_file_t *file = index->files[i];
+        for (size_t j = 0; j < file->num_trigrams; j++)
+            postings[len++] = (uint64_t)file->trigrams[j] << 32 | i;
+    }
+    for (uint64_t i = 0; i < index->old_num_trigrams; i++) {
+        const index_trigram_t *tri = &index->old_trigrams[i];
+        for (uint32_t j = 0; j < tri->num; j++) {
+            int64_t id = new_ids[index->old_postings[tri->postings + j]];
+            if (id != -1)
+                postings[len++] = (uint64_t)tri->trigram << 32 | id;
+        }
+    }
+    free(new_ids);
+    sort_postings(postings, len);
+    *num = len;
+    return postings;
+}
+
+static bool write_all(FILE *fp, const void *data, size_t len) {
+    return len == 0 || fwrite(data, 1, len, fp) == len;
+}
+
+/**
+ * @brief Writes the tables of the new index into an open file.
+ */
+static bool write_index(trigram_index_t *index, FILE *fp, const uint64_t *postings, size_t num_postings) {
+    index_header_t header;
+    uint64_t names_len = strlen(index->root) + 1;
+    bool ok = true;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, 8);
+    header.num_files = index->num_files;
+    header.num_postings = num_postings;
+    for (size_t i = 0; i < num_postings; i++) {
+        if (i == 0 || postings[i] >> 32 != postings[i - 1] >> 32)
+            header.num_trigrams++;
+    }
+    for (size_t i = 0; i < index->num_files; i++)
+        names_len += strlen(index->files[i]->name) + 1;
+    header.names_len = names_len;
+    header.root = 0;
+    ok = write_all(fp, &header, sizeof(header));
+
+    names_len = strlen(index->root) + 1;
+    for (size_t i = 0; ok && i < index->num_files; i++) {
+        trigram_file_t *file = index->files[i];
+        index_file_t entry = {names_len, file->size, file->mtime_sec, file->mtime_nsec, file->indexed};
+        ok = write_all(fp, &entry, sizeof(entry));
+        names_len += strlen(file->name) + 1;
+    }
+    for (size_t i = 0; ok && i < num_postings;) {
+        index_trigram_t entry = {postings[i] >> 32, 0, i};
+        while (i < num_postings && postings[i] >> 32 == entry.trigram) {
+            entry.num++;
+            i++;
+        }
+        ok = write_all(fp, &entry, sizeof(entry));
+    }
+    for (size_t i = 0; ok && i < num_postings; i++) {
+        uint32_t id = (uint32_t)postings[i];
+        ok = write_all(fp, &id, sizeof(id));
+    }
+    ok = ok && write_all(fp, index->root, strlen(index->root) + 1);
+    for (size_t i = 0; ok && i < index->num_files; i++)
+        ok = write_all(fp, index->files[i]->name, strlen(index->files[i]->name) + 1);
+    return ok;
+}
+
+/**
+ * @brief Tells whether the new index differs from the loaded one: a file
+ * was changed, added, removed, or indexed at last.
+ */
+static bool index_changed(trigram_index_t *index) {
+    if (index->num_files != index->old_num_files)
+        return true;
+    for (size_t i = 0; i < index->num_files; i++) {
+        trigram_file_t *file = index->files[i];
+        if (file->changed || (file->old_id == -1 && file->indexed))
+            return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Writes the new index over the index file, if any file changed,
+ * was added or was removed since it was saved. The workers must be done.
+ *
+ * @param index the index supplied from the user
+ * @param path the index file
+ * @return false if the index couldn't be written, errno tells why
+ */
+bool trigram_index_save(trigram_index_t *index, const char *path) {
+    char *tmp_path;
+    uint64_t *postings;
+    size_t num_postings;
+    FILE *fp;
+    bool ok;
+
+    if (!index_changed(index))
+        return true;
+
+    tmp_path = xrealloc(NULL, strlen(path) + 5);
+    sprintf(tmp_path, "%s.tmp", path);
+    if ((fp = fopen(tmp_path, "w")) == NULL) {
+        free(tmp_path);
+        return false;
+    }
+    postings = gather_postings(index, &num_postings);
+    ok = write_index(index, fp, postings, num_postings);
+    ok = (fclose(fp) == 0) && ok;
+    ok = ok && rename(tmp_path, path) == 0;
+    if (!ok)
+        unlink(tmp_path);
+    free(postings);
+    free(tmp_path);
+    return ok;
+}
+
+/**
+ * @brief Frees the index, and unmaps the loaded index file.
+ *
+ * @param index the index supplied from the user
+ */
+void trigram_index_free(trigram_index_t *index) {
+    for (size_t i = 0; i < index->num_files; i++) {
+        free(index->files[i]->name);
+        free(index->files[i]->trigrams);
+        free(index->files[i]);
+    }
+    for (int i = 0; i < index->num_workers; i++) {
+        free(index->scans[i].seen);
+        free(index->scans[i].trigrams);
+    }
+    if (index->map != NULL)
+        munmap(index->map, index->map_size);
+    free(index->names_table);
+    free(index->files);
+    free(index->scans);
+    free(index->root);
+    free(index);
+}
@@ -0,0 +1,20 @@
+#ifndef TRIGRAM_INDEX_INCLUDED
+#define TRIGRAM_INDEX_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+typedef struct trigram_index trigram_index_t;
+typedef struct trigram_file trigram_file_t;
+
+trigram_index_t *trigram_index_load(const char *path, const char *root, int num_workers);
+trigram_file_t *trigram_index_add(trigram_index_t *index, const char *name, const struct stat *sb);
+bool trigram_index_known(trigram_file_t *file);
+bool trigram_index_contains(trigram_index_t *index, trigram_file_t *file, const char *str, size_t len);
+void trigram_index_scan(trigram_index_t *index, int worker, const char *buf, size_t len);
+void trigram_index_finish(trigram_index_t *index, int worker, trigram_file_t *file, bool complete);
+bool trigram_index_save(trigram_index_t *index, const char *path);
+void trigram_index_free(trigram_index_t *index);
+
+#endif
@@ -0,0 +1,499 @@
+/*
+A reader which loads many small files at once with io_uring.
+The files are queued up to the depth of the reader. For all of them the
+open and the statx are submitted together with a single system call,
+then the read of each file, again after a short read until the whole
+file is in, and its close, and the finished files are handed out in the
+order they complete. A worker thus waits for the disk once for a whole
+batch of files instead of once per file. The ring is driven with the
+raw system calls, so no library is needed, and uring_reader_new fails
+where io_uring is missing or disabled, letting the caller read the
+files the usual way. Files which aren't regular or are bigger than
+max_size are handed out without contents, for the caller to map them.
+*/
+#define _GNU_SOURCE // For struct statx
+#include "uring-reader.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define SLOT_BUF_INIT 4096
+#define SLOT_KEEP_MAX (1024 * 1024) // Bigger buffers aren't kept
+#define OP_BITS 2 // The user data of a request is the slot and the operation
+
+enum { OP_OPEN, OP_STATX, OP_READ, OP_CLOSE };
+
+enum slot_state {
+    SLOT_FREE,
+    SLOT_OPENING, // Waiting for the open and the statx
+    SLOT_READING, // Until the size of the statx or the end of the file
+    SLOT_READY, // In the ready queue
+    SLOT_HELD // Handed out, until the next call on the reader
+};
+
+/** @brief A queued file */
+typedef struct uring_slot {
+    enum slot_state state;
+    void *tag;
+    char *path; // Kept until the slot is reused, the kernel may read it late
+    size_t path_capacity;
+    int fd; // -1 while not open
+    int waiting; // The open and the statx which are not complete yet
+    int statx_res;
+    struct statx stx;
+    char *buf;
+    size_t capacity;
+    size_t len;
+    bool read; // buf holds the contents of the file
+    int inflight; // Requests of this slot submitted and not complete
+} uring_slot_t;
+
+/** @brief The reader structure the user receives */
+typedef struct uring_reader {
+    int ring_fd;
+    size_t max_size;
+    void *ring; // Both queues, shared with the kernel
+    size_t ring_size;
+    // The submission queue
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned sq_local_tail; // Requests prepared, published when submitting
+    // The completion queue
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    // The files
+    uring_slot_t *slots;
+    unsigned depth;
+    unsigned *free_slots; // Stack of the slots which can be reused
+    unsigned num_free;
+    unsigned *ready; // Ring of the slots ready to be handed out
+    unsigned ready_head;
+    unsigned num_ready;
+    unsigned queued; // Files added and not handed out yet
+    unsigned inflight; // Requests submitted and not complete
+    int held; // The slot handed out last, or -1
+} uring_reader_t;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void *xrealloc(void *ptr, size_t size) {
+    if ((ptr = realloc(ptr, size)) == NULL) {
+        perror("malloc failed in uring-reader");
+        exit(1);
+    }
+    return ptr;
+}
+
+/**
+ * @brief Checks that the kernel supports all the requests the reader
+ * makes, they came in different versions.
+ */
+static bool ops_supported(int ring_fd) {
+    static const int ops[] = {IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_CLOSE};
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    bool supported = probe != NULL && sys_io_uring_register(ring_fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+
+    for (size_t i = 0; supported && i < sizeof(ops) / sizeof(ops[0]); i++) {
+        if (ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+            supported = false;
+    }
+    free(probe);
+    return supported;
+}
+
+/**
+ * @brief Maps the queues of the ring into the reader.
+ */
+static bool map_rings(uring_reader_t *reader, struct io_uring_params *params) {
+    size_t sq_size = params->sq_off.array + params->sq_entries * sizeof(unsigned);
+    size_t cq_size = params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+
+    reader->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    reader->ring = mmap(NULL, reader->ring_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, reader->ring_fd, IORING_OFF_SQ_RING);
+    if (reader->ring == MAP_FAILED)
+        return false;
+    reader->sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+    reader->sqes = mmap(NULL, reader->sqes_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, reader->ring_fd, IORING_OFF_SQES);
+    if (reader->sqes == MAP_FAILED) {
+        munmap(reader->ring, reader->ring_size);
+        return false;
+    }
+
+    char *sq = reader->ring, *cq = reader->ring; // Offsets are from the same start
+    reader->sq_head = (unsigned *)(sq + params->sq_off.head);
+    reader->sq_tail = (unsigned *)(sq + params->sq_off.tail);
+    reader->sq_mask = (unsigned *)(sq + params->sq_off.ring_mask);
+    reader->sq_array = (unsigned *)(sq + params->sq_off.array);
+    reader->sq_local_tail = *reader->sq_tail;
+    reader->cq_head = (unsigned *)(cq + params->cq_off.head);
+    reader->cq_tail = (unsigned *)(cq + params->cq_off.tail);
+    reader->cq_mask = (unsigned *)(cq + params->cq_off.ring_mask);
+    reader->cqes = (struct io_uring_cqe *)(cq + params->cq_off.cqes);
+    return true;
+}
+
+/**
+ * @brief Dynamically allocates a new reader with its own ring. Exits only
+ * on malloc error.
+ *
+ * @param depth the number of files which may be queued at once
+ * @param max_size the biggest file read by the reader
+ * @return uring_reader_t* a pointer to the allocated reader, or NULL if
+ * io_uring can't be used here
+ */
+uring_reader_t *uring_reader_new(unsigned depth, size_t max_size) {
+    struct io_uring_params params;
+    uring_reader_t *reader;
+    int ring_fd;
+
+    if (depth == 0)
+        return NULL;
+    // Every file has at most two requests in the queue at any time
+    memset(&params, 0, sizeof(params));
+    if ((ring_fd = sys_io_uring_setup(2 * depth, &params)) == -1)
+        return NULL;
+    // Both queues are in one mapping since Linux 5.4
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !ops_supported(ring_fd)) {
+        close(ring_fd);
+        return NULL;
+    }
+
+    reader = xrealloc(NULL, sizeof(uring_reader_t));
+    memset(reader, 0, sizeof(uring_reader_t));
+    reader->ring_fd = ring_fd;
+    if (!map_rings(reader, &params)) {
+        close(ring_fd);
+        free(reader);
+        return NULL;
+    }
+    reader->max_size = max_size;
+    reader->depth = depth;
+    reader->slots = xrealloc(NULL, depth * sizeof(uring_slot_t));
+    reader->free_slots = xrealloc(NULL, depth * sizeof(unsigned));
+    reader->ready = xrealloc(NULL, depth * sizeof(unsigned));
+    memset(reader->slots, 0, depth * sizeof(uring_slot_t));
+    for (unsigned i = 0; i < depth; i++) {
+        reader->slots[i].fd = -1;
+        reader->slots[i].buf = xrealloc(NULL, SLOT_BUF_INIT);
+        reader->slots[i].capacity = SLOT_BUF_INIT;
+        reader->free_slots[i] = depth - 1 - i;
+    }
+    reader->num_free = depth;
+    reader->held = -1;
+    return reader;
+}
+
+/**
+ * @brief Prepares a request of a slot, it is submitted with the next wait.
+ */
+static struct io_uring_sqe *get_sqe(uring_reader_t *reader, unsigned slot, int op) {
+    unsigned index = reader->sq_local_tail & *reader->sq_mask;
+    struct io_uring_sqe *sqe = &reader->sqes[index];
+
+    reader->sq_array[index] = index;
+    reader->sq_local_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op == OP_OPEN ? IORING_OP_OPENAT : op == OP_STATX ? IORING_OP_STATX :
+                  op == OP_READ ? IORING_OP_READ : IORING_OP_CLOSE;
+    sqe->user_data = ((uint64_t)slot << OP_BITS) | op;
+    reader->slots[slot].inflight++;
+    reader->inflight++;
+    return sqe;
+}
+
+/**
+ * @brief Submits the prepared requests and waits until at least
+ * min_complete requests are complete.
+ */
+static void submit(uring_reader_t *reader, unsigned min_complete) {
+    int ret;
+
+    __atomic_store_n(reader->sq_tail, reader->sq_local_tail, __ATOMIC_RELEASE);
+    do {
+        unsigned to_submit = reader->sq_local_tail - __atomic_load_n(reader->sq_head, __ATOMIC_ACQUIRE);
+        ret = sys_io_uring_enter(reader->ring_fd, to_submit, min_complete,
+                                 min_complete ? IORING_ENTER_GETEVENTS : 0);
+    } while (ret == -1 && errno == EINTR);
+    if (ret == -1) {
+        perror("io_uring_enter failed in uring-reader");
+        exit(1);
+    }
+}
+
+/**
+ * @brief Reads the part of the file which isn't in the buffer yet.
+ */
+static void read_rest(uring_reader_t *reader, unsigned slot) {
+    uring_slot_t *s = &reader->slots[slot];
+    struct io_uring_sqe *sqe = get_sqe(reader, slot, OP_READ);
+
+    sqe->fd = s->fd;
+    sqe->addr = (uintptr_t)(s->buf + s->len);
+    sqe->len = s->stx.stx_size - s->len;
+    sqe->off = s->len;
+}
+
+static void set_ready(uring_reader_t *reader, unsigned slot, bool read) {
+    reader->slots[slot].read = read;
+    reader->slots[slot].state = SLOT_READY;
+    reader->ready[(reader->ready_head + reader->num_ready++) % reader->depth] = slot;
+}
+
+/**
+ * @brief Called when the open and the statx of a file are complete:
+ * reads the file and closes it, or only closes it if it isn't for us.
+ */
+static void opened(uring_reader_t *reader, unsigned slot) {
+    uring_slot_t *s = &reader->slots[slot];
+
+    if (s->fd < 0) {
+        set_ready(reader, slot, false);
+        return;
+    }
+    if (s->statx_res < 0 || !S_ISREG(s->stx.stx_mode) || s->stx.stx_size > reader->max_size) {
+        get_sqe(reader, slot, OP_CLOSE)->fd = s->fd;
+        set_ready(reader, slot, false);
+        return;
+    }
+    if (s->stx.stx_size == 0) {
+        get_sqe(reader, slot, OP_CLOSE)->fd = s->fd;
+        s->len = 0;
+        set_ready(reader, slot, true);
+        return;
+    }
+    if (s->stx.stx_size > s->capacity) {
+        free(s->buf);
+        s->buf = xrealloc(NULL, s->stx.stx_size);
+        s->capacity = s->stx.stx_size;
+    }
+    // The close waits for the reads, a short one is followed by another
+    s->len = 0;
+    read_rest(reader, slot);
+    s->state = SLOT_READING;
+}
+
+static void release_slot(uring_reader_t *reader, unsigned slot) {
+    if (reader->slots[slot].state == SLOT_FREE && reader->slots[slot].inflight == 0)
+        reader->free_slots[reader->num_free++] = slot;
+}
+
+/**
+ * @brief Handles the completed requests, without waiting.
+ */
+static void reap(uring_reader_t *reader) {
+    unsigned head = *reader->cq_head;
+    unsigned tail = __atomic_load_n(reader->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &reader->cqes[head & *reader->cq_mask];
+        unsigned slot = cqe->user_data >> OP_BITS;
+        uring_slot_t *s = &reader->slots[slot];
+        int res = cqe->res;
+
+        s->inflight--;
+        reader->inflight--;
+        switch (cqe->user_data & ((1 << OP_BITS) - 1)) {
+            case OP_OPEN:
+                s->fd = res;
+                if (--s->waiting == 0)
+                    opened(reader, slot);
+                break;
+            case OP_STATX:
+                s->statx_res = res;
+                if (--s->waiting == 0)
+                    opened(reader, slot);
+                break;
+            case OP_READ:
+                if (res > 0)
+                    s->len += res;
+                // A read may stop short, the file is only whole at its
+                // size or at its end, if it was truncated meanwhile
+                if (res > 0 && s->len < s->stx.stx_size) {
+                    read_rest(reader, slot);
+                    break;
+                }
+                get_sqe(reader, slot, OP_CLOSE)->fd = s->fd;
+                set_ready(reader, slot, res >= 0);
+                break;
+            case OP_CLOSE:
+                s->fd = -1;
+                release_slot(reader, slot);
+                break;
+        }
+    }
+    __atomic_store_n(reader->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Takes back the slot handed out last.
+ */
+static void release_held(uring_reader_t *reader) {
+    if (reader->held < 0)
+        return;
+    uring_slot_t *s = &reader->slots[reader->held];
+    if (s->capacity > SLOT_KEEP_MAX) {
+        free(s->buf);
+        s->buf = xrealloc(NULL, SLOT_BUF_INIT);
+        s->capacity = SLOT_BUF_INIT;
+    }
+    s->state = SLOT_FREE;
+    release_slot(reader, reader->held);
+    reader->held = -1;
+}
+
+/**
+ * @brief Checks whether no more file can be added now.
+ *
+ * @param reader the reader supplied from the user
+ * @return true if uring_reader_next must be called before adding a file
+ */
+bool uring_reader_full(uring_reader_t *reader) {
+    release_held(reader);
+    if (reader->num_free == 0)
+        reap(reader);
+    return reader->num_free == 0;
+}
+
+/**
+ * @brief Checks whether the reader has nothing to do.
+ *
+ * @param reader the reader supplied from the user
+ * @return true if no file is queued and no request is running
+ */
+bool uring_reader_empty(uring_reader_t *reader) {
+    release_held(reader);
+    return reader->queued == 0 && reader->inflight == 0;
+}
+
+/**
+ * @brief Queues a file to read. It is opened with the next call to
+ * uring_reader_next, together with the other queued files. The reader
+ * must not be full.
+ *
+ * @param reader the reader supplied from the user
+ * @param path the path of the file, copied
+ * @param tag given back by uring_reader_next with the file
+ */
+void uring_reader_add(uring_reader_t *reader, const char *path, void *tag) {
+    struct io_uring_sqe *sqe;
+    size_t len = strlen(path) + 1;
+
+    release_held(reader);
+    unsigned slot = reader->free_slots[--reader->num_free];
+    uring_slot_t *s = &reader->slots[slot];
+    if (len > s->path_capacity) {
+        s->path = xrealloc(s->path, len);
+        s->path_capacity = len;
+    }
+    memcpy(s->path, path, len);
+    s->tag = tag;
+    s->fd = -1;
+    s->len = 0;
+    s->state = SLOT_OPENING;
+    s->waiting = 2;
+
+    sqe = get_sqe(reader, slot, OP_OPEN);
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)s->path;
+    sqe->open_flags = O_RDONLY | O_CLOEXEC;
+    sqe = get_sqe(reader, slot, OP_STATX);
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)s->path;
+    sqe->len = STATX_TYPE | STATX_SIZE;
+    sqe->addr2 = (uintptr_t)&s->stx;
+    reader->queued++;
+}
+
+/**
+ * @brief Submits the queued requests and gives a file which has been read,
+ * waiting for one if none is ready.
+ *
+ * @param reader the reader supplied from the user
+ * @param buf set to the contents of the file, valid until the next call
+ * on the reader, or to NULL if the reader couldn't read the file. The
+ * caller reads it the usual way then, which also reports the errors
+ * @param len set to the length of the contents
+ * @return the tag of the file, or NULL if no file is queued
+ */
+void *uring_reader_next(uring_reader_t *reader, const char **buf, size_t *len) {
+    release_held(reader);
+    while (reader->num_ready == 0) {
+        if (reader->queued == 0) {
+            // Only closes are left, wait for one so a slot is freed
+            if (reader->inflight > 0) {
+                submit(reader, 1);
+                reap(reader);
+            }
+            return NULL;
+        }
+        submit(reader, 1);
+        reap(reader);
+    }
+
+    unsigned slot = reader->ready[reader->ready_head];
+    uring_slot_t *s = &reader->slots[slot];
+    reader->ready_head = (reader->ready_head + 1) % reader->depth;
+    reader->num_ready--;
+    reader->queued--;
+    // The closes prepared by reap are submitted with the next wait
+    s->state = SLOT_HELD;
+    reader->held = slot;
+    *buf = s->read ? s->buf : NULL;
+    *len = s->len;
+    return s->tag;
+}
+
+/**
+ * @brief Frees the reader after waiting for the running requests. The
+ * tags of the files still queued are not freed.
+ *
+ * @param reader the reader supplied from the user
+ */
+void uring_reader_free(uring_reader_t *reader) {
+    release_held(reader);
+    while (reader->inflight > 0) {
+        submit(reader, 1);
+        reap(reader);
+    }
+    for (unsigned i = 0; i < reader->depth; i++) {
+        if (reader->slots[i].fd >= 0)
+            close(reader->slots[i].fd);
+        free(reader->slots[i].path);
+        free(reader->slots[i].buf);
+    }
+    munmap(reader->sqes, reader->sqes_size);
+    munmap(reader->ring, reader->ring_size);
+    close(reader->ring_fd);
+    free(reader->slots);
+    free(reader->free_slots);
+    free(reader->ready);
+    free(reader);
+}
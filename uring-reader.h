@@ -0,0 +1,16 @@
+#ifndef URING_READER_INCLUDED
+#define URING_READER_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct uring_reader uring_reader_t;
+
+uring_reader_t *uring_reader_new(unsigned depth, size_t max_size);
+bool uring_reader_full(uring_reader_t *reader);
+bool uring_reader_empty(uring_reader_t *reader);
+void uring_reader_add(uring_reader_t *reader, const char *path, void *tag);
+void *uring_reader_next(uring_reader_t *reader, const char **buf, size_t *len);
+void uring_reader_free(uring_reader_t *reader);
+
+#endif
@@ -0,0 +1,422 @@
+/*
+A task pool with one deque per worker.
+The producers spread the tasks over the deques in turn, and every worker
+takes tasks from its own deque, so the workers don't fight for a single
+lock. A worker whose deque is empty steals half of the tasks of another
+worker's deque. The deques are lock-free queues (lock-free-queue.c), so
+taking a task neither locks nor allocates while the rings have room.
+Only the first num_active workers take tasks. In the adaptive mode the
+pool times every task, and adds workers while the tasks mostly wait for
+I/O, and removes them again while the tasks keep their CPU busy or the
+process already uses all of its CPUs. The time a task is off the CPU
+only counts as I/O wait if the worker went to sleep by itself during the
+task, since a worker preempted by other jobs doesn't need company.
+A worker without a task parks on a condition variable until a task is
+pushed or the pool is finished, instead of spinning. The pool is
+finished once it is closed and every task pushed is done, so a worker
+doesn't stop while another one may still push tasks, as the parts of a
+file it splits. The pushes only take the lock when a worker is parked. A
+pool may also have a capacity: a producer pushing with ws_pool_push_wait
+then waits while the pool is full, until the workers have taken half of
+the tasks.
+*/
+#define _GNU_SOURCE // For sched_getaffinity()
+#include "work-stealing-pool.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "lock-free-queue.h"
+
+#define DEQUE_CAPACITY 1024
+#define STEAL_MAX 64
+#define CACHE_LINE 64
+#define ADAPT_TASKS 64 // Tasks between two adjustments of the active workers
+#define IO_BOUND 0.5 // Grow when the tasks wait for I/O more than this of their time
+#define CPU_BOUND 0.9 // Shrink when they wait less than 1 - this, or the CPUs are this busy
+#define INACTIVE_SLEEP_US 1000 // An inactive worker checks the pool again after it
+
+/** @brief The time at which a worker took its current task */
+typedef struct ws_clock {
+    bool busy;
+    struct timespec wall;
+    struct timespec cpu;
+    long sleeps; // Voluntary context switches of the worker
+} __attribute__((aligned(CACHE_LINE))) ws_clock_t;
+
+/** @brief The pool structure the user receives */
+typedef struct ws_pool {
+    lf_queue_t **deques;
+    int num_workers;
+    atomic_uint next_push; // Counts the pushes, to choose the deque
+    atomic_long size; // Tasks in all deques, including the ones being stolen
+    atomic_int num_active; // Workers from 0 to num_active - 1 take tasks
+    // Adaptive mode, the active workers stay between min_active and num_workers
+    bool adaptive;
+    int min_active; // Also the number of CPUs the pool may use
+    ws_clock_t *clocks;
+    struct timespec round_wall; // When the current round of tasks began
+    struct timespec round_cpu; // And the CPU time of the process then
+    atomic_long tasks_timed;
+    atomic_long wall_ns;
+    atomic_long io_ns;
+    // Parking, see ws_pool_wait and ws_pool_push_wait
+    pthread_mutex_t mutex;
+    pthread_cond_t work; // Signaled when a task is pushed or the pool is closed
+    pthread_cond_t room; // Signaled when a full pool is half empty again
+    atomic_int parked; // Workers waiting for a task
+    atomic_int blocked; // Producers waiting for room
+    atomic_bool closed; // No more tasks will be pushed from outside
+    atomic_long unfinished; // Tasks pushed and not reported by ws_pool_done yet
+    long capacity; // Tasks queued before ws_pool_push_wait waits, 0 for no limit
+} ws_pool_t;
+
+/**
+ * @brief Counts the CPUs this process may run on, which is the default
+ * number of workers.
+ *
+ * @return the number of CPUs, at least 1
+ */
+int ws_pool_num_cpus(void) {
+    cpu_set_t set;
+    long num;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) > 0)
+        return CPU_COUNT(&set);
+    num = sysconf(_SC_NPROCESSORS_ONLN);
+    return num > 0 ? (int)num : 1;
+}
+
+/**
+ * @brief Dynamically allocates a new pool. Exits only on malloc error.
+ *
+ * @param num_workers the number of workers taking tasks from the pool
+ * @return ws_pool_t* a pointer to the allocated pool
+ */
+ws_pool_t *ws_pool_new(int num_workers) {
+    ws_pool_t *pool;
+    if ((pool = calloc(1, sizeof(ws_pool_t))) == NULL ||
+        (pool->deques = malloc(num_workers * sizeof(lf_queue_t *))) == NULL) {
+        perror("malloc failed in work-stealing-pool");
+        exit(1);
+    }
+    pool->num_workers = num_workers;
+    atomic_init(&pool->size, 0);
+    atomic_init(&pool->num_active, num_workers);
+    atomic_init(&pool->parked, 0);
+    atomic_init(&pool->blocked, 0);
+    atomic_init(&pool->closed, false);
+    atomic_init(&pool->unfinished, 0);
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->room, NULL);
+    for (int i = 0; i < num_workers; i++)
+        pool->deques[i] = lf_queue_new(DEQUE_CAPACITY);
+    return pool;
+}
+
+/**
+ * @brief Lets the pool change the number of active workers by itself,
+ * from min_active up to all workers, starting with min_active. Must be
+ * called before the workers start.
+ *
+ * @param pool the pool supplied from the user
+ * @param min_active the number of workers active when the tasks are CPU bound
+ */
+void ws_pool_set_adaptive(ws_pool_t *pool, int min_active) {
+    if (min_active < 1)
+        min_active = 1;
+    if (min_active > pool->num_workers)
+        min_active = pool->num_workers;
+    if ((pool->clocks = calloc(pool->num_workers, sizeof(ws_clock_t))) == NULL) {
+        perror("malloc failed in work-stealing-pool");
+        exit(1);
+    }
+    pool->adaptive = true;
+    pool->min_active = min_active;
+    atomic_init(&pool->tasks_timed, 0);
+    atomic_init(&pool->wall_ns, 0);
+    atomic_init(&pool->io_ns, 0);
+    atomic_store(&pool->num_active, min_active);
+    clock_gettime(CLOCK_MONOTONIC, &pool->round_wall);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &pool->round_cpu);
+}
+
+/**
+ * @brief Bounds the tasks a producer may queue with ws_pool_push_wait.
+ * Must be called before the tasks are pushed.
+ *
+ * @param pool the pool supplied from the user
+ * @param capacity the number of tasks, 0 for no limit
+ */
+void ws_pool_set_capacity(ws_pool_t *pool, long capacity) {
+    pool->capacity = capacity > 0 ? capacity : 0;
+}
+
+/**
+ * @brief Gives the number of workers which currently take tasks.
+ *
+ * @param pool the pool supplied from the user
+ * @return the number of active workers
+ */
+int ws_pool_active(ws_pool_t *pool) {
+    return atomic_load(&pool->num_active);
+}
+
+static long elapsed_ns(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) * 1000000000L + (to->tv_nsec - from->tv_nsec);
+}
+
+/**
+ * @brief Accounts the task the worker has finished, and every ADAPT_TASKS
+ * tasks adjusts the number of active workers by one from the share of
+ * I/O wait in the time of the tasks. The pool never grows while the
+ * process keeps all its CPUs busy. Called by the worker itself.
+ */
+static void finish_task(ws_pool_t *pool, int worker) {
+    ws_clock_t *clock = &pool->clocks[worker];
+    struct timespec wall, cpu;
+    struct rusage usage;
+
+    clock->busy = false;
+    clock_gettime(CLOCK_MONOTONIC, &wall);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+    getrusage(RUSAGE_THREAD, &usage);
+    long wall_ns = elapsed_ns(&clock->wall, &wall);
+    long off_cpu_ns = wall_ns - elapsed_ns(&clock->cpu, &cpu);
+    atomic_fetch_add(&pool->wall_ns, wall_ns);
+    if (usage.ru_nvcsw > clock->sleeps && off_cpu_ns > 0)
+        atomic_fetch_add(&pool->io_ns, off_cpu_ns);
+    // Only the worker finishing the last task of the round adjusts
+    if (atomic_fetch_add(&pool->tasks_timed, 1) + 1 != ADAPT_TASKS)
+        return;
+    atomic_fetch_sub(&pool->tasks_timed, ADAPT_TASKS);
+    double round_wall_ns = atomic_exchange(&pool->wall_ns, 0);
+    double io_ns = atomic_exchange(&pool->io_ns, 0);
+    int num_active = atomic_load(&pool->num_active);
+
+    struct timespec round_wall = pool->round_wall, round_cpu = pool->round_cpu;
+    clock_gettime(CLOCK_MONOTONIC, &pool->round_wall);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &pool->round_cpu);
+    double round_ns = elapsed_ns(&round_wall, &pool->round_wall);
+    double busy_cpus = elapsed_ns(&round_cpu, &pool->round_cpu) / (round_ns > 0 ? round_ns : 1);
+    bool saturated = busy_cpus > CPU_BOUND * pool->min_active;
+
+    if (round_wall_ns <= 0)
+        return;
+    if (io_ns > IO_BOUND * round_wall_ns && !saturated && num_active < pool->num_workers)
+        atomic_store(&pool->num_active, num_active + 1);
+    else if ((io_ns < (1 - CPU_BOUND) * round_wall_ns || saturated) && num_active > pool->min_active)
+        atomic_store(&pool->num_active, num_active - 1);
+}
+
+static void start_task(ws_pool_t *pool, int worker) {
+    ws_clock_t *clock = &pool->clocks[worker];
+    struct rusage usage;
+    clock->busy = true;
+    getrusage(RUSAGE_THREAD, &usage);
+    clock->sleeps = usage.ru_nvcsw;
+    clock_gettime(CLOCK_MONOTONIC, &clock->wall);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &clock->cpu);
+}
+
+/**
+ * @brief Adds a task into the pool. The tasks are spread over the
+ * deques of the active workers in turn. Any thread may push.
+ *
+ * @param pool the pool supplied from the user
+ * @param elem the task to add
+ */
+void ws_pool_push(ws_pool_t *pool, void *elem) {
+    unsigned int next = atomic_fetch_add(&pool->next_push, 1);
+    lf_queue_t *deque = pool->deques[next % atomic_load(&pool->num_active)];
+
+    atomic_fetch_add(&pool->unfinished, 1);
+    atomic_fetch_add(&pool->size, 1);
+    lf_queue_insert_back(deque, elem);
+    // The worker parks after it counts itself, then checks the size again
+    if (atomic_load(&pool->parked) > 0) {
+        pthread_mutex_lock(&pool->mutex);
+        pthread_cond_signal(&pool->work);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+}
+
+/**
+ * @brief Adds a task into the pool like ws_pool_push, but first waits
+ * while the pool holds its capacity of tasks, until the workers have
+ * taken half of them. Only the producers from outside should wait, a
+ * worker waiting for room could wait for itself.
+ *
+ * @param pool the pool supplied from the user
+ * @param elem the task to add
+ */
+void ws_pool_push_wait(ws_pool_t *pool, void *elem) {
+    if (pool->capacity > 0 && atomic_load(&pool->size) >= pool->capacity) {
+        pthread_mutex_lock(&pool->mutex);
+        atomic_fetch_add(&pool->blocked, 1);
+        while (atomic_load(&pool->size) > pool->capacity / 2)
+            pthread_cond_wait(&pool->room, &pool->mutex);
+        atomic_fetch_sub(&pool->blocked, 1);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+    ws_pool_push(pool, elem);
+}
+
+/**
+ * @brief Moves half of the tasks of the victim, the oldest ones, into the
+ * deque of the thief and returns one of them.
+ */
+static void *steal(ws_pool_t *pool, int thief, int victim) {
+    lf_queue_t *from = pool->deques[victim];
+    lf_queue_t *to = pool->deques[thief];
+    void *elem;
+
+    if ((elem = lf_queue_remove_front(from)) == NULL)
+        return NULL;
+    size_t num = lf_queue_size(from) / 2;
+    if (num > STEAL_MAX)
+        num = STEAL_MAX;
+    for (size_t i = 0; i < num; i++) {
+        void *other = lf_queue_remove_front(from);
+        if (other == NULL)
+            break;
+        lf_queue_insert_back(to, other);
+    }
+    return elem;
+}
+
+/**
+ * @brief Takes a task for a worker: the oldest task of its own deque, or
+ * a task stolen from another worker if its deque is empty. An inactive
+ * worker gets no task, its deque is emptied by the others. In the
+ * adaptive mode this also ends the timing of the previous task of the
+ * worker, so a worker should call it as soon as a task is done.
+ *
+ * @param pool the pool supplied from the user
+ * @param worker the index of the worker, from 0 to num_workers - 1
+ * @return a task, or NULL if no task was found
+ */
+void *ws_pool_pop(ws_pool_t *pool, int worker) {
+    void *elem;
+
+    if (pool->adaptive && pool->clocks[worker].busy)
+        finish_task(pool, worker);
+    if (atomic_load(&pool->size) == 0 || worker >= atomic_load(&pool->num_active))
+        return NULL;
+
+    elem = lf_queue_remove_front(pool->deques[worker]);
+    for (int i = 1; elem == NULL && i < pool->num_workers; i++)
+        elem = steal(pool, worker, (worker + i) % pool->num_workers);
+
+    if (elem != NULL) {
+        long size = atomic_fetch_sub(&pool->size, 1) - 1;
+        if (pool->adaptive)
+            start_task(pool, worker);
+        if (atomic_load(&pool->blocked) > 0 && size <= pool->capacity / 2) {
+            pthread_mutex_lock(&pool->mutex);
+            pthread_cond_signal(&pool->room);
+            pthread_mutex_unlock(&pool->mutex);
+        }
+    }
+    return elem;
+}
+
+/**
+ * @brief Parks a worker which found no task, until a task is pushed or the
+ * pool is finished. It returns early if there may be a task already, so
+ * the worker should try ws_pool_pop again, and check ws_pool_finished to
+ * stop. An inactive worker only sleeps a little,
+ * since it may become active again.
+ *
+ * @param pool the pool supplied from the user
+ * @param worker the index of the worker, from 0 to num_workers - 1
+ */
+void ws_pool_wait(ws_pool_t *pool, int worker) {
+    if (worker >= atomic_load(&pool->num_active)) {
+        usleep(INACTIVE_SLEEP_US);
+        return;
+    }
+    pthread_mutex_lock(&pool->mutex);
+    atomic_fetch_add(&pool->parked, 1);
+    while (atomic_load(&pool->size) == 0 && !ws_pool_finished(pool) &&
+           worker < atomic_load(&pool->num_active))
+        pthread_cond_wait(&pool->work, &pool->mutex);
+    atomic_fetch_sub(&pool->parked, 1);
+    // A worker made inactive meanwhile leaves its task to another one
+    if (worker >= atomic_load(&pool->num_active) && atomic_load(&pool->size) > 0)
+        pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+/**
+ * @brief Tells the pool that no more tasks will be pushed from outside,
+ * and wakes up all the parked workers. The workers may still push.
+ *
+ * @param pool the pool supplied from the user
+ */
+void ws_pool_close(ws_pool_t *pool) {
+    pthread_mutex_lock(&pool->mutex);
+    atomic_store(&pool->closed, true);
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+/**
+ * @brief Tells the pool that a task taken by a worker is done, with the
+ * tasks it pushed pushed already. The workers parked when the last task
+ * is done are woken up to stop.
+ *
+ * @param pool the pool supplied from the user
+ */
+void ws_pool_done(ws_pool_t *pool) {
+    // The worker parks after it checks under the lock, closing wakes it too
+    if (atomic_fetch_sub(&pool->unfinished, 1) == 1 && atomic_load(&pool->closed)) {
+        pthread_mutex_lock(&pool->mutex);
+        pthread_cond_broadcast(&pool->work);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+}
+
+/**
+ * @brief Tells whether the pool is closed and every task pushed is done,
+ * so no task can come anymore and the workers may stop.
+ *
+ * @param pool the pool supplied from the user
+ * @return true if the pool is finished
+ */
+bool ws_pool_finished(ws_pool_t *pool) {
+    return atomic_load(&pool->closed) && atomic_load(&pool->unfinished) == 0;
+}
+
+/**
+ * @brief Checks whether there is no task left in the pool, without
+ * taking any lock.
+ *
+ * @param pool the pool supplied from the user
+ * @return true if the pool is empty
+ */
+bool ws_pool_empty(ws_pool_t *pool) {
+    return atomic_load(&pool->size) == 0;
+}
+
+/**
+ * @brief Frees the pool. The tasks left in it are not freed.
+ *
+ * @param pool the pool supplied from the user
+ */
+void ws_pool_free(ws_pool_t *pool) {
+    for (int i = 0; i < pool->num_workers; i++)
+        lf_queue_free(pool->deques[i], NULL);
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->room);
+    free(pool->deques);
+    free(pool->clocks);
+    free(pool);
+}
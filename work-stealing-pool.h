@@ -0,0 +1,23 @@
+#ifndef WORK_STEALING_POOL_INCLUDED
+#define WORK_STEALING_POOL_INCLUDED
+
+#include <stdbool.h>
+
+typedef struct ws_pool ws_pool_t;
+
+int ws_pool_num_cpus(void);
+ws_pool_t *ws_pool_new(int num_workers);
+void ws_pool_set_adaptive(ws_pool_t *pool, int min_active);
+void ws_pool_set_capacity(ws_pool_t *pool, long capacity);
+int ws_pool_active(ws_pool_t *pool);
+void ws_pool_push(ws_pool_t *pool, void *elem);
+void ws_pool_push_wait(ws_pool_t *pool, void *elem);
+void *ws_pool_pop(ws_pool_t *pool, int worker);
+void ws_pool_wait(ws_pool_t *pool, int worker);
+void ws_pool_close(ws_pool_t *pool);
+void ws_pool_done(ws_pool_t *pool);
+bool ws_pool_finished(ws_pool_t *pool);
+bool ws_pool_empty(ws_pool_t *pool);
+void ws_pool_free(ws_pool_t *pool);
+
+#endif